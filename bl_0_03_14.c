@@ -81,6 +81,11 @@ int      NAKED is_wifi_only()
 long int NAKED strtol(const char* str, char** endptr, int base)                                            { ASM_THUMB_B(0x1798A8); }
 void     toggle_vibrator(int state)                                                                        { ASM_THUMB_B(0x10C678); }
 
+/* Tegra TIMERUS counter (TMRUS_CNTR_1US) */
+#define TIMERUS_CNTR_1US 0x60005010
+
+uint32_t get_timer_us()                                                                                    { return *(volatile uint32_t*)TIMERUS_CNTR_1US; }
+
 /*
  * Fastboot
  */
@@ -0,0 +1,734 @@
+/*
+ * Acer bootloader boot menu application raw block device access
+ *
+ * Copyright (C) 2013 Skrilax_CZ
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "bl_0_03_14.h"
+#include "mystdlib.h"
+#include "blockdev.h"
+#include "iostats.h"
+
+/* MBR / EBR */
+#define BLOCKDEV_MBR_SIGNATURE    0xAA55
+#define BLOCKDEV_MBR_TABLE        0x1BE
+#define BLOCKDEV_MBR_ENTRIES      4
+#define BLOCKDEV_MBR_ENTRY_SIZE   16
+#define BLOCKDEV_MBR_TYPE_GPT     0xEE
+
+/* Longest EBR chain followed */
+#define BLOCKDEV_MAX_LOGICAL      32
+
+/* GPT */
+#define BLOCKDEV_GPT_SIGNATURE    "EFI PART"
+#define BLOCKDEV_GPT_MAX_ENTRIES  128
+
+/* Partitions found in the partition table */
+#define BLOCKDEV_MAX_PARTITIONS   (BLOCKDEV_MBR_ENTRIES + BLOCKDEV_MAX_LOGICAL)
+
+/* BL partitions located so far */
+#define BLOCKDEV_MAX_RESOLVED     8
+
+/* Largest single read command */
+#define BLOCKDEV_MAX_SECTORS      256
+
+/* Bounce buffer for partial sectors and destinations the DMA can't take */
+#define BLOCKDEV_BOUNCE_SECTORS   32
+#define BLOCKDEV_DMA_ALIGN        32
+
+/* Sectors compared with the partition API to confirm where a partition is */
+#define BLOCKDEV_VERIFY_SECTORS   8
+
+/*
+ * SD card sector cache: reads smaller than a line are served from lines filled
+ * with one aligned command, so neighbouring metadata reads cost one command.
+ */
+#define BLOCKDEV_SD_CACHE_LINES   8
+#define BLOCKDEV_SD_LINE_SECTORS  64
+
+/* A partition in the partition table */
+struct blockdev_part
+{
+	uint32_t number;
+	uint32_t start;
+	uint32_t sectors;
+};
+
+/* A BL partition, sectors 0 if it is not on the eMMC */
+struct blockdev_resolved
+{
+	char partition[8];
+	uint32_t start;
+	uint32_t sectors;
+};
+
+/* A run of sectors kept in the cache */
+struct blockdev_cache_line
+{
+	uint32_t start;
+	uint32_t count;        /* 0 for an unused line */
+	uint32_t last_used;
+	char* buf;
+};
+
+/* A disk, open while any partition on it is */
+struct blockdev_disk
+{
+	const char* name;
+	int major;
+	int removable;
+	int cache_lines;
+	int stream;            /* IOSTATS_ stream of the reads */
+
+	int (*open)(int major, int minor, int** handle);
+	int (*close)(int* handle);
+	int (*read_sector)(int* handle, uint32_t sector, void* buffer, uint32_t num_sectors);
+
+	int* handle;
+	int refs;
+	char* mem;
+	char* bounce;
+	uint32_t next_sector;  /* where the last read stopped */
+
+	/* Partition table (num_parts -1 = not read yet) */
+	struct blockdev_part parts[BLOCKDEV_MAX_PARTITIONS];
+	int num_parts;
+
+	/* Sector cache (LRU) */
+	struct blockdev_cache_line cache[BLOCKDEV_SD_CACHE_LINES];
+	uint32_t cache_tick;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+};
+
+struct blockdev
+{
+	struct blockdev_disk* disk;
+	uint32_t start;
+	uint32_t sectors;
+};
+
+static struct blockdev_disk blockdev_emmc =
+{
+	.name = "eMMC",
+	.major = HSMMC_MAJOR,
+	.removable = 0,
+	.cache_lines = 0,
+	.stream = IOSTATS_EMMC_READ,
+	.open = &hsmmc_open,
+	.close = &hsmmc_close,
+	.read_sector = &hsmmc_read_sector,
+	.num_parts = -1,
+};
+
+static struct blockdev_disk blockdev_sd =
+{
+	.name = "SD",
+	.major = SD_CARD_MAJOR,
+	.removable = 1,
+	.cache_lines = BLOCKDEV_SD_CACHE_LINES,
+	.stream = IOSTATS_SD_READ,
+	.open = &sd_open,
+	.close = &sd_close,
+	.read_sector = &sd_read_sector,
+	.num_parts = -1,
+};
+
+static struct blockdev_resolved blockdev_resolved[BLOCKDEV_MAX_RESOLVED];
+static int blockdev_num_resolved = 0;
+
+static uint32_t blockdev_le32(const unsigned char* ptr)
+{
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static int blockdev_is_extended(unsigned char type)
+{
+	return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+/* Sector read command with accounting */
+static int blockdev_read_disk(struct blockdev_disk* disk, uint32_t sector, void* buffer, uint32_t num_sectors)
+{
+	uint32_t start_us = get_timer_us();
+	int ret;
+
+	ret = disk->read_sector(disk->handle, sector, buffer, num_sectors);
+	iostats_add(disk->stream, num_sectors << BLOCKDEV_SECTOR_BITS, sector != disk->next_sector, start_us);
+
+	disk->next_sector = sector + num_sectors;
+	return ret;
+}
+
+static int blockdev_disk_open(struct blockdev_disk* disk)
+{
+	uint32_t size;
+	int i;
+
+	if (disk->refs > 0)
+	{
+		disk->refs++;
+		return 0;
+	}
+
+	/* Bounce buffer and cache lines, all DMA aligned */
+	size = (BLOCKDEV_BOUNCE_SECTORS + disk->cache_lines * BLOCKDEV_SD_LINE_SECTORS) * BLOCKDEV_SECTOR_SIZE;
+
+	disk->mem = malloc(size + BLOCKDEV_DMA_ALIGN);
+	if (!disk->mem)
+		return 1;
+
+	disk->bounce = (char*)(((unsigned long)disk->mem + BLOCKDEV_DMA_ALIGN - 1) & ~(unsigned long)(BLOCKDEV_DMA_ALIGN - 1));
+
+	for (i = 0; i < disk->cache_lines; i++)
+	{
+		disk->cache[i].buf = disk->bounce + (BLOCKDEV_BOUNCE_SECTORS + i * BLOCKDEV_SD_LINE_SECTORS) * BLOCKDEV_SECTOR_SIZE;
+		disk->cache[i].count = 0;
+	}
+
+	if (disk->open(disk->major, 0, &disk->handle))
+	{
+		printf("BLOCKDEV: cannot open %s\n", disk->name);
+		free(disk->mem);
+		disk->mem = NULL;
+		return 1;
+	}
+
+	disk->refs = 1;
+	return 0;
+}
+
+static void blockdev_disk_close(struct blockdev_disk* disk)
+{
+	if (--disk->refs > 0)
+		return;
+
+	if (disk->cache_lines)
+		printf("BLOCKDEV: %s cache %d hits, %d misses\n", disk->name, disk->cache_hits, disk->cache_misses);
+
+	disk->close(disk->handle);
+	free(disk->mem);
+	disk->mem = NULL;
+	disk->bounce = NULL;
+	disk->handle = NULL;
+
+	/* The card may get swapped */
+	if (disk->removable)
+		disk->num_parts = -1;
+}
+
+static void blockdev_add_part(struct blockdev_disk* disk, uint32_t number, uint32_t start, uint32_t sectors)
+{
+	if (disk->num_parts >= BLOCKDEV_MAX_PARTITIONS)
+		return;
+
+	disk->parts[disk->num_parts].number = number;
+	disk->parts[disk->num_parts].start = start;
+	disk->parts[disk->num_parts].sectors = sectors;
+	disk->num_parts++;
+}
+
+/* Partitions of a GPT disk, numbered by their entry, those beyond 2 TiB are left out */
+static void blockdev_scan_gpt(struct blockdev_disk* disk)
+{
+	unsigned char* sector = (unsigned char*)disk->bounce;
+	unsigned char* entry;
+	uint32_t entries_lba, num_entries, entry_size, per_sector, loaded, count, i;
+	int j, used;
+
+	if (blockdev_read_disk(disk, 1, sector, 1))
+		return;
+
+	if (memcmp(sector, BLOCKDEV_GPT_SIGNATURE, 8) || blockdev_le32(sector + 76))
+		return;
+
+	entries_lba = blockdev_le32(sector + 72);
+	num_entries = blockdev_le32(sector + 80);
+	entry_size = blockdev_le32(sector + 84);
+
+	if (entry_size < 128 || entry_size > BLOCKDEV_SECTOR_SIZE || (BLOCKDEV_SECTOR_SIZE % entry_size))
+		return;
+
+	if (num_entries > BLOCKDEV_GPT_MAX_ENTRIES)
+		num_entries = BLOCKDEV_GPT_MAX_ENTRIES;
+
+	/* The entries are read a bounce buffer at a time */
+	per_sector = BLOCKDEV_SECTOR_SIZE / entry_size;
+	loaded = 0;
+
+	for (i = 0; i < num_entries; i++)
+	{
+		if (i == loaded)
+		{
+			count = (num_entries - i + per_sector - 1) / per_sector;
+			if (count > BLOCKDEV_BOUNCE_SECTORS)
+				count = BLOCKDEV_BOUNCE_SECTORS;
+
+			if (blockdev_read_disk(disk, entries_lba + i / per_sector, sector, count))
+				return;
+
+			loaded = i + count * per_sector;
+		}
+
+		entry = sector + (i % (BLOCKDEV_BOUNCE_SECTORS * per_sector)) * entry_size;
+
+		/* Unused entries have a zero type GUID */
+		used = 0;
+		for (j = 0; j < 16; j++)
+			used |= entry[j];
+
+		if (!used || blockdev_le32(entry + 36) || blockdev_le32(entry + 44))
+			continue;
+
+		if (blockdev_le32(entry + 40) >= blockdev_le32(entry + 32))
+			blockdev_add_part(disk, i + 1, blockdev_le32(entry + 32), blockdev_le32(entry + 40) - blockdev_le32(entry + 32) + 1);
+	}
+}
+
+/*
+ * Read the partition table: MBR with the EBR chain (primary partitions numbered
+ * by their slot, logical ones from 5) or GPT behind a protective MBR.
+ */
+static void blockdev_scan(struct blockdev_disk* disk)
+{
+	unsigned char* sector = (unsigned char*)disk->bounce;
+	unsigned char* entry;
+	uint32_t ext_start, ebr;
+	int i, number;
+
+	disk->num_parts = 0;
+
+	if (blockdev_read_disk(disk, 0, sector, 1))
+		return;
+
+	if ((sector[510] | (sector[511] << 8)) != BLOCKDEV_MBR_SIGNATURE)
+		return;
+
+	if (sector[BLOCKDEV_MBR_TABLE + 4] == BLOCKDEV_MBR_TYPE_GPT)
+	{
+		blockdev_scan_gpt(disk);
+		return;
+	}
+
+	ext_start = 0;
+	for (i = 0; i < BLOCKDEV_MBR_ENTRIES; i++)
+	{
+		entry = sector + BLOCKDEV_MBR_TABLE + i * BLOCKDEV_MBR_ENTRY_SIZE;
+
+		if (!entry[4] || !blockdev_le32(entry + 12))
+			continue;
+
+		if (blockdev_is_extended(entry[4]))
+		{
+			if (!ext_start)
+				ext_start = blockdev_le32(entry + 8);
+		}
+		else
+			blockdev_add_part(disk, i + 1, blockdev_le32(entry + 8), blockdev_le32(entry + 12));
+	}
+
+	/* The second entry of an EBR links the next one (relative to the extended partition) */
+	ebr = ext_start;
+	number = BLOCKDEV_MBR_ENTRIES + 1;
+
+	for (i = 0; ebr && i < BLOCKDEV_MAX_LOGICAL; i++)
+	{
+		if (blockdev_read_disk(disk, ebr, sector, 1))
+			break;
+
+		if ((sector[510] | (sector[511] << 8)) != BLOCKDEV_MBR_SIGNATURE)
+			break;
+
+		entry = sector + BLOCKDEV_MBR_TABLE;
+		if (entry[4] && blockdev_le32(entry + 12))
+			blockdev_add_part(disk, number++, ebr + blockdev_le32(entry + 8), blockdev_le32(entry + 12));
+
+		entry += BLOCKDEV_MBR_ENTRY_SIZE;
+		if (blockdev_is_extended(entry[4]) && blockdev_le32(entry + 8))
+			ebr = ext_start + blockdev_le32(entry + 8);
+		else
+			ebr = 0;
+	}
+}
+
+/*
+ * Find the partition table entry of a BL partition: it must have the same size
+ * and the same first sectors as read through the partition API. Returns the
+ * number of sectors (0 if there isn't exactly one such entry).
+ */
+static uint32_t blockdev_locate(struct blockdev_disk* disk, const char* partition, uint64_t size, uint32_t* start)
+{
+	uint32_t processed_bytes, verify_len, found;
+	char* reference;
+	int pt_handle, i, matches;
+
+	verify_len = BLOCKDEV_VERIFY_SECTORS * BLOCKDEV_SECTOR_SIZE;
+	if (size < verify_len)
+		verify_len = (uint32_t)size & ~(BLOCKDEV_SECTOR_SIZE - 1);
+
+	if (!verify_len)
+		return 0;
+
+	reference = malloc(verify_len);
+	if (!reference)
+		return 0;
+
+	if (open_partition(partition, PARTITION_OPEN_READ, &pt_handle))
+	{
+		free(reference);
+		return 0;
+	}
+
+	if (iostats_read_partition(pt_handle, reference, verify_len, &processed_bytes) || processed_bytes != verify_len)
+	{
+		close_partition(pt_handle);
+		free(reference);
+		return 0;
+	}
+
+	close_partition(pt_handle);
+
+	found = 0;
+	matches = 0;
+	for (i = 0; i < disk->num_parts; i++)
+	{
+		if (((uint64_t)disk->parts[i].sectors << BLOCKDEV_SECTOR_BITS) != size)
+			continue;
+
+		if (blockdev_read_disk(disk, disk->parts[i].start, disk->bounce, verify_len >> BLOCKDEV_SECTOR_BITS))
+			continue;
+
+		if (memcmp(disk->bounce, reference, verify_len))
+			continue;
+
+		*start = disk->parts[i].start;
+		found = disk->parts[i].sectors;
+		matches++;
+	}
+
+	free(reference);
+
+	if (matches != 1)
+		return 0;
+
+	return found;
+}
+
+/* Look up (or locate) where a BL partition is, 0 sectors if it isn't on the eMMC */
+static struct blockdev_resolved* blockdev_resolve(struct blockdev_disk* disk, const char* partition, uint64_t size)
+{
+	struct blockdev_resolved* res;
+	int i;
+
+	for (i = 0; i < blockdev_num_resolved; i++)
+	{
+		if (!strcmp(blockdev_resolved[i].partition, partition))
+			return &blockdev_resolved[i];
+	}
+
+	if (disk->num_parts < 0)
+		blockdev_scan(disk);
+
+	/* Out of slots, locate it every time */
+	if (blockdev_num_resolved < BLOCKDEV_MAX_RESOLVED)
+		res = &blockdev_resolved[blockdev_num_resolved++];
+	else
+		res = &blockdev_resolved[BLOCKDEV_MAX_RESOLVED - 1];
+
+	strncpy(res->partition, partition, ARRAY_SIZE(res->partition));
+	res->partition[ARRAY_SIZE(res->partition) - 1] = '\0';
+	res->start = 0;
+	res->sectors = blockdev_locate(disk, partition, size, &res->start);
+
+	if (res->sectors)
+		printf("BLOCKDEV: %s at sector %u (%u sectors)\n", partition, res->start, res->sectors);
+	else
+		printf("BLOCKDEV: %s not found in the eMMC partition table\n", partition);
+
+	return res;
+}
+
+/* SD card partition number of partition, 0 if it is a BL partition */
+int blockdev_sd_partition(const char* partition)
+{
+	const char* ptr;
+	int number;
+
+	if (strncmp(partition, BLOCKDEV_SD_PREFIX, strlen(BLOCKDEV_SD_PREFIX)))
+		return 0;
+
+	ptr = partition + strlen(BLOCKDEV_SD_PREFIX);
+	if (*ptr < '1' || *ptr > '9')
+		return 0;
+
+	number = 0;
+	while (*ptr >= '0' && *ptr <= '9')
+		number = number * 10 + (*ptr++ - '0');
+
+	if (*ptr != '\0')
+		return 0;
+
+	return number;
+}
+
+/*
+ * Open partition, NULL if it can't be found. A BL partition must have the
+ * given size, for an SD card partition size is ignored.
+ */
+struct blockdev* blockdev_open(const char* partition, uint64_t size)
+{
+	struct blockdev_disk* disk;
+	struct blockdev_resolved* res;
+	struct blockdev* dev;
+	uint32_t start, sectors;
+	int number, i;
+
+	number = blockdev_sd_partition(partition);
+	disk = number ? &blockdev_sd : &blockdev_emmc;
+	start = 0;
+
+	if (blockdev_disk_open(disk))
+		return NULL;
+
+	if (number)
+	{
+		if (disk->num_parts < 0)
+			blockdev_scan(disk);
+
+		sectors = 0;
+		for (i = 0; i < disk->num_parts; i++)
+		{
+			if (disk->parts[i].number == (uint32_t)number)
+			{
+				start = disk->parts[i].start;
+				sectors = disk->parts[i].sectors;
+			}
+		}
+
+		if (!sectors)
+			printf("BLOCKDEV: %s not found in the SD card partition table\n", partition);
+	}
+	else
+	{
+		res = blockdev_resolve(disk, partition, size);
+		start = res->start;
+		sectors = res->sectors;
+
+		if (((uint64_t)sectors << BLOCKDEV_SECTOR_BITS) != size)
+			sectors = 0;
+	}
+
+	if (!sectors)
+	{
+		blockdev_disk_close(disk);
+		return NULL;
+	}
+
+	dev = malloc(sizeof(struct blockdev));
+	if (!dev)
+	{
+		blockdev_disk_close(disk);
+		return NULL;
+	}
+
+	dev->disk = disk;
+	dev->start = start;
+	dev->sectors = sectors;
+	return dev;
+}
+
+/* Size of the partition in bytes */
+uint64_t blockdev_size(struct blockdev* dev)
+{
+	return (uint64_t)dev->sectors << BLOCKDEV_SECTOR_BITS;
+}
+
+/* Overlapping copy to a lower address */
+static void blockdev_move_down(char* dest, const char* src, uint32_t len)
+{
+	while (len--)
+		*dest++ = *src++;
+}
+
+/*
+ * Whole sectors into dest with as few commands as possible. If the DMA can't
+ * take dest, short reads go through the bounce buffer, longer ones are read to
+ * the next aligned address within dest (all but the last sector) and moved down.
+ */
+static int blockdev_read_sectors(struct blockdev_disk* disk, uint32_t sector, uint32_t count, char* dest)
+{
+	uint32_t n, shift;
+
+	while (count > 0)
+	{
+		shift = (unsigned long)dest & (BLOCKDEV_DMA_ALIGN - 1);
+
+		if (!shift)
+		{
+			n = count > BLOCKDEV_MAX_SECTORS ? BLOCKDEV_MAX_SECTORS : count;
+
+			if (blockdev_read_disk(disk, sector, dest, n))
+				return 1;
+		}
+		else if (count > BLOCKDEV_BOUNCE_SECTORS)
+		{
+			shift = BLOCKDEV_DMA_ALIGN - shift;
+			n = count - 1 > BLOCKDEV_MAX_SECTORS ? BLOCKDEV_MAX_SECTORS : count - 1;
+
+			if (blockdev_read_disk(disk, sector, dest + shift, n))
+				return 1;
+
+			blockdev_move_down(dest, dest + shift, n << BLOCKDEV_SECTOR_BITS);
+		}
+		else
+		{
+			n = count;
+
+			if (blockdev_read_disk(disk, sector, disk->bounce, n))
+				return 1;
+
+			memcpy(dest, disk->bounce, n << BLOCKDEV_SECTOR_BITS);
+		}
+
+		dest += n << BLOCKDEV_SECTOR_BITS;
+		sector += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/* Cache line holding sector of the partition, filled (within the partition) on a miss */
+static struct blockdev_cache_line* blockdev_cache_get(struct blockdev* dev, uint32_t sector)
+{
+	struct blockdev_disk* disk = dev->disk;
+	struct blockdev_cache_line* line;
+	uint32_t start, end;
+	int i;
+
+	line = NULL;
+	for (i = 0; i < disk->cache_lines; i++)
+	{
+		if (disk->cache[i].count && sector >= disk->cache[i].start && sector < disk->cache[i].start + disk->cache[i].count)
+		{
+			disk->cache_hits++;
+			iostats_hit(IOSTATS_CACHE_SD);
+			disk->cache[i].last_used = ++disk->cache_tick;
+			return &disk->cache[i];
+		}
+
+		if (line == NULL || disk->cache[i].last_used < line->last_used)
+			line = &disk->cache[i];
+	}
+
+	disk->cache_misses++;
+	iostats_miss(IOSTATS_CACHE_SD);
+
+	start = sector & ~(BLOCKDEV_SD_LINE_SECTORS - 1);
+	end = start + BLOCKDEV_SD_LINE_SECTORS;
+
+	if (start < dev->start)
+		start = dev->start;
+
+	if (end > dev->start + dev->sectors)
+		end = dev->start + dev->sectors;
+
+	line->count = 0;
+	if (blockdev_read_disk(disk, start, line->buf, end - start))
+		return NULL;
+
+	line->start = start;
+	line->count = end - start;
+	line->last_used = ++disk->cache_tick;
+	return line;
+}
+
+/*
+ * Read len bytes at byte offset pos of the partition, 0 on success. Whole sectors
+ * go straight into buf with as few commands as possible. Partial sectors at either
+ * end go through the bounce buffer, or on a cached disk (as do all reads smaller
+ * than a cache line) through the cache.
+ */
+int blockdev_read(struct blockdev* dev, uint64_t pos, uint32_t len, void* buf)
+{
+	struct blockdev_disk* disk = dev->disk;
+	struct blockdev_cache_line* line;
+	uint32_t sector, offset, count, chunk;
+	char* dest = buf;
+	char* src;
+
+	if (pos + len > ((uint64_t)dev->sectors << BLOCKDEV_SECTOR_BITS))
+		return 1;
+
+	sector = dev->start + (uint32_t)(pos >> BLOCKDEV_SECTOR_BITS);
+	offset = (uint32_t)pos & (BLOCKDEV_SECTOR_SIZE - 1);
+
+	while (len > 0)
+	{
+		if (!offset && len >= BLOCKDEV_SECTOR_SIZE &&
+		    (!disk->cache_lines || len >= BLOCKDEV_SD_LINE_SECTORS * BLOCKDEV_SECTOR_SIZE))
+		{
+			count = len >> BLOCKDEV_SECTOR_BITS;
+
+			if (blockdev_read_sectors(disk, sector, count, dest))
+				return 1;
+
+			dest += count << BLOCKDEV_SECTOR_BITS;
+			len -= count << BLOCKDEV_SECTOR_BITS;
+			sector += count;
+			continue;
+		}
+
+		if (disk->cache_lines)
+		{
+			line = blockdev_cache_get(dev, sector);
+			if (!line)
+				return 1;
+
+			src = line->buf + ((sector - line->start) << BLOCKDEV_SECTOR_BITS) + offset;
+			chunk = ((line->start + line->count - sector) << BLOCKDEV_SECTOR_BITS) - offset;
+		}
+		else
+		{
+			if (blockdev_read_disk(disk, sector, disk->bounce, 1))
+				return 1;
+
+			src = disk->bounce + offset;
+			chunk = BLOCKDEV_SECTOR_SIZE - offset;
+		}
+
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(dest, src, chunk);
+		dest += chunk;
+		len -= chunk;
+
+		offset += chunk;
+		sector += offset >> BLOCKDEV_SECTOR_BITS;
+		offset &= BLOCKDEV_SECTOR_SIZE - 1;
+	}
+
+	return 0;
+}
+
+void blockdev_close(struct blockdev* dev)
+{
+	blockdev_disk_close(dev->disk);
+	free(dev);
+}
@@ -25,73 +25,77 @@
 
 #define PAGE_SIZE 2048
 
-int create_android_image(struct boot_img_hdr** bootimg, int* bootimg_size, const char* kernel, int kernel_size, const char* ramdisk, int ramdisk_size)
+/* Round up to whole pages */
+#define PAGE_ALIGN(size) (((size) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+int alloc_android_image(struct boot_img_hdr** bootimg, int* bootimg_size, char** kernel, int kernel_size, char** ramdisk, int ramdisk_size)
 {
-	struct boot_img_hdr hdr;
+	struct boot_img_hdr* hdr;
 	char* bootimg_data;
-	int padsize;
+	int header_len, kernel_len, ramdisk_len; /* page aligned, in bytes */
 
 	/* Check */
-	if (!kernel || kernel_size == 0)
+	if (kernel_size <= 0 || ramdisk_size < 0)
 		return 1;
 
-	if (!ramdisk)
-		ramdisk_size = 0;
-
-	/* Init */
-	memset(&hdr, 0, sizeof(hdr));
-
-	/* Magic */
-	memcpy(&hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
-
-	/* Ignore load addresses (bootloader will only care about the second ramdisk address, but we don't use that) */
-	hdr.page_size    = PAGE_SIZE;
-	hdr.kernel_size  = kernel_size;
-	hdr.ramdisk_size = ramdisk_size;
+	header_len = PAGE_ALIGN(sizeof(struct boot_img_hdr));
+	kernel_len = PAGE_ALIGN(kernel_size);
+	ramdisk_len = PAGE_ALIGN(ramdisk_size);
 
 	/* Total size */
-	*bootimg_size = ((sizeof(struct boot_img_hdr) + hdr.page_size - 1) / hdr.page_size +
-	                (kernel_size + hdr.page_size - 1) / hdr.page_size +
-	                (ramdisk_size + hdr.page_size - 1) / hdr.page_size) * hdr.page_size;
+	*bootimg_size = header_len + kernel_len + ramdisk_len;
 
-	*bootimg = malloc(*bootimg_size);
-	bootimg_data = (char*)(*bootimg);
+	bootimg_data = malloc(*bootimg_size);
+	if (!bootimg_data)
+		return 1;
 
 	/* Header */
-	memcpy(bootimg_data, (char*)&hdr, sizeof(struct boot_img_hdr));
-	bootimg_data += sizeof(struct boot_img_hdr);
+	memset(bootimg_data, 0, header_len);
+	hdr = (struct boot_img_hdr*)bootimg_data;
 
-	padsize = hdr.page_size - (sizeof(struct boot_img_hdr) & (hdr.page_size - 1));
-	if (padsize > 0)
-	{
-		memset(bootimg_data, 0, padsize);
-		bootimg_data += padsize;
-	}
+	/* Magic */
+	memcpy(&hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
 
-	/* Kernel */
-	memcpy(bootimg_data, kernel, kernel_size);
-	bootimg_data += kernel_size;
+	/* Ignore load addresses (bootloader will only care about the second ramdisk address, but we don't use that) */
+	hdr->page_size    = PAGE_SIZE;
+	hdr->kernel_size  = kernel_size;
+	hdr->ramdisk_size = ramdisk_size;
 
-	padsize = hdr.page_size - (kernel_size & (hdr.page_size - 1));
-	if (padsize > 0)
-	{
-		memset(bootimg_data, 0, padsize);
-		bootimg_data += padsize;
-	}
+	/* Kernel, the caller fills it, only the padding is cleared */
+	*kernel = bootimg_data + header_len;
+	memset(*kernel + kernel_size, 0, kernel_len - kernel_size);
 
 	/* Ramdisk if present */
 	if (ramdisk_size > 0)
 	{
-		memcpy(bootimg_data, ramdisk, ramdisk_size);
-		bootimg_data += ramdisk_size;
-
-		padsize = hdr.page_size - (ramdisk_size & (hdr.page_size - 1));
-		if (padsize > 0)
-		{
-			memset(bootimg_data, 0, padsize);
-			bootimg_data += padsize;
-		}
+		*ramdisk = *kernel + kernel_len;
+		memset(*ramdisk + ramdisk_size, 0, ramdisk_len - ramdisk_size);
 	}
+	else
+		*ramdisk = NULL;
+
+	*bootimg = hdr;
+	return 0;
+}
+
+int create_android_image(struct boot_img_hdr** bootimg, int* bootimg_size, const char* kernel, int kernel_size, const char* ramdisk, int ramdisk_size)
+{
+	char *kernel_data, *ramdisk_data;
+
+	/* Check */
+	if (!kernel || kernel_size == 0)
+		return 1;
+
+	if (!ramdisk)
+		ramdisk_size = 0;
+
+	if (alloc_android_image(bootimg, bootimg_size, &kernel_data, kernel_size, &ramdisk_data, ramdisk_size))
+		return 1;
+
+	memcpy(kernel_data, kernel, kernel_size);
+
+	if (ramdisk_size > 0)
+		memcpy(ramdisk_data, ramdisk, ramdisk_size);
 
 	return 0;
 }
@@ -20,17 +20,34 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <getopt.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include "bootmenu.h"
 
 #ifdef ANDROID
 #define MISC_PARTITION "/dev/block/mmcblk0p5"
+#define MMC_DEVICE     "/dev/block/mmcblk0p%d"
 #else
 #define MISC_PARTITION "/dev/mmcblk0p5"
+#define MMC_DEVICE     "/dev/mmcblk0p%d"
 #endif
 
+#define MAX_MOUNTS     8
+#define FIEMAP_EXTENTS 64
+
+/* Extents the bootloader can't read straight from the partition */
+#define FIEMAP_EXTENT_UNREADABLE (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED | \
+                                  FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED | \
+                                  FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL)
+
 struct option long_options[] =
 {
 	/* Get options */
@@ -45,6 +62,10 @@ struct option long_options[] =
 	{ "set-boot-image", required_argument, 0, 'I' },
 	{ "set-next-boot-image", required_argument, 0, 'N' },
 	{ "set-boot-file", required_argument, 0, 'F' },
+	/* Compiled menu */
+	{ "compile-menu", no_argument, 0, 'M' },
+	{ "mount", required_argument, 0, 'm' },
+	{ "misc-device", required_argument, 0, 'D' },
 	/* End */
 	{ 0, 0, 0, 0 }
 };
@@ -65,10 +86,18 @@ const char* desc_options[] =
 		"\tNOEXT4_OFF:      EXT4 boot allowed\n"
 		"\tNOEXT4_ON:       EXT4 boot forbidden\n"
 		"\tSHOW_FB_REC_ON:  Show fastboot / recovery on selection screen\n"
-		"\tSHOW_FB_REC_OFF: Hide fastboot / recovery on selection screen\n",
+		"\tSHOW_FB_REC_OFF: Hide fastboot / recovery on selection screen\n"
+		"\tRAW_IO_ON:       Read EXT4 straight from the eMMC\n"
+		"\tRAW_IO_OFF:      Read EXT4 through the bootloader partition API\n",
 	"Sets the default boot image",
 	"Sets the next boot image",
 	"Sets the default boot file (path in bootloader format).",
+	/* Compiled menu */
+	"Compiles the boot file with the physical location of the images it boots, so the\n"
+		"\tbootloader doesn't need to parse it. It's used as long as the files stay the same\n"
+		"\t(run sync afterwards).",
+	"Where a partition is mounted, PARTITION=DIR (default: looked up in /proc/mounts).",
+	"Misc partition device to use, must precede other options (default " MISC_PARTITION ").",
 	/* End */
 	NULL
 };
@@ -83,12 +112,47 @@ const char* allowed_partitions[] =
 	"UBN", /* custom */
 	"AKB", /* mmcblk0p7 */
 	"UDA", /* mmcblk0p8 */
+	"SD1", /* SD card */
+	"SD2", /* SD card */
+	"SD3", /* SD card */
+	"SD4", /* SD card */
 	NULL
 };
 
+/* Partitions with a fixed device (mmcblk0pN) */
+struct partition_device
+{
+	const char* name;
+	int number;
+};
+
+const struct partition_device partition_devices[] =
+{
+	{ "LNX", 1 },
+	{ "SOS", 2 },
+	{ "APP", 3 },
+	{ "CAC", 4 },
+	{ "FLX", 6 },
+	{ "AKB", 7 },
+	{ "UDA", 8 },
+	{ NULL,  0 }
+};
+
+/* Mount points given by --mount */
+struct partition_mount
+{
+	char name[8];
+	const char* dir;
+};
+
+struct partition_mount partition_mounts[MAX_MOUNTS];
+int num_partition_mounts = 0;
+
+const char* misc_partition = MISC_PARTITION;
+
 int read_msc_command(struct msc_command* cmd)
 {
-	FILE* f = fopen(MISC_PARTITION, "r");
+	FILE* f = fopen(misc_partition, "r");
 	if (f == NULL)
 		return 1;
 
@@ -101,7 +165,7 @@ int read_msc_command(struct msc_command* cmd)
 
 int write_msc_command(struct msc_command* cmd)
 {
-	FILE* f = fopen(MISC_PARTITION, "w");
+	FILE* f = fopen(misc_partition, "w");
 	if (f == NULL)
 		return 1;
 
@@ -131,6 +195,423 @@ void error(const char* reason)
 	}
 }
 
+/*
+ * Compiled menu
+ */
+
+/* Find the directory where the partition is mounted */
+int find_mount(const char* partition, char* dir, int dir_size, dev_t* dev)
+{
+	struct stat st;
+	char device[64];
+	char line[1024], mount_dir[512];
+	dev_t rdev;
+	FILE* f;
+	int i;
+
+	for (i = 0; i < num_partition_mounts; i++)
+	{
+		if (!strcmp(partition_mounts[i].name, partition))
+		{
+			if (stat(partition_mounts[i].dir, &st) || !S_ISDIR(st.st_mode))
+				return 1;
+
+			snprintf(dir, dir_size, "%s", partition_mounts[i].dir);
+			*dev = st.st_dev;
+			return 0;
+		}
+	}
+
+	for (i = 0; partition_devices[i].name; i++)
+	{
+		if (!strcmp(partition_devices[i].name, partition))
+			break;
+	}
+
+	if (!partition_devices[i].name)
+		return 1;
+
+	snprintf(device, sizeof(device), MMC_DEVICE, partition_devices[i].number);
+	if (stat(device, &st) || !S_ISBLK(st.st_mode))
+		return 1;
+
+	rdev = st.st_rdev;
+
+	/* The mount point is on the partition device */
+	f = fopen("/proc/mounts", "r");
+	if (f == NULL)
+		return 1;
+
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "%*s %511s", mount_dir) != 1)
+			continue;
+
+		if (!stat(mount_dir, &st) && S_ISDIR(st.st_mode) && st.st_dev == rdev)
+		{
+			snprintf(dir, dir_size, "%s", mount_dir);
+			*dev = rdev;
+			fclose(f);
+			return 0;
+		}
+	}
+
+	fclose(f);
+	return 1;
+}
+
+/* Inode of the file given in BL format, and its extents if extents is set */
+int map_file(const char* path, struct msc_menu_file* file, struct msc_menu_header* menu, uint32_t max_extents)
+{
+	struct msc_menu_extent* extents;
+	struct msc_menu_extent* last;
+	struct fiemap* fm;
+	struct fiemap_extent* fe;
+	struct stat st;
+	char partition[8], dir[512], local_path[1024];
+	const char* ptr;
+	unsigned int generation = 0;
+	uint64_t start, length;
+	dev_t dev;
+	uint32_t i;
+	int fd, l, ret = 1;
+
+	memset(file, 0, sizeof(struct msc_menu_file));
+
+	ptr = strchr(path, ':');
+	l = ((int)(ptr - path));
+
+	if (ptr == NULL || l > 4)
+	{
+		fprintf(stderr, "ERROR: Invalid path %s!\n", path);
+		return 1;
+	}
+
+	strncpy(partition, path, l);
+	partition[l] = '\0';
+
+	if (find_mount(partition, dir, sizeof(dir), &dev))
+	{
+		fprintf(stderr, "ERROR: Partition %s is not mounted (see --mount)!\n", partition);
+		return 1;
+	}
+
+	snprintf(local_path, sizeof(local_path), "%s%s", dir, ptr + 1);
+
+	fd = open(local_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+	{
+		fprintf(stderr, "ERROR: Cannot open %s!\n", local_path);
+		goto finish;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_dev != dev || st.st_size > 0xFFFFFFFFLL)
+	{
+		fprintf(stderr, "ERROR: %s is not a file on %s!\n", local_path, partition);
+		goto finish;
+	}
+
+	if (ioctl(fd, FS_IOC_GETVERSION, &generation))
+	{
+		fprintf(stderr, "ERROR: Cannot get generation of %s!\n", local_path);
+		goto finish;
+	}
+
+	fsync(fd);
+
+	file->ino = st.st_ino;
+	file->size = st.st_size;
+	file->mtime = st.st_mtime;
+	file->ctime = st.st_ctime;
+	file->generation = generation;
+
+	if (!menu)
+	{
+		ret = 0;
+		goto finish;
+	}
+
+	fm = malloc(sizeof(struct fiemap) + FIEMAP_EXTENTS * sizeof(struct fiemap_extent));
+	if (!fm)
+		goto finish;
+
+	extents = (struct msc_menu_extent*)((char*)menu + menu->extents_offset);
+	file->first_extent = menu->num_extents;
+	last = NULL;
+	start = 0;
+
+	while (start < file->size)
+	{
+		memset(fm, 0, sizeof(struct fiemap));
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET;
+		fm->fm_flags = FIEMAP_FLAG_SYNC;
+		fm->fm_extent_count = FIEMAP_EXTENTS;
+
+		if (ioctl(fd, FS_IOC_FIEMAP, fm))
+		{
+			fprintf(stderr, "ERROR: Cannot map %s!\n", local_path);
+			goto finish_fm;
+		}
+
+		if (fm->fm_mapped_extents == 0)
+			break;
+
+		for (i = 0; i < fm->fm_mapped_extents; i++)
+		{
+			fe = &fm->fm_extents[i];
+			start = fe->fe_logical + fe->fe_length;
+
+			if (fe->fe_logical >= file->size)
+				continue;
+
+			if (fe->fe_flags & FIEMAP_EXTENT_UNREADABLE)
+			{
+				fprintf(stderr, "ERROR: %s has extents the bootloader can't read!\n", local_path);
+				goto finish_fm;
+			}
+
+			length = fe->fe_length;
+			if (length > file->size - fe->fe_logical)
+				length = file->size - fe->fe_logical;
+
+			/* Continues the previous one */
+			if (last && last->logical + last->length == fe->fe_logical && last->physical + last->length == fe->fe_physical &&
+			    (last->flags != 0) == ((fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) != 0))
+			{
+				last->length += length;
+				continue;
+			}
+
+			if (menu->num_extents == max_extents)
+			{
+				fprintf(stderr, "ERROR: Too many extents (%s)!\n", local_path);
+				goto finish_fm;
+			}
+
+			last = &extents[menu->num_extents++];
+			last->physical = fe->fe_physical;
+			last->logical = fe->fe_logical;
+			last->length = length;
+			last->flags = (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) ? MSC_MENU_EXTENT_UNWRITTEN : 0;
+			last->reserved = 0;
+			file->num_extents++;
+		}
+
+		if (fm->fm_extents[fm->fm_mapped_extents - 1].fe_flags & FIEMAP_EXTENT_LAST)
+			break;
+	}
+
+	printf("%s: %u bytes in %u extents\n", path, file->size, file->num_extents);
+	ret = 0;
+
+finish_fm:
+	free(fm);
+
+finish:
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+/* Parse the menu file the same way the bootloader does */
+int parse_menu(const char* local_path, struct msc_menu_header* menu)
+{
+	struct msc_menu_entry* entry = NULL;
+	char section[64];
+	char line[EXT2FS_LINE_MAX + 1]; /* split like ext2fs_fgetline in the bootloader */
+	char* value;
+	char *ptr, *ptr2;
+	FILE* f;
+
+	f = fopen(local_path, "r");
+	if (f == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot open %s!\n", local_path);
+		return 1;
+	}
+
+	section[0] = '\0';
+
+	while (fgets(line, sizeof(line), f))
+	{
+		ptr = line;
+
+		/* Check space */
+		while (*ptr == ' ' || *ptr == '\t')
+			ptr++;
+
+		/* Check comment */
+		if (*ptr == ';')
+			continue;
+
+		/* Check section */
+		if (*ptr == '[')
+		{
+			ptr2 = strchr(ptr, ']');
+
+			if (ptr2)
+			{
+				ptr++;
+				*ptr2 = '\0';
+
+				strncpy(section, ptr, sizeof(section));
+				section[sizeof(section) - 1] = '\0';
+				entry = NULL;
+
+				if (strcmp(section, "LNX") && strcmp(section, "AKB") && strcmp(section, "SOS"))
+				{
+					if (menu->num_entries == MSC_MENU_MAX_ENTRIES)
+					{
+						fprintf(stderr, "ERROR: Too many menu entries!\n");
+						fclose(f);
+						return 1;
+					}
+
+					entry = &menu->entries[menu->num_entries++];
+					strncpy(entry->title, section, sizeof(entry->title));
+				}
+
+				continue;
+			}
+		}
+
+		/* Check if we have section */
+		if (section[0] == '\0')
+			continue;
+
+		/* Remove trailing whitespace */
+		ptr2 = &ptr[strlen(ptr) - 1];
+
+		while (ptr2 >= ptr && (*ptr2 == ' ' || *ptr2 == '\t' || *ptr2 == '\r' || *ptr2 == '\n'))
+		{
+			*ptr2 = '\0';
+			ptr2--;
+		}
+
+		value = strchr(ptr, '=');
+		if (value == NULL)
+			continue;
+
+		*value++ = '\0';
+
+		/* Title only for these */
+		if (entry == NULL)
+		{
+			if (strcmp(ptr, MENU_TITLE_PROP))
+				continue;
+
+			if (!strcmp(section, "LNX"))
+				strncpy(menu->lnx_title, value, sizeof(menu->lnx_title) - 1);
+			else if (!strcmp(section, "AKB"))
+				strncpy(menu->akb_title, value, sizeof(menu->akb_title) - 1);
+			else
+				strncpy(menu->sos_title, value, sizeof(menu->sos_title) - 1);
+
+			continue;
+		}
+
+		if (!strcmp(ptr, MENU_TITLE_PROP))
+			strncpy(entry->title, value, sizeof(entry->title) - 1);
+		else if (!strcmp(ptr, MENU_ANDROID_IMAGE_PROP))
+			strncpy(entry->path[MSC_MENU_FILE_ANDROID], value, sizeof(entry->path[0]) - 1);
+		else if (!strcmp(ptr, MENU_ZIMAGE_PROP))
+			strncpy(entry->path[MSC_MENU_FILE_ZIMAGE], value, sizeof(entry->path[0]) - 1);
+		else if (!strcmp(ptr, MENU_RAMDISK_PROP))
+			strncpy(entry->path[MSC_MENU_FILE_RAMDISK], value, sizeof(entry->path[0]) - 1);
+		else if (!strcmp(ptr, MENU_CMDLINE_PROP))
+			strncpy(entry->cmdline, value, sizeof(entry->cmdline) - 1);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* Compile the boot file and store it in the misc partition */
+int compile_menu(const char* boot_file)
+{
+	struct msc_menu_header* menu;
+	struct msc_menu_entry* entry;
+	char partition[8], dir[512], local_path[1024];
+	const char* ptr;
+	uint32_t max_extents, i;
+	dev_t dev;
+	FILE* f;
+	int j, l, ret = 1;
+
+	menu = calloc(1, MSC_MENU_SIZE_LIMIT);
+	if (menu == NULL)
+		return 1;
+
+	menu->magic = MSC_MENU_MAGIC;
+	menu->version = MSC_MENU_VERSION;
+	menu->extents_offset = (sizeof(struct msc_menu_header) + 7) & ~7;
+	max_extents = (MSC_MENU_SIZE_LIMIT - menu->extents_offset) / sizeof(struct msc_menu_extent);
+	strncpy(menu->boot_file, boot_file, sizeof(menu->boot_file) - 1);
+
+	/* The menu file itself */
+	if (map_file(boot_file, &menu->menu, NULL, 0))
+		goto finish;
+
+	ptr = strchr(boot_file, ':');
+	l = ((int)(ptr - boot_file));
+	strncpy(partition, boot_file, l);
+	partition[l] = '\0';
+
+	if (find_mount(partition, dir, sizeof(dir), &dev))
+		goto finish;
+
+	snprintf(local_path, sizeof(local_path), "%s%s", dir, ptr + 1);
+	if (parse_menu(local_path, menu))
+		goto finish;
+
+	/* Images, the ones that can't be mapped are left to the filesystem */
+	for (i = 0; i < menu->num_entries; i++)
+	{
+		entry = &menu->entries[i];
+		printf("[%s]\n", entry->title);
+
+		for (j = 0; j < MSC_MENU_FILES; j++)
+		{
+			if (entry->path[j][0] == '\0')
+				continue;
+
+			if (map_file(entry->path[j], &entry->files[j], menu, max_extents))
+			{
+				fprintf(stderr, "WARNING: %s will be loaded through the filesystem.\n", entry->path[j]);
+				memset(&entry->files[j], 0, sizeof(struct msc_menu_file));
+			}
+		}
+	}
+
+	menu->size = menu->extents_offset + menu->num_extents * sizeof(struct msc_menu_extent);
+	menu->checksum = msc_menu_checksum(menu);
+
+	f = fopen(misc_partition, "r+");
+	if (f == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot open %s!\n", misc_partition);
+		goto finish;
+	}
+
+	if (fseek(f, MSC_MENU_OFFSET, SEEK_SET) || fwrite(menu, 1, menu->size, f) != menu->size ||
+	    fflush(f) || fsync(fileno(f)))
+	{
+		fprintf(stderr, "ERROR: Failed writing compiled menu!\n");
+		fclose(f);
+		goto finish;
+	}
+
+	fclose(f);
+	printf("Compiled %u entries, %u extents (%u bytes).\n", menu->num_entries, menu->num_extents, menu->size);
+	ret = 0;
+
+finish:
+	free(menu);
+	return ret;
+}
+
 #define LOAD_MSC(cmd, dirty) if (dirty == -1) { if (read_msc_command(&cmd)) { error("Failed reading MSC command!"); return 1; } dirty = 0; }
 
 int main(int argc, char** argv)
@@ -140,6 +621,7 @@ int main(int argc, char** argv)
 	int partition_valid;
 	struct msc_command cmd;
 	int dirty = -1;
+	int compile = 0;
 	char array[0x100];
 	char* ptr;
 
@@ -158,7 +640,7 @@ int main(int argc, char** argv)
 
 	while (1)
 	{
-		c = getopt_long(argc, argv, "csifC:S:I:F:", long_options, &option_index);
+		c = getopt_long(argc, argv, "csifC:S:I:F:Mm:D:", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -201,9 +683,14 @@ int main(int argc, char** argv)
 					puts("NOEXT4_OFF|");
 
 				if (cmd.settings & MSC_SETTINGS_SHOW_FB_REC)
-					puts("SHOW_FB_REC_ON\n");
+					puts("SHOW_FB_REC_ON|");
 				else
-					puts("SHOW_FB_REC_OFF\n");
+					puts("SHOW_FB_REC_OFF|");
+
+				if (cmd.settings & MSC_SETTINGS_RAW_IO)
+					puts("RAW_IO_ON\n");
+				else
+					puts("RAW_IO_OFF\n");
 
 				break;
 
@@ -282,6 +769,10 @@ int main(int argc, char** argv)
 					cmd.settings |= MSC_SETTINGS_SHOW_FB_REC;
 				else if (!strcmp(optarg, "SHOW_FB_REC_OFF"))
 					cmd.settings &= ~MSC_SETTINGS_SHOW_FB_REC;
+				else if (!strcmp(optarg, "RAW_IO_ON"))
+					cmd.settings |= MSC_SETTINGS_RAW_IO;
+				else if (!strcmp(optarg, "RAW_IO_OFF"))
+					cmd.settings &= ~MSC_SETTINGS_RAW_IO;
 				else
 				{
 					error("Invalid bootloader settings!");
@@ -388,6 +879,32 @@ int main(int argc, char** argv)
 				strncpy(cmd.boot_file, optarg, sizeof(cmd.boot_file));
 				dirty = 1;
 				break;
+
+			case 'M':
+				get_option_possible = 0;
+				LOAD_MSC(cmd, dirty);
+				compile = 1;
+				break;
+
+			case 'm':
+				ptr = strchr(optarg, '=');
+				l = ((int)(ptr - optarg));
+
+				if (ptr == NULL || l > 4 || num_partition_mounts == MAX_MOUNTS)
+				{
+					error("Invalid mount");
+					return 1;
+				}
+
+				strncpy(partition_mounts[num_partition_mounts].name, optarg, l);
+				partition_mounts[num_partition_mounts].name[l] = '\0';
+				partition_mounts[num_partition_mounts].dir = ptr + 1;
+				num_partition_mounts++;
+				break;
+
+			case 'D':
+				misc_partition = optarg;
+				break;
 		}
 	}
 
@@ -395,5 +912,19 @@ int main(int argc, char** argv)
 	if (dirty == 1)
 		write_msc_command(&cmd);
 
+	if (compile)
+	{
+		cmd.boot_file[sizeof(cmd.boot_file) - 1] = '\0';
+
+		if (cmd.boot_file[0] == '\0')
+		{
+			error("No boot file set!");
+			return 1;
+		}
+
+		if (compile_menu(cmd.boot_file))
+			return 1;
+	}
+
 	return 0;
 }
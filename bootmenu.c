@@ -25,6 +25,7 @@
 #include "fastboot.h"
 #include "framebuffer.h"
 #include "ext2fs.h"
+#include "iostats.h"
 #include "bootimg.h"
 #include "atag.h"
 #include "generated.h"
@@ -51,13 +52,6 @@ char extra_cmdline[1024];
 struct boot_menu_item boot_menu_items[20];
 int boot_menu_items_length = 0;
 
-/* Menu file items */
-#define MENU_TITLE_PROP            "title"
-#define MENU_ANDROID_IMAGE_PROP    "android"
-#define MENU_ZIMAGE_PROP           "zImage"
-#define MENU_RAMDISK_PROP          "ramdisk"
-#define MENU_CMDLINE_PROP          "cmdline"
-
 /* Device keys */
 struct gpio_key device_keys[] =
 {
@@ -277,7 +271,7 @@ void msc_cmd_read(void)
 	if (open_partition("MSC", PARTITION_OPEN_READ, &msc_pt_handle))
 		return;
 
-	if (read_partition(msc_pt_handle, &my_cmd, sizeof(my_cmd), &processed_bytes))
+	if (iostats_read_partition(msc_pt_handle, &my_cmd, sizeof(my_cmd), &processed_bytes))
 		goto finish;
 
 	if (processed_bytes != sizeof(my_cmd))
@@ -307,7 +301,7 @@ void msc_cmd_write(void)
 	if (open_partition("MSC", PARTITION_OPEN_WRITE, &msc_pt_handle))
 		goto finish;
 
-	write_partition(msc_pt_handle, &msc_cmd, sizeof(msc_cmd), &processed_bytes);
+	iostats_write_partition(msc_pt_handle, &msc_cmd, sizeof(msc_cmd), &processed_bytes);
 
 finish:
 	close_partition(msc_pt_handle);
@@ -475,7 +469,7 @@ int akb_contains_boot_image()
 		if (open_partition("AKB", PARTITION_OPEN_READ, &akb_pt_handle))
 			return 0;
 
-		ret = read_partition(akb_pt_handle, &android_img_header, sizeof(android_img_header), &processed_bytes);
+		ret = iostats_read_partition(akb_pt_handle, &android_img_header, sizeof(android_img_header), &processed_bytes);
 		close_partition(akb_pt_handle);
 
 		if (ret || processed_bytes != sizeof(android_img_header))
@@ -523,28 +517,456 @@ void android_boot(struct boot_img_hdr* bootimg_data, uint32_t bootimg_size, uint
 	else
 		extra_cmdline[0] = '\0';
 
+	/* Release all partitions before handing over to the kernel */
+	ext2fs_invalidate(NULL);
+	iostats_print();
+
 	android_boot_image(bootimg_data, bootimg_size, ram_base);
 }
 
+/* Boot images parsed from the boot file */
+struct boot_images
+{
+	int valid;
+
+	/* What they were parsed from */
+	char boot_file[256];
+	unsigned char settings;
+	struct ext2fs_stat menu;
+
+	int num_items;
+	struct boot_selection_item items[20];
+	char recovery_name[256];
+};
+
+struct boot_images* boot_images_cache = NULL;
+
+/* Compiled menu, read from MSC once per session */
+struct msc_menu_header* compiled_menu = NULL;
+int compiled_menu_fetched = 0;
+
 /*
- * Load boot images
+ * Get partition from path in BL format
  */
-int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_item* menu_items, int max_items, char* recovery_name, int recovery_name_size)
+static int compiled_menu_partition(const char* path, char* partition, int partition_size)
+{
+	const char* ptr;
+	int len;
+
+	ptr = strchr(path, ':');
+	len = ((int)(ptr - path));
+
+	if (ptr == NULL || len > 4 || len >= partition_size)
+		return 1;
+
+	strncpy(partition, path, len);
+	partition[len] = '\0';
+	return 0;
+}
+
+/*
+ * Check compiled menu read from MSC
+ */
+static int compiled_menu_verify(struct msc_menu_header* menu)
+{
+	struct msc_menu_entry* entry;
+	struct msc_menu_file* file;
+	int i, j;
+
+	if (menu->checksum != msc_menu_checksum(menu))
+		return 1;
+
+	if (menu->num_entries > MSC_MENU_MAX_ENTRIES || menu->extents_offset < sizeof(struct msc_menu_header) ||
+	    (menu->extents_offset & 7) || menu->extents_offset > menu->size ||
+	    menu->num_extents > (menu->size - menu->extents_offset) / sizeof(struct msc_menu_extent))
+		return 1;
+
+	menu->boot_file[ARRAY_SIZE(menu->boot_file) - 1] = '\0';
+	menu->lnx_title[ARRAY_SIZE(menu->lnx_title) - 1] = '\0';
+	menu->akb_title[ARRAY_SIZE(menu->akb_title) - 1] = '\0';
+	menu->sos_title[ARRAY_SIZE(menu->sos_title) - 1] = '\0';
+
+	for (i = 0; i < menu->num_entries; i++)
+	{
+		entry = &menu->entries[i];
+		entry->title[ARRAY_SIZE(entry->title) - 1] = '\0';
+		entry->cmdline[ARRAY_SIZE(entry->cmdline) - 1] = '\0';
+
+		for (j = 0; j < MSC_MENU_FILES; j++)
+		{
+			entry->path[j][ARRAY_SIZE(entry->path[j]) - 1] = '\0';
+			file = &entry->files[j];
+
+			if (file->first_extent > menu->num_extents || file->num_extents > menu->num_extents - file->first_extent)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Read compiled menu from MSC
+ */
+static void compiled_menu_fetch(void)
+{
+	struct msc_menu_header* menu = NULL;
+	uint32_t head[4];
+	uint64_t pt_size;
+	uint32_t processed_bytes = 0;
+	int msc_pt_handle = -1;
+
+	compiled_menu_fetched = 1;
+
+	if (get_partition_size("MSC", &pt_size) || pt_size < MSC_MENU_OFFSET + MSC_MENU_SIZE_LIMIT)
+		return;
+
+	if (open_partition("MSC", PARTITION_OPEN_READ, &msc_pt_handle))
+		return;
+
+	if (iostats_set_partition_position(msc_pt_handle, MSC_MENU_OFFSET, PARTITION_SETPOS_ABSOLUTE))
+		goto finish;
+
+	if (iostats_read_partition(msc_pt_handle, head, sizeof(head), &processed_bytes) || processed_bytes != sizeof(head))
+		goto finish;
+
+	if (head[0] != MSC_MENU_MAGIC || head[1] != MSC_MENU_VERSION ||
+	    head[2] < sizeof(struct msc_menu_header) || head[2] > MSC_MENU_SIZE_LIMIT)
+		goto finish;
+
+	menu = malloc(head[2]);
+	if (!menu)
+		goto finish;
+
+	memcpy(menu, head, sizeof(head));
+
+	if (iostats_read_partition(msc_pt_handle, (char*)menu + sizeof(head), head[2] - sizeof(head), &processed_bytes) ||
+	    processed_bytes != head[2] - sizeof(head))
+		goto finish;
+
+	if (compiled_menu_verify(menu))
+	{
+		printf("BOOTMENU: compiled menu is corrupted\n");
+		goto finish;
+	}
+
+	compiled_menu = menu;
+	menu = NULL;
+
+finish:
+	if (menu)
+		free(menu);
+
+	close_partition(msc_pt_handle);
+}
+
+/*
+ * Check the extents of a compiled file are still where the inode keeps its data,
+ * extents can move (e4defrag) without the size or the times changing
+ */
+static int compiled_menu_check_extents(const char* partition, struct msc_menu_file* file)
+{
+	struct msc_menu_extent* extent;
+	uint64_t offset, expected;
+	uint32_t pos, end, len;
+	int i;
+
+	extent = (struct msc_menu_extent*)((char*)compiled_menu + compiled_menu->extents_offset) + file->first_extent;
+	i = 0;
+
+	for (pos = 0; pos < file->size; pos += len < end - pos ? len : end - pos)
+	{
+		if (ext2fs_map_ino(partition, file->ino, pos, &offset, &len) || len == 0)
+			return 1;
+
+		while (i < file->num_extents && extent[i].logical + extent[i].length <= pos)
+			i++;
+
+		/* In an extent, or in the hole before the next one */
+		if (i < file->num_extents && extent[i].logical <= pos)
+		{
+			expected = (extent[i].flags & MSC_MENU_EXTENT_UNWRITTEN) ? 0 : extent[i].physical + (pos - extent[i].logical);
+			end = extent[i].logical + extent[i].length;
+		}
+		else
+		{
+			expected = 0;
+			end = i < file->num_extents ? extent[i].logical : file->size;
+		}
+
+		if (offset != expected)
+			return 1;
+
+		if (end > file->size)
+			end = file->size;
+	}
+
+	return 0;
+}
+
+/*
+ * Check a file of the compiled menu is unchanged, with extents also that its data
+ * didn't move
+ */
+static int compiled_menu_check_file(const char* path, struct msc_menu_file* file, int extents)
+{
+	struct ext2fs_stat st;
+	char partition[8];
+
+	if (compiled_menu_partition(path, partition, ARRAY_SIZE(partition)))
+		return 1;
+
+	if (ext2fs_stat_ino(partition, file->ino, &st))
+		return 1;
+
+	if (st.nlinks == 0 || st.size != file->size || st.mtime != file->mtime || st.ctime != file->ctime ||
+	    st.generation != file->generation)
+		return 1;
+
+	if (extents && compiled_menu_check_extents(partition, file))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Get compiled menu, if it was compiled from the current boot file and that one didn't change
+ */
+static struct msc_menu_header* compiled_menu_get(void)
+{
+	if (!compiled_menu_fetched)
+		compiled_menu_fetch();
+
+	if (!compiled_menu || strcmp(compiled_menu->boot_file, msc_cmd.boot_file))
+		return NULL;
+
+	if (compiled_menu_check_file(compiled_menu->boot_file, &compiled_menu->menu, 0))
+	{
+		printf("BOOTMENU: compiled menu is out of date\n");
+		return NULL;
+	}
+
+	return compiled_menu;
+}
+
+/*
+ * Read file of the compiled menu by its extents
+ */
+static int compiled_menu_read_file(const char* path, struct msc_menu_file* file, char* dest)
+{
+	struct msc_menu_extent* extent;
+	char partition[8];
+	uint64_t position = (uint64_t)-1;
+	uint32_t pos, len, processed_bytes;
+	int pt_handle = -1;
+	int i, ret = 1;
+
+	if (compiled_menu_partition(path, partition, ARRAY_SIZE(partition)))
+		return 1;
+
+	if (open_partition(partition, PARTITION_OPEN_READ, &pt_handle))
+		return 1;
+
+	extent = (struct msc_menu_extent*)((char*)compiled_menu + compiled_menu->extents_offset) + file->first_extent;
+	pos = 0;
+
+	for (i = 0; i < file->num_extents; i++, extent++)
+	{
+		/* Sorted and not overlapping */
+		if (extent->logical < pos || extent->logical >= file->size)
+			goto finish;
+
+		/* Hole */
+		memset(dest + pos, 0, extent->logical - pos);
+
+		len = extent->length;
+		if (len > file->size - extent->logical)
+			len = file->size - extent->logical;
+
+		if (extent->flags & MSC_MENU_EXTENT_UNWRITTEN)
+			memset(dest + extent->logical, 0, len);
+		else
+		{
+			if (position != extent->physical &&
+			    iostats_set_partition_position(pt_handle, extent->physical, PARTITION_SETPOS_ABSOLUTE))
+				goto finish;
+
+			if (iostats_read_partition(pt_handle, dest + extent->logical, len, &processed_bytes) || processed_bytes != len)
+				goto finish;
+
+			position = extent->physical + len;
+		}
+
+		pos = extent->logical + len;
+	}
+
+	memset(dest + pos, 0, file->size - pos);
+	ret = 0;
+
+finish:
+	close_partition(pt_handle);
+	return ret;
+}
+
+/*
+ * Load files of a compiled entry (starting with file first), returns 0 on success.
+ * Buffers from alloc stay with the caller on failure.
+ */
+static int compiled_menu_loadfiles(int entry, int first, struct ext2fs_load_item* items, int count, ext2fs_alloc_t alloc, void* arg)
 {
-	int len, ret;
+	struct msc_menu_header* menu;
+	struct msc_menu_entry* e;
+	int i;
+
+	if (entry < 0 || first + count > MSC_MENU_FILES)
+		return 1;
+
+	menu = compiled_menu_get();
+	if (!menu || entry >= menu->num_entries)
+		return 1;
+
+	e = &menu->entries[entry];
+
+	/* Same files, unchanged */
+	for (i = 0; i < count; i++)
+	{
+		if (strcmp(items[i].path, e->path[first + i]) || e->files[first + i].size == 0 ||
+		    compiled_menu_check_file(e->path[first + i], &e->files[first + i], 1))
+		{
+			printf("BOOTMENU: compiled entry %d is out of date\n", entry);
+			return 1;
+		}
+
+		items[i].data = NULL;
+		items[i].size = e->files[first + i].size;
+	}
+
+	if (alloc)
+	{
+		if (alloc(items, count, arg))
+			return 1;
+	}
+	else
+	{
+		for (i = 0; i < count; i++)
+		{
+			items[i].data = malloc(items[i].size);
+			if (!items[i].data)
+				goto fail;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (compiled_menu_read_file(e->path[first + i], &e->files[first + i], items[i].data))
+			goto fail;
+	}
+
+	printf("BOOTMENU: loaded compiled entry %d\n", entry);
+	return 0;
+
+fail:
+	if (!alloc)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (items[i].data)
+				free(items[i].data);
+
+			items[i].data = NULL;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Fill boot items from the compiled menu
+ */
+static int compiled_menu_items(struct msc_menu_header* menu, struct boot_selection_item* boot_items, int num_items, int max_items,
+                               int have_akb, char* recovery_name, int recovery_name_size)
+{
+	struct msc_menu_entry* entry;
+	struct boot_selection_item* item;
+	int i;
+
+	if (menu->lnx_title[0] != '\0')
+	{
+		strncpy(boot_items[0].title, menu->lnx_title, ARRAY_SIZE(boot_items[0].title));
+	}
+
+	if (have_akb && menu->akb_title[0] != '\0')
+	{
+		strncpy(boot_items[1].title, menu->akb_title, ARRAY_SIZE(boot_items[1].title));
+	}
+
+	if (recovery_name && recovery_name_size > 0 && menu->sos_title[0] != '\0')
+	{
+		strncpy(recovery_name, menu->sos_title, recovery_name_size);
+		recovery_name[recovery_name_size - 1] = '\0';
+	}
+
+	for (i = 0; i < menu->num_entries && num_items < max_items; i++)
+	{
+		entry = &menu->entries[i];
+		item = &boot_items[num_items];
+
+		item->partition[0] = '\0';
+		strncpy(item->title, entry->title, ARRAY_SIZE(item->title));
+		strncpy(item->path_android, entry->path[MSC_MENU_FILE_ANDROID], ARRAY_SIZE(item->path_android));
+		strncpy(item->path_zImage, entry->path[MSC_MENU_FILE_ZIMAGE], ARRAY_SIZE(item->path_zImage));
+		strncpy(item->path_ramdisk, entry->path[MSC_MENU_FILE_RAMDISK], ARRAY_SIZE(item->path_ramdisk));
+		strncpy(item->cmdline, entry->cmdline, ARRAY_SIZE(item->cmdline));
+		item->compiled = i;
+		num_items++;
+	}
+
+	printf("BOOTMENU: %d images from the compiled menu\n", menu->num_entries);
+	return num_items;
+}
+
+/*
+ * Value of a "prop=value" line (end is past the last character) into dest,
+ * returns 1 if the line sets prop
+ */
+static int menu_line_prop(const char* ptr, const char* end, const char* prop, char* dest, int dest_size)
+{
+	int len = strlen(prop);
+
+	if (end - ptr < len + 1 || memcmp(ptr, prop, len) || ptr[len] != '=')
+		return 0;
+
+	ptr += len + 1;
+	len = end - ptr;
+
+	if (len > dest_size - 1)
+		len = dest_size - 1;
+
+	memcpy(dest, ptr, len);
+	dest[len] = '\0';
+	return 1;
+}
+
+/*
+ * Parse boot images from the boot file (titles are kept in the items)
+ */
+static int parse_boot_images(struct boot_selection_item* boot_items, int max_items, char* recovery_name, int recovery_name_size,
+                             struct ext2fs_stat* menu_stat)
+{
+	int fd, len;
 	int have_akb = 0;
 	int num_items = 0;
-	char boot_file_partition[8];
 	char section[64];
-	char line[256];
+	char* line;
 	struct boot_selection_item boot_current;
-	struct boot_menu_item menu_current;
-	char *ptr, *ptr2;
+	struct msc_menu_header* menu;
+	char *ptr, *ptr2, *end;
 
 	if (max_items < 2)
 		return 0;
 
 	printf("BOOTMENU: loading images\n");
+	menu_stat->ino = 0;
 
 	/* Always add primary boot (secondary only if the partition exists) */
 	strncpy(boot_items[num_items].partition, "LNX", ARRAY_SIZE(boot_items[0].partition));
@@ -553,9 +975,9 @@ int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_it
 	boot_items[num_items].path_ramdisk[0] = '\0';
 	boot_items[num_items].path_zImage[0] = '\0';
 	boot_items[num_items].cmdline[0] = '\0';
+	boot_items[num_items].compiled = -1;
 
-	menu_items[num_items].title = "Primary (LNX)";
-	menu_items[num_items].id = num_items;
+	strncpy(boot_items[num_items].title, "Primary (LNX)", ARRAY_SIZE(boot_items[0].title));
 	num_items++;
 
 	have_akb = akb_contains_boot_image();
@@ -568,9 +990,9 @@ int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_it
 		boot_items[num_items].path_ramdisk[0] = '\0';
 		boot_items[num_items].path_zImage[0] = '\0';
 		boot_items[num_items].cmdline[0] = '\0';
+		boot_items[num_items].compiled = -1;
 
-		menu_items[num_items].title = "Secondary (AKB)";
-		menu_items[num_items].id = num_items;
+		strncpy(boot_items[num_items].title, "Secondary (AKB)", ARRAY_SIZE(boot_items[0].title));
 		num_items++;
 
 		printf("BOOTMENU: have akb partition\n");
@@ -580,26 +1002,27 @@ int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_it
 	if ((msc_cmd.settings & MSC_SETTINGS_FORBID_EXT) || msc_cmd.boot_file[0] == '\0')
 		return num_items;
 
-	/* Read menu file */
-	ptr = strchr(msc_cmd.boot_file, ':');
-	len = ((int)(ptr - msc_cmd.boot_file));
+	/* Use the compiled menu if it's up to date */
+	menu = compiled_menu_get();
+	if (menu)
+	{
+		menu_stat->ino = menu->menu.ino;
+		menu_stat->size = menu->menu.size;
+		menu_stat->mtime = menu->menu.mtime;
+		menu_stat->ctime = menu->menu.ctime;
+		menu_stat->generation = menu->menu.generation;
+		return compiled_menu_items(menu, boot_items, num_items, max_items, have_akb, recovery_name, recovery_name_size);
+	}
 
-	/* Failure reading the path */
-	if (ptr == NULL || len > 4)
+	/* Open the menu file */
+	fd = ext2fs_fopen(msc_cmd.boot_file);
+	if (fd < 0)
 		return num_items;
 
-	/* Copy partition */
-	strncpy(boot_file_partition, msc_cmd.boot_file, len);
-	boot_file_partition[len] = '\0';
-	ptr++;
+	if (ext2fs_fstat(fd, menu_stat))
+		menu_stat->ino = 0;
 
-	/* Mount partition */
-	if (ext2fs_mount(boot_file_partition))
-		return num_items;
-
-	/* Open the file */
-	if (ext2fs_open(ptr) < 0)
-		goto fail_open;
+	ext2fs_freadahead(fd, EXT2FS_RA_TEXT_SLOTS, EXT2FS_RA_TEXT_CHUNK);
 
 	/* Read it line by line */
 	section[0] = '\0';
@@ -607,46 +1030,50 @@ int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_it
 
 	printf("BOOTMENU: began reading menu file\n");
 
-	while(1)
+	/* Lines are handed out of the file buffer, not terminated */
+	while ((len = ext2fs_fgetline(fd, &line)) > 0)
 	{
-		ret = ext2fs_gets(line, ARRAY_SIZE(line));
-
-		if (!ret)
-			break;
-
 		ptr = line;
+		end = line + len;
 
 		/* Check space */
-		while (*ptr == ' ' || *ptr == '\t')
+		while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
 			ptr++;
 
+		/* Remove trailing whitespace */
+		while (end > ptr && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+			end--;
+
 		/* Check comment */
-		if (*ptr == ';')
+		if (ptr < end && *ptr == ';')
 			continue;
 
 		/* Check section */
-		if (*ptr == '[')
+		if (ptr < end && *ptr == '[')
 		{
-			ptr2 = strchr(ptr, ']');
+			ptr2 = ptr + 1;
+			while (ptr2 < end && *ptr2 != ']')
+				ptr2++;
 
-			if (ptr2)
+			if (ptr2 < end)
 			{
 				ptr++;
-				*ptr2 = '\0';
 
 				/* Push the item (and it's not LNX, AKB or SOS) */
-				if (section[0] != '\0' && strcmp(section, "LNX") && strcmp(section, "AKB") && strcmp(section, "SOS"))
+				if (section[0] != '\0' && strcmp(section, "LNX") && strcmp(section, "AKB") && strcmp(section, "SOS") &&
+				    num_items < max_items)
 				{
 					memcpy(&boot_items[num_items], &boot_current, sizeof(struct boot_selection_item));
-					memcpy(&menu_items[num_items], &menu_current, sizeof(struct boot_menu_item));
-					menu_items[num_items].title = boot_items[num_items].title;
-					menu_items[num_items].id = num_items;
 					num_items++;
 				}
 
 				/* Set section */
-				strncpy(section, ptr, ARRAY_SIZE(section));
-				section[ARRAY_SIZE(section) - 1] = '\0';
+				len = ptr2 - ptr;
+				if (len > (int)ARRAY_SIZE(section) - 1)
+					len = ARRAY_SIZE(section) - 1;
+
+				memcpy(section, ptr, len);
+				section[len] = '\0';
 				printf("BOOTMENU: new section %s\n", section);
 
 				/* Reset */
@@ -657,8 +1084,7 @@ int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_it
 				boot_current.path_ramdisk[0] = '\0';
 				boot_current.path_zImage[0] = '\0';
 				boot_current.cmdline[0] = '\0';
-
-				menu_current.title = boot_current.title;
+				boot_current.compiled = -1;
 				continue;
 			}
 		}
@@ -667,117 +1093,150 @@ int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_it
 		if (section[0] == '\0')
 			continue;
 
-		/* Remove trailing whitespace */
-		ptr2 = &ptr[strlen(ptr) - 1];
-
-		while (ptr2 >= ptr && (*ptr2 == ' ' || *ptr2 == '\t' || *ptr2 == '\r' || *ptr2 == '\n'))
-		{
-			*ptr2 = '\0';
-			ptr2--;
-		}
-
-		/* Handle AKB, LNX and SOS section specially */
+		/* Handle AKB, LNX and SOS section specially (title only) */
 		if (!strcmp(section, "LNX"))
 		{
-			/* Title only */
-			if (!strncmp(ptr, MENU_TITLE_PROP "=", strlen(MENU_TITLE_PROP "=")))
-			{
-				ptr2 = &ptr[strlen(MENU_TITLE_PROP "=")];
-				strncpy(boot_items[0].title, ptr2, ARRAY_SIZE(boot_items[0].title));
-				boot_items[0].title[ARRAY_SIZE(boot_items[0].title) - 1] = '\0';
-				menu_items[0].title = boot_items[0].title;
-			}
-
+			menu_line_prop(ptr, end, MENU_TITLE_PROP, boot_items[0].title, ARRAY_SIZE(boot_items[0].title));
 			continue;
 		}
 
 		if (!strcmp(section, "AKB"))
 		{
 			if (have_akb)
-			{
-				/* Title only */
-				if (!strncmp(ptr, MENU_TITLE_PROP "=", strlen(MENU_TITLE_PROP "=")))
-				{
-					ptr2 = &ptr[strlen(MENU_TITLE_PROP "=")];
-					strncpy(boot_items[1].title, ptr2, ARRAY_SIZE(boot_items[1].title));
-					boot_items[1].title[ARRAY_SIZE(boot_items[1].title) - 1] = '\0';
-					menu_items[1].title = boot_items[1].title;
-				}
-			}
+				menu_line_prop(ptr, end, MENU_TITLE_PROP, boot_items[1].title, ARRAY_SIZE(boot_items[1].title));
+
 			continue;
 		}
 
 		if (!strcmp(section, "SOS"))
 		{
 			if (recovery_name && recovery_name_size > 0)
-			{
-				/* Title only */
-				if (!strncmp(ptr, MENU_TITLE_PROP "=", strlen(MENU_TITLE_PROP "=")))
-				{
-					ptr2 = &ptr[strlen(MENU_TITLE_PROP "=")];
-					strncpy(recovery_name, ptr2, recovery_name_size);
-					recovery_name[recovery_name_size - 1] = '\0';
-				}
-			}
+				menu_line_prop(ptr, end, MENU_TITLE_PROP, recovery_name, recovery_name_size);
+
 			continue;
 		}
 
 		/* Now, common items */
-		if (!strncmp(ptr, MENU_TITLE_PROP "=", strlen(MENU_TITLE_PROP "=")))
-		{
-			ptr2 = &ptr[strlen(MENU_TITLE_PROP "=")];
-			strncpy(boot_current.title, ptr2, ARRAY_SIZE(boot_current.title));
-			boot_current.title[ARRAY_SIZE(boot_current.title) - 1] = '\0';
+		if (menu_line_prop(ptr, end, MENU_TITLE_PROP, boot_current.title, ARRAY_SIZE(boot_current.title)))
 			printf("BOOTMENU: title: %s\n", boot_current.title);
-		}
-		else if (!strncmp(ptr, MENU_ANDROID_IMAGE_PROP "=", strlen(MENU_ANDROID_IMAGE_PROP "=")))
-		{
-			ptr2 = &ptr[strlen(MENU_ANDROID_IMAGE_PROP "=")];
-			strncpy(boot_current.path_android, ptr2, ARRAY_SIZE(boot_current.path_android));
-			boot_current.path_android[ARRAY_SIZE(boot_current.path_android) - 1] = '\0';
+		else if (menu_line_prop(ptr, end, MENU_ANDROID_IMAGE_PROP, boot_current.path_android, ARRAY_SIZE(boot_current.path_android)))
 			printf("BOOTMENU: android: %s\n", boot_current.path_android);
-		}
-		else if (!strncmp(ptr, MENU_ZIMAGE_PROP "=", strlen(MENU_ZIMAGE_PROP "=")))
-		{
-			ptr2 = &ptr[strlen(MENU_ZIMAGE_PROP "=")];
-			strncpy(boot_current.path_zImage, ptr2, ARRAY_SIZE(boot_current.path_zImage));
-			boot_current.path_zImage[ARRAY_SIZE(boot_current.path_zImage) - 1] = '\0';
+		else if (menu_line_prop(ptr, end, MENU_ZIMAGE_PROP, boot_current.path_zImage, ARRAY_SIZE(boot_current.path_zImage)))
 			printf("BOOTMENU: zImage: %s\n", boot_current.path_zImage);
-		}
-		else if (!strncmp(ptr, MENU_RAMDISK_PROP "=", strlen(MENU_RAMDISK_PROP "=")))
-		{
-			ptr2 = &ptr[strlen(MENU_RAMDISK_PROP "=")];
-			strncpy(boot_current.path_ramdisk, ptr2, ARRAY_SIZE(boot_current.path_ramdisk));
-			boot_current.path_ramdisk[ARRAY_SIZE(boot_current.path_ramdisk) - 1] = '\0';
+		else if (menu_line_prop(ptr, end, MENU_RAMDISK_PROP, boot_current.path_ramdisk, ARRAY_SIZE(boot_current.path_ramdisk)))
 			printf("BOOTMENU: ramdisk: %s\n", boot_current.path_ramdisk);
-		}
-		else if (!strncmp(ptr, MENU_CMDLINE_PROP "=", strlen(MENU_CMDLINE_PROP "=")))
-		{
-			ptr2 = &ptr[strlen(MENU_CMDLINE_PROP "=")];
-			strncpy(boot_current.cmdline, ptr2, ARRAY_SIZE(boot_current.cmdline));
-			boot_current.cmdline[ARRAY_SIZE(boot_current.cmdline) - 1] = '\0';
+		else if (menu_line_prop(ptr, end, MENU_CMDLINE_PROP, boot_current.cmdline, ARRAY_SIZE(boot_current.cmdline)))
 			printf("BOOTMENU: cmdline: %s\n", boot_current.cmdline);
-		}
 	}
 
 	/* Push it if we have something */
-	if (section[0] != '\0' && strcmp(section, "LNX") && strcmp(section, "AKB") && strcmp(section, "SOS"))
+	if (section[0] != '\0' && strcmp(section, "LNX") && strcmp(section, "AKB") && strcmp(section, "SOS") &&
+	    num_items < max_items)
 	{
 		memcpy(&boot_items[num_items], &boot_current, sizeof(struct boot_selection_item));
-		memcpy(&menu_items[num_items], &menu_current, sizeof(struct boot_menu_item));
-		menu_items[num_items].title = boot_items[num_items].title;
-		menu_items[num_items].id = num_items;
 		num_items++;
 	}
 
-	ext2fs_close();
-
-fail_open:
-	ext2fs_unmount();
+	ext2fs_fclose(fd);
 	printf("BOOTMENU: finished reading menu file\n");
 	return num_items;
 }
 
+/*
+ * Check boot images parsed earlier are still valid
+ */
+static int boot_images_valid(void)
+{
+	struct ext2fs_stat st;
+	char partition[8];
+
+	if (!boot_images_cache || !boot_images_cache->valid)
+		return 0;
+
+	if (strcmp(boot_images_cache->boot_file, msc_cmd.boot_file) ||
+	    ((boot_images_cache->settings ^ msc_cmd.settings) & MSC_SETTINGS_FORBID_EXT))
+		return 0;
+
+	/* The menu file didn't change */
+	if (boot_images_cache->menu.ino)
+	{
+		if (compiled_menu_partition(boot_images_cache->boot_file, partition, ARRAY_SIZE(partition)) ||
+		    ext2fs_stat_ino(partition, boot_images_cache->menu.ino, &st))
+			return 0;
+
+		if (st.nlinks == 0 || st.size != boot_images_cache->menu.size || st.mtime != boot_images_cache->menu.mtime ||
+		    st.ctime != boot_images_cache->menu.ctime || st.generation != boot_images_cache->menu.generation)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Invalidate boot images parsed earlier
+ */
+void invalidate_boot_images(void)
+{
+	if (boot_images_cache)
+		boot_images_cache->valid = 0;
+}
+
+/*
+ * Load boot images (parsed once per session, until the menu file changes)
+ */
+int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_item* menu_items, int max_items, char* recovery_name, int recovery_name_size)
+{
+	struct ext2fs_stat menu_stat;
+	int i, num_items;
+
+	if (!boot_images_cache)
+	{
+		boot_images_cache = malloc(sizeof(struct boot_images));
+		if (boot_images_cache)
+			boot_images_cache->valid = 0;
+	}
+
+	if (!boot_images_cache)
+	{
+		/* No memory to keep them */
+		num_items = parse_boot_images(boot_items, max_items, recovery_name, recovery_name_size, &menu_stat);
+	}
+	else
+	{
+		if (!boot_images_valid())
+		{
+			boot_images_cache->recovery_name[0] = '\0';
+			boot_images_cache->num_items = parse_boot_images(boot_images_cache->items, ARRAY_SIZE(boot_images_cache->items),
+			                                                 boot_images_cache->recovery_name,
+			                                                 ARRAY_SIZE(boot_images_cache->recovery_name), &boot_images_cache->menu);
+
+			strncpy(boot_images_cache->boot_file, msc_cmd.boot_file, ARRAY_SIZE(boot_images_cache->boot_file));
+			boot_images_cache->settings = msc_cmd.settings;
+			boot_images_cache->valid = 1;
+		}
+
+		num_items = boot_images_cache->num_items;
+		if (num_items > max_items)
+			num_items = max_items;
+
+		memcpy(boot_items, boot_images_cache->items, num_items * sizeof(struct boot_selection_item));
+
+		if (recovery_name && recovery_name_size > 0 && boot_images_cache->recovery_name[0] != '\0')
+		{
+			strncpy(recovery_name, boot_images_cache->recovery_name, recovery_name_size);
+			recovery_name[recovery_name_size - 1] = '\0';
+		}
+	}
+
+	for (i = 0; i < num_items; i++)
+	{
+		menu_items[i].title = boot_items[i].title;
+		menu_items[i].id = i;
+	}
+
+	return num_items;
+}
+
 /*
  * Show interactive boot selection
  */
@@ -915,14 +1374,42 @@ void boot_interactively(unsigned char initial_selection, int force_initial, int
 	boot_normal(&boot_items[selected_item], boot_status, ram_base);
 }
 
+/* Boot image being assembled from a kernel and a ramdisk */
+struct boot_image_layout
+{
+	struct boot_img_hdr* bootimg;
+	int bootimg_len;
+};
+
+/*
+ * Allocates the boot image for the loaded files (ext2fs_loadboot allocator)
+ */
+static int boot_image_alloc(struct ext2fs_load_item* items, int count, void* arg)
+{
+	struct boot_image_layout* layout = arg;
+	char *zImage, *ramdisk;
+
+	if (alloc_android_image(&layout->bootimg, &layout->bootimg_len, &zImage, items[0].size,
+	                        &ramdisk, count > 1 ? items[1].size : 0))
+		return 1;
+
+	items[0].data = zImage;
+	if (count > 1)
+		items[1].data = ramdisk;
+
+	return 0;
+}
+
 /*
  * Boots normally (returns on ERROR)
  */
 void boot_normal(struct boot_selection_item* item, const char* status, uint32_t ram_base)
 {
 	struct boot_img_hdr* bootimg;
-	char *zImage, *ramdisk;
-	int bootimg_len, zImage_len, ramdisk_len;
+	int bootimg_len;
+	struct boot_image_layout layout;
+	struct ext2fs_load_item images[2];
+	int num_images, ret;
 
 	/* Normal mode frame */
 	bootmenu_basic_frame();
@@ -944,7 +1431,9 @@ void boot_normal(struct boot_selection_item* item, const char* status, uint32_t
 			fb_refresh();
 
 			/* Load it */
-			if (ext2fs_loadfile((char**)&bootimg, &bootimg_len, item->path_android))
+			images[0].path = item->path_android;
+			if (compiled_menu_loadfiles(item->compiled, MSC_MENU_FILE_ANDROID, images, 1, NULL, NULL) &&
+			    ext2fs_loadboot(images, 1, NULL, NULL))
 			{
 				fb_printf(" FAIL\n");
 				fb_refresh();
@@ -952,65 +1441,52 @@ void boot_normal(struct boot_selection_item* item, const char* status, uint32_t
 				return;
 			}
 
+			bootimg = (struct boot_img_hdr*)images[0].data;
+			bootimg_len = images[0].size;
+
 			fb_printf(" OK\n");
 			fb_refresh();
 		}
 		else if (item->path_zImage[0] != '\0')
 		{
-			/* Load zImage */
-			fb_printf("Loading kernel image from filesystem ...");
-			fb_refresh();
+			/* Load zImage and ramdisk (if it exists) in one pass, straight into the boot image */
+			images[0].path = item->path_zImage;
+			images[1].path = item->path_ramdisk;
+			num_images = item->path_ramdisk[0] != '\0' ? 2 : 1;
 
-			/* Load it */
-			if (ext2fs_loadfile(&zImage, &zImage_len, item->path_zImage))
-			{
-				fb_printf(" FAIL\n");
-				fb_refresh();
-				sleep(2000);
-				return;
-			}
+			if (num_images == 2)
+				fb_printf("Loading kernel image and ramdisk from filesystem ...");
+			else
+				fb_printf("Loading kernel image from filesystem ...");
 
-			fb_printf(" OK\n");
 			fb_refresh();
 
-			/* Load ramdisk if it exists */
-			if (item->path_ramdisk[0] != '\0')
-			{
-				fb_printf("Loading ramdisk from filesystem ...");
-				fb_refresh();
-
-				/* Load it */
-				if (ext2fs_loadfile(&ramdisk, &ramdisk_len, item->path_ramdisk))
-				{
-					free(zImage);
-					fb_printf(" FAIL\n");
-					fb_refresh();
-					sleep(2000);
-					return;
-				}
+			/* Load it */
+			layout.bootimg = NULL;
+			ret = compiled_menu_loadfiles(item->compiled, MSC_MENU_FILE_ZIMAGE, images, num_images, boot_image_alloc, &layout);
 
-				fb_printf(" OK\n");
-				fb_refresh();
-			}
-			else
+			if (ret && layout.bootimg)
 			{
-				ramdisk = NULL;
-				ramdisk_len = 0;
+				free(layout.bootimg);
+				layout.bootimg = NULL;
 			}
 
-			/* Create image */
-			if (create_android_image(&bootimg, &bootimg_len, zImage, zImage_len, ramdisk, ramdisk_len))
+			if (ret && ext2fs_loadboot(images, num_images, boot_image_alloc, &layout))
 			{
-				free(zImage);
-				free(ramdisk);
-				fb_printf("Booting ... FAIL\n");
+				if (layout.bootimg)
+					free(layout.bootimg);
+
+				fb_printf(" FAIL\n");
 				fb_refresh();
 				sleep(2000);
 				return;
 			}
 
-			free(zImage);
-			free(ramdisk);
+			bootimg = layout.bootimg;
+			bootimg_len = layout.bootimg_len;
+
+			fb_printf(" OK\n");
+			fb_refresh();
 		}
 		else
 		{
@@ -1123,10 +1599,15 @@ void main(void* global_handle, uint32_t ram_base)
 	/* Read msc command */
 	msc_cmd_read();
 
+	/* Read the filesystems straight from the eMMC */
+	if (msc_cmd.settings & MSC_SETTINGS_RAW_IO)
+		ext2fs_set_io(NULL, EXT2FS_IO_RAW);
+
 	/* Check if we should wipe cache */
 	if (msc_cmd.erase_cache)
 	{
 		/* Erase cache */
+		ext2fs_invalidate("CAC");
 		format_partition("CAC");
 
 		/* Clear the flag */
@@ -1207,11 +1688,13 @@ void main(void* global_handle, uint32_t ram_base)
 		/* Erase userdata */
 		fb_printf("Erasing UDA partition...\n\n");
 		fb_refresh();
+		ext2fs_invalidate("UDA");
 		format_partition("UDA");
 
 		/* Erase cache */
 		fb_printf("Erasing CAC partition...\n\n");
 		fb_refresh();
+		ext2fs_invalidate("CAC");
 		format_partition("CAC");
 
 		/* Finished */
@@ -1428,6 +1911,7 @@ void main(void* global_handle, uint32_t ram_base)
 				fb_printf("Erasing CAC partition...\n\n");
 				fb_refresh();
 
+				ext2fs_invalidate("CAC");
 				format_partition("CAC");
 
 				fb_printf("Done.\n");
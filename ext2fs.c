@@ -26,6 +26,8 @@
 #include "bl_0_03_14.h"
 #include "mystdlib.h"
 #include "ext2fs.h"
+#include "blockdev.h"
+#include "iostats.h"
 #include "byteorder.h"
 
 /* Magic value used to identify an ext2 filesystem.  */
@@ -61,12 +63,91 @@
 /* The size of an ext2 block in bytes.  */
 #define EXT2_BLOCK_SIZE(data)  (1 << LOG2_BLOCK_SIZE(data))
 
+/* Feature flags used by the reader */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX        0x0020
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER  0x0001
+#define EXT2_FEATURE_INCOMPAT_META_BG        0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT          0x0080
+
+/* Superblock flags */
+#define EXT2_FLAGS_UNSIGNED_HASH   0x0002
+
 /* ext4 extension flag */
 #define EXT4_EXTENTS_FLAG      0x80000
 
+/* Data stored in the inode (i_block, then the system.data xattr) */
+#define EXT4_INLINE_DATA_FLAG  0x10000000
+
+/* Inline data layout */
+#define EXT2_GOOD_OLD_INODE_SIZE       128
+#define EXT4_MIN_INLINE_DATA_SIZE      60
+#define EXT4_INLINE_DOTDOT_SIZE        4
+#define EXT4_XATTR_MAGIC               0xEA020000
+#define EXT4_XATTR_INDEX_SYSTEM        7
+#define EXT4_XATTR_ENTRY_SIZE          16
+
+/* Hashed directory flag */
+#define EXT2_INDEX_FLAG        0x1000
+
+/* Directory hash versions */
+#define EXT2_HASH_LEGACY                0
+#define EXT2_HASH_HALF_MD4              1
+#define EXT2_HASH_TEA                   2
+#define EXT2_HASH_LEGACY_UNSIGNED       3
+#define EXT2_HASH_HALF_MD4_UNSIGNED     4
+#define EXT2_HASH_TEA_UNSIGNED          5
+
+/* Hashed directory layout */
+#define EXT2_DX_ROOT_INFO_OFFSET        24
+#define EXT2_DX_NODE_ENTRIES_OFFSET     8
+#define EXT2_DX_MAX_LEVELS              3
+#define EXT2_DX_BLOCK_MASK              0x0FFFFFFF
+#define EXT2_HTREE_EOF                  0x7FFFFFFF
+
 /* ext4 extension magic */
 #define EXT4_EXT_MAGIC         0xf30a
 
+/* Extents longer than this are unwritten (preallocated), len - 32768 blocks */
+#define EXT4_EXT_INIT_MAX_LEN  32768
+
+/* Number of blocks in the metadata block cache */
+#define EXT2FS_CACHE_BLOCKS    32
+
+/* Number of resolved directory entries kept per filesystem */
+#define EXT2FS_DCACHE_ENTRIES  32
+
+/* Longest name / symlink target kept in the directory entry cache */
+#define EXT2FS_DCACHE_NAME     64
+#define EXT2FS_DCACHE_SYMLINK  128
+
+/* Number of nodes in the per-mount node pool */
+#define EXT2FS_NODE_POOL       16
+
+/* Per-mount scratch space in bytes, a target for every symlink being followed (at most a block each) */
+#define EXT2FS_ARENA_SCRATCH(blksz) (EXT2_MAX_SYMLINKCNT * (((blksz) + 1 + 7) & ~7))
+
+/* Boot block map record on MSC (after the MSC command) */
+#define EXT2FS_BMAP_PARTITION  "MSC"
+#define EXT2FS_BMAP_OFFSET     0x8000
+#define EXT2FS_BMAP_MAGIC      0x50414D42
+#define EXT2FS_BMAP_MAX_FILES  4
+#define EXT2FS_BMAP_MAX_DEPTH  8
+#define EXT2FS_BMAP_MAX_RUNS   256
+
+/* Readahead window limits (see ext2fs_freadahead) */
+#define EXT2FS_RA_MAX_SLOTS    8
+#define EXT2FS_RA_MAX_CHUNK    0x40000
+#define EXT2FS_RA_ALIGN        64
+
+/* Number of filesystems kept mounted */
+#define EXT2FS_MAX_MOUNTS      4
+
+/* Number of files open at once */
+#define EXT2FS_MAX_FILES       8
+
+/* Number of partitions with their own device access setting */
+#define EXT2FS_MAX_IO_PREFS    4
+
 /* The ext2 superblock.  */
 struct ext2_sblock
 {
@@ -105,6 +186,27 @@ struct ext2_sblock
 	char volume_name[16];
 	char last_mounted_on[64];
 	uint32_t compression_info;
+	uint8_t prealloc_blocks;
+	uint8_t prealloc_dir_blocks;
+	uint16_t reserved_gdt_blocks;
+	uint8_t journal_uuid[16];
+	uint32_t journal_inode;
+	uint32_t journal_dev;
+	uint32_t last_orphan;
+	uint32_t hash_seed[4];
+	uint8_t default_hash_version;
+	uint8_t journal_backup_type;
+	uint16_t descriptor_size;
+	uint32_t default_mount_options;
+	uint32_t first_meta_bg;
+	uint32_t mkfs_time;
+	uint32_t journal_blocks[17];
+	uint32_t total_blocks_hi;
+	uint32_t reserved_blocks_hi;
+	uint32_t free_blocks_hi;
+	uint16_t min_extra_inode_size;
+	uint16_t want_extra_inode_size;
+	uint32_t flags;
 };
 
 /* The ext2 blockgroup.  */
@@ -119,6 +221,18 @@ struct ext2_block_group
 	uint32_t reserved[3];
 };
 
+/* The upper half of an ext4 64-bit blockgroup.  */
+struct ext4_block_group_hi
+{
+	uint32_t block_id_hi;
+	uint32_t inode_id_hi;
+	uint32_t inode_table_id_hi;
+	uint16_t free_blocks_hi;
+	uint16_t free_inodes_hi;
+	uint16_t used_dir_cnt_hi;
+	uint16_t reserved[7];
+};
+
 /* The ext2 inode.  */
 struct ext2_inode
 {
@@ -161,20 +275,112 @@ struct ext2_dirent
 	uint8_t filetype;
 };
 
+/* Last extent leaf used by a node, so sequential lookups avoid the tree walk.  */
+struct ext4_extent_cursor
+{
+	struct ext4_extent_header* leaf;  /* in buf, or the root in the inode */
+	char* buf;
+	uint32_t first;                   /* file blocks covered by the leaf */
+	uint32_t end;
+	int index;                        /* last matched extent */
+};
+
 struct ext2fs_node
 {
 	struct ext2_data* data;
 	struct ext2_inode inode;
 	int ino;
 	int inode_read;
+	struct ext4_extent_cursor cursor;
+};
+
+/* Cached filesystem block.  */
+struct ext2_cache_entry
+{
+	uint64_t blkno;
+	uint32_t last_used;
+	int valid;
+	char* buf;
+};
+
+/* Resolved directory entry, ino 0 caches a failed lookup.  */
+struct ext2_dentry
+{
+	int parent;                           /* 0 for an unused entry */
+	int ino;
+	int type;
+	uint32_t last_used;
+	char name[EXT2FS_DCACHE_NAME];
+	char symlink[EXT2FS_DCACHE_SYMLINK];  /* target of a short symlink, if read */
 };
 
 /* Information about a "mounted" ext2 filesystem.  */
 struct ext2_data
 {
+	/* Partition */
+	char partition[8];
+	int pt_handle;
+	struct blockdev* dev; /* raw eMMC access, NULL if reads go through the partition API */
+	uint64_t pt_size;
+	uint64_t pt_pos;      /* where the last read stopped, (uint64_t)-1 if unknown */
+	uint32_t last_used;
+
+	unsigned int inode_size;
 	struct ext2_sblock sblock;
 	struct ext2_inode *inode;
 	struct ext2fs_node diropen;
+
+	/* Arena, one allocation holding the node pool, the buffers and the block cache blocks */
+	char* arena;
+	uint32_t arena_size;
+	uint32_t arena_used;
+	uint32_t arena_peak;
+
+	/* Node pool, each node comes with its own extent leaf buffer */
+	struct ext2fs_node* node_pool;
+	uint32_t node_pool_used;
+
+	/* Inode table location of each group (from the descriptor table) */
+	uint64_t* inode_tables;
+	uint32_t group_count;
+
+	/* Directory block being scanned */
+	char* dir_buf;
+
+	/* Metadata block cache (LRU) */
+	struct ext2_cache_entry cache[EXT2FS_CACHE_BLOCKS];
+	uint32_t cache_tick;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+
+	/* Directory entry cache (LRU) */
+	struct ext2_dentry dcache[EXT2FS_DCACHE_ENTRIES];
+	uint32_t dcache_tick;
+	uint32_t dcache_hits;
+	uint32_t dcache_misses;
+};
+
+/* Hashed directory root information (after the "." and ".." entries).  */
+struct ext2_dx_root_info
+{
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+};
+
+/* Hashed directory index entry, the first one holds limit / count instead of hash.  */
+struct ext2_dx_entry
+{
+	uint32_t hash;
+	uint32_t block;
+};
+
+struct ext2_dx_countlimit
+{
+	uint16_t limit;
+	uint16_t count;
 };
 
 /* ext4 extensions */
@@ -204,95 +410,485 @@ struct ext4_extent_idx
 };
 
 typedef struct ext2fs_node* ext2fs_node_t;
+
+/*
+ * Readahead window of a file read sequentially: a ring of slots holding the
+ * physical runs that follow the read position (split in chunks), filled by
+ * walking the extent cursor with as few reads as possible.
+ */
+struct ext2fs_readahead
+{
+	char* mem;
+	char* slot[EXT2FS_RA_MAX_SLOTS];
+	unsigned int pos[EXT2FS_RA_MAX_SLOTS];
+	unsigned int len[EXT2FS_RA_MAX_SLOTS];
+	unsigned int chunk;
+	int slots;
+
+	/* Filled slots from head on, next is the file position following them */
+	unsigned int next;
+	int head;
+	int filled;
+};
+
+/*
+ * Line iterator state: the file block (from the read position on) the lines are
+ * handed out of, and a buffer to put together a line straddling two blocks.
+ */
+struct ext2fs_lines
+{
+	char* block;
+	unsigned int len;
+	unsigned int off;    /* start of the next line */
+	char* spill;
+};
+
+/* Open file */
+struct ext2fs_file
+{
+	ext2fs_node_t node;
+	unsigned int pos;
+	unsigned int size;
+
+	/* Line iterator, NULL until the first line is read */
+	struct ext2fs_lines* lines;
+
+	/* Readahead, NULL if not enabled */
+	struct ext2fs_readahead* ra;
+};
+
 typedef struct ext4_extent_header* ext4_extent_header_t;
 
+/* Mounted filesystems, kept for the whole session */
+static struct ext2_data* ext2fs_mounts[EXT2FS_MAX_MOUNTS];
+static uint32_t ext2fs_mount_tick = 0;
+
+/* Device access of the mounts (see ext2fs_set_io) */
+struct ext2fs_io_pref
+{
+	char partition[8];
+	int io;
+};
+
+static struct ext2fs_io_pref ext2fs_io_prefs[EXT2FS_MAX_IO_PREFS];
+static int ext2fs_default_io = EXT2FS_IO_PARTITION;
+
+/* Open files */
+static struct ext2fs_file ext2fs_files[EXT2FS_MAX_FILES];
+
+/* Filesystem selected by ext2fs_mount and its file (ext2fs_open) */
 static struct ext2_data* ext2fs_root = NULL;
-static ext2fs_node_t ext2fs_file = NULL;
-static int ext2fs_pos = 0;
+static int ext2fs_fd = -1;
 static int symlinknest = 0;
-static unsigned int inode_size;
-static int ext_pt_handle = -1;
-static uint64_t pt_size;
-static char gets_buffer[1024];
-static char* gets_buffer_ptr = gets_buffer;
 
-static int ext2fs_devread(uint64_t sector, int byte_offset, int byte_len, char *buf)
+static int ext2fs_devread(struct ext2_data* data, uint64_t sector, int byte_offset, int byte_len, char *buf)
 {
 	uint32_t processed_bytes;
+	uint64_t pos = (sector * SECTOR_SIZE) + byte_offset;
+	uint32_t start_us = get_timer_us();
+	int seek = (pos != data->pt_pos);
 
-	if ((sector < 0) || (sector * SECTOR_SIZE) + (byte_offset + byte_len - 1) >= pt_size)
+	if (pos + (byte_len - 1) >= data->pt_size)
 	{
 		printf(" ** ext2fs_devread() read outside partition sector %d\n", sector);
 		return 1;
 	}
 
 	/*
-	 * Set position
+	 * Raw eMMC, no position to keep
 	 */
-	if (set_partition_position(ext_pt_handle, (sector * SECTOR_SIZE) + byte_offset, PARTITION_SETPOS_ABSOLUTE))
-		return 1;
+	if (data->dev)
+	{
+		data->pt_pos = (uint64_t)-1;
+
+		if (blockdev_read(data->dev, pos, byte_len, buf))
+			return 1;
+
+		data->pt_pos = pos + byte_len;
+		iostats_add(IOSTATS_EXT2FS_READ, byte_len, seek, start_us);
+		return 0;
+	}
+
+	/*
+	 * Set position (unless the read continues the previous one)
+	 */
+	if (pos != data->pt_pos)
+	{
+		data->pt_pos = (uint64_t)-1;
+
+		if (iostats_set_partition_position(data->pt_handle, pos, PARTITION_SETPOS_ABSOLUTE))
+			return 1;
+	}
 
 	/*
 	 * Read it
 	 */
-	if (read_partition(ext_pt_handle, buf, byte_len, &processed_bytes) || (processed_bytes != (uint32_t)byte_len))
+	data->pt_pos = (uint64_t)-1;
+
+	if (iostats_read_partition(data->pt_handle, buf, byte_len, &processed_bytes) || (processed_bytes != (uint32_t)byte_len))
 		return 1;
 
+	data->pt_pos = pos + byte_len;
+	iostats_add(IOSTATS_EXT2FS_READ, byte_len, seek, start_us);
 	return 0;
 }
 
-static int ext2fs_blockgroup(struct ext2_data* data, int group, struct ext2_block_group* blkgrp)
+/*
+ * Get a filesystem block through the metadata cache. The returned pointer
+ * stays valid only until the next call (the entry may get evicted).
+ */
+static char* ext2fs_cache_block(struct ext2_data* data, uint64_t blkno)
 {
-	uint64_t blkno;
-	uint32_t blkoff;
+	struct ext2_cache_entry* entry;
+	struct ext2_cache_entry* victim = NULL;
+	int i;
+
+	for (i = 0; i < EXT2FS_CACHE_BLOCKS; i++)
+	{
+		entry = &data->cache[i];
+
+		if (entry->valid && entry->blkno == blkno)
+		{
+			entry->last_used = ++data->cache_tick;
+			data->cache_hits++;
+			iostats_hit(IOSTATS_CACHE_BLOCK);
+			return entry->buf;
+		}
+
+		/* Prefer free entries, then the least recently used one */
+		if (victim == NULL || (victim->valid && (!entry->valid || entry->last_used < victim->last_used)))
+			victim = entry;
+	}
+
+	data->cache_misses++;
+	iostats_miss(IOSTATS_CACHE_BLOCK);
+	victim->valid = 0;
+
+	if (ext2fs_devread(data, blkno << LOG2_EXT2_BLOCK_SIZE(data), 0, EXT2_BLOCK_SIZE(data), victim->buf))
+		return NULL;
+
+	victim->blkno = blkno;
+	victim->last_used = ++data->cache_tick;
+	victim->valid = 1;
+	return victim->buf;
+}
+
+/* Allocate size bytes from the mount arena */
+static void* ext2fs_arena_alloc(struct ext2_data* data, uint32_t size)
+{
+	char* ptr;
+
+	size = (size + 7) & ~7;
+	if (size > data->arena_size - data->arena_used)
+		return NULL;
+
+	ptr = data->arena + data->arena_used;
+	data->arena_used += size;
+
+	if (data->arena_used > data->arena_peak)
+		data->arena_peak = data->arena_used;
+
+	return ptr;
+}
+
+/* Arena position, everything allocated after it is dropped by ext2fs_arena_release */
+static uint32_t ext2fs_arena_mark(struct ext2_data* data)
+{
+	return data->arena_used;
+}
+
+static void ext2fs_arena_release(struct ext2_data* data, uint32_t mark)
+{
+	data->arena_used = mark;
+}
+
+/* Does the group hold a superblock backup (sparse_super) */
+static int ext2fs_group_has_super(struct ext2_data* data, uint32_t group)
+{
+	uint32_t n;
+
+	if (!(__le32_to_cpu(data->sblock.feature_ro_compat) & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return 1;
+
+	if (group <= 1)
+		return 1;
+
+	for (n = 3; n <= group; n *= 3)
+		if (n == group)
+			return 1;
+
+	for (n = 5; n <= group; n *= 5)
+		if (n == group)
+			return 1;
+
+	for (n = 7; n <= group; n *= 7)
+		if (n == group)
+			return 1;
+
+	return 0;
+}
+
+/* Descriptor size and group count, returns the number of descriptor blocks (0 if invalid) */
+static uint32_t ext2fs_descriptor_blocks(struct ext2_data* data, uint32_t* desc_size)
+{
+	struct ext2_sblock* sblock = &data->sblock;
 	uint32_t desc_per_blk;
+	int blksz = EXT2_BLOCK_SIZE(data);
+
+	if (__le32_to_cpu(sblock->feature_incompat) & EXT4_FEATURE_INCOMPAT_64BIT)
+		*desc_size = __le16_to_cpu(sblock->descriptor_size);
+	else
+		*desc_size = sizeof(struct ext2_block_group);
+
+	/* Power of two, at least the 32 byte descriptor */
+	if (*desc_size < sizeof(struct ext2_block_group) || *desc_size > (uint32_t)blksz || (*desc_size & (*desc_size - 1)))
+		return 0;
+
+	if (!__le32_to_cpu(sblock->inodes_per_group) || !__le32_to_cpu(sblock->blocks_per_group))
+		return 0;
 
-	desc_per_blk = EXT2_BLOCK_SIZE(data) / sizeof(struct ext2_block_group);
-	blkno = __le32_to_cpu(data->sblock.first_data_block) + 1 + (group / desc_per_blk);
-	blkoff = (group % desc_per_blk) * sizeof(struct ext2_block_group);
-	return ext2fs_devread(blkno << LOG2_EXT2_BLOCK_SIZE(data), blkoff, sizeof(struct ext2_block_group), (char*)blkgrp);
+	data->group_count = __le32_to_cpu(sblock->total_inodes) / __le32_to_cpu(sblock->inodes_per_group);
+	desc_per_blk = blksz / *desc_size;
+
+	return (data->group_count + desc_per_blk - 1) / desc_per_blk;
 }
 
-static int ext2fs_read_inode(struct ext2_data* data, int ino, struct ext2_inode* inode)
+/* Read the group descriptor table and keep the inode table locations */
+static int ext2fs_read_descriptors(struct ext2_data* data)
+{
+	struct ext2_sblock* sblock = &data->sblock;
+	struct ext2_block_group* desc;
+	struct ext4_block_group_hi* desc_hi;
+	uint32_t desc_size, desc_per_blk, gdt_blocks, plain_blocks, b, g, mark;
+	uint64_t blkno;
+	int blksz = EXT2_BLOCK_SIZE(data);
+	int is_64bit = __le32_to_cpu(sblock->feature_incompat) & EXT4_FEATURE_INCOMPAT_64BIT;
+	char* gdt;
+
+	gdt_blocks = ext2fs_descriptor_blocks(data, &desc_size);
+	if (!gdt_blocks)
+		return 1;
+
+	desc_per_blk = blksz / desc_size;
+
+	/* With meta_bg, only the first first_meta_bg blocks follow the superblock */
+	plain_blocks = gdt_blocks;
+	if ((__le32_to_cpu(sblock->feature_incompat) & EXT2_FEATURE_INCOMPAT_META_BG) && __le32_to_cpu(sblock->first_meta_bg) < gdt_blocks)
+		plain_blocks = __le32_to_cpu(sblock->first_meta_bg);
+
+	data->inode_tables = ext2fs_arena_alloc(data, data->group_count * sizeof(uint64_t));
+	if (!data->inode_tables)
+		return 1;
+
+	/* The raw table is only needed here */
+	mark = ext2fs_arena_mark(data);
+	gdt = ext2fs_arena_alloc(data, gdt_blocks * blksz);
+	if (!gdt)
+		return 1;
+
+	blkno = __le32_to_cpu(sblock->first_data_block) + 1;
+	if (plain_blocks && ext2fs_devread(data, blkno << LOG2_EXT2_BLOCK_SIZE(data), 0, plain_blocks * blksz, gdt))
+		goto fail;
+
+	/* Meta groups keep their descriptor block in their first group */
+	for (b = plain_blocks; b < gdt_blocks; b++)
+	{
+		g = b * desc_per_blk;
+		blkno = __le32_to_cpu(sblock->first_data_block) + (uint64_t)g * __le32_to_cpu(sblock->blocks_per_group);
+		blkno += ext2fs_group_has_super(data, g);
+
+		if (ext2fs_devread(data, blkno << LOG2_EXT2_BLOCK_SIZE(data), 0, blksz, gdt + b * blksz))
+			goto fail;
+	}
+
+	for (g = 0; g < data->group_count; g++)
+	{
+		desc = (struct ext2_block_group*)(gdt + g * desc_size);
+		data->inode_tables[g] = __le32_to_cpu(desc->inode_table_id);
+
+		if (is_64bit && desc_size >= sizeof(struct ext2_block_group) + sizeof(struct ext4_block_group_hi))
+		{
+			desc_hi = (struct ext4_block_group_hi*)(desc + 1);
+			data->inode_tables[g] |= ((uint64_t)__le32_to_cpu(desc_hi->inode_table_id_hi)) << 32;
+		}
+	}
+
+	ext2fs_arena_release(data, mark);
+	return 0;
+
+fail:
+	ext2fs_arena_release(data, mark);
+	return 1;
+}
+
+/* The whole on-disk inode (data->inode_size bytes) in the block cache */
+static char* ext2fs_inode_buffer(struct ext2_data* data, int ino)
 {
-	struct ext2_block_group blkgrp;
 	struct ext2_sblock* sblock = &data->sblock;
 	int inodes_per_block;
-	int status;
+	uint32_t group;
 
 	uint64_t blkno;
 	uint32_t blkoff;
+	char* block;
 
 	/* It is easier to calculate if the first inode is 0.  */
 	ino--;
-	status = ext2fs_blockgroup(data, ino / __le32_to_cpu(sblock->inodes_per_group), &blkgrp);
+	group = ino / __le32_to_cpu(sblock->inodes_per_group);
 
-	if (status)
-		return 1;
+	if (ino < 0 || group >= data->group_count)
+		return NULL;
+
+	inodes_per_block = EXT2_BLOCK_SIZE(data) / data->inode_size;
+
+	blkno = data->inode_tables[group] + (ino % __le32_to_cpu(sblock->inodes_per_group)) / inodes_per_block;
+	blkoff = (ino % inodes_per_block) * data->inode_size;
 
-	inodes_per_block = EXT2_BLOCK_SIZE(data) / inode_size;
+	block = ext2fs_cache_block(data, blkno);
+	if (!block)
+		return NULL;
+
+	return block + blkoff;
+}
 
-	blkno = __le32_to_cpu(blkgrp.inode_table_id) + (ino % __le32_to_cpu(sblock->inodes_per_group)) / inodes_per_block;
-	blkoff = (ino % inodes_per_block) * inode_size;
+static int ext2fs_read_inode(struct ext2_data* data, int ino, struct ext2_inode* inode)
+{
+	char* raw;
 
 	/* Read the inode.  */
-	status = ext2fs_devread(blkno << LOG2_EXT2_BLOCK_SIZE(data), blkoff, sizeof(struct ext2_inode), (char*) inode);
-	if (status)
+	raw = ext2fs_inode_buffer(data, ino);
+	if (!raw)
 		return 1;
 
+	memcpy(inode, raw, sizeof(struct ext2_inode));
 	return 0;
 }
 
+static int ext2fs_is_inline(ext2fs_node_t node)
+{
+	return (__le32_to_cpu(node->inode.flags) & EXT4_INLINE_DATA_FLAG) != 0;
+}
+
+/*
+ * Read inline data, the first 60 bytes are i_block, the rest is the value of
+ * the system.data xattr in the inode body. The inode table block is normally
+ * still in the block cache from reading the inode, so there's no device read.
+ */
+static int ext2fs_read_inline(ext2fs_node_t node, unsigned int pos, unsigned int len, char* buf)
+{
+	struct ext2_data* data = node->data;
+	unsigned int done, chunk, value_offs, value_size;
+	uint32_t extra, off, end;
+	uint8_t* raw;
+	uint8_t* entry;
+
+	done = 0;
+
+	if (pos < EXT4_MIN_INLINE_DATA_SIZE)
+	{
+		chunk = EXT4_MIN_INLINE_DATA_SIZE - pos;
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(buf, (char*)node->inode.b.blocks.dir_blocks + pos, chunk);
+		done = chunk;
+	}
+
+	if (done == len)
+		return len;
+
+	/* The rest lives in the xattrs following the extra inode fields */
+	if (data->inode_size <= EXT2_GOOD_OLD_INODE_SIZE + 4)
+		return -1;
+
+	raw = (uint8_t*)ext2fs_inode_buffer(data, node->ino);
+	if (!raw)
+		return -1;
+
+	extra = raw[EXT2_GOOD_OLD_INODE_SIZE] | (raw[EXT2_GOOD_OLD_INODE_SIZE + 1] << 8);
+	off = EXT2_GOOD_OLD_INODE_SIZE + extra;
+	end = data->inode_size;
+
+	if (off + 4 > end || __le32_to_cpu(*(uint32_t*)(raw + off)) != EXT4_XATTR_MAGIC)
+		return -1;
+
+	off += 4;
+	entry = raw + off;
+
+	/* Entries end with 4 zero bytes, values are relative to the first entry */
+	while (entry + EXT4_XATTR_ENTRY_SIZE <= raw + end && *(uint32_t*)entry != 0)
+	{
+		if (entry[0] == 4 && entry[1] == EXT4_XATTR_INDEX_SYSTEM && !memcmp(entry + EXT4_XATTR_ENTRY_SIZE, "data", 4))
+		{
+			value_offs = __le16_to_cpu(*(uint16_t*)(entry + 2));
+			value_size = __le32_to_cpu(*(uint32_t*)(entry + 8));
+
+			pos += done - EXT4_MIN_INLINE_DATA_SIZE;
+			if (off + value_offs + value_size > end || pos + (len - done) > value_size)
+				return -1;
+
+			memcpy(buf + done, raw + off + value_offs + pos, len - done);
+			return len;
+		}
+
+		entry += (EXT4_XATTR_ENTRY_SIZE + entry[0] + 3) & ~3;
+	}
+
+	return -1;
+}
+
+/* Create node for inode ino from the node pool, the inode itself is read on demand */
+static ext2fs_node_t ext2fs_alloc_node(struct ext2_data* data, int ino)
+{
+	ext2fs_node_t node;
+	char* buf;
+	int i;
+
+	for (i = 0; i < EXT2FS_NODE_POOL; i++)
+	{
+		if (!(data->node_pool_used & (1 << i)))
+			break;
+	}
+
+	if (i == EXT2FS_NODE_POOL)
+	{
+		printf("EXT2FS: %s out of nodes\n", data->partition);
+		return NULL;
+	}
+
+	node = &data->node_pool[i];
+	buf = node->cursor.buf;
+
+	memset(node, 0, sizeof(struct ext2fs_node));
+	node->data = data;
+	node->ino = ino;
+	node->cursor.buf = buf;
+
+	data->node_pool_used |= 1 << i;
+	return node;
+}
+
 static void ext2fs_free_node(ext2fs_node_t node, ext2fs_node_t currroot)
 {
-	if ((node != &ext2fs_root->diropen) && (node != currroot))
-		free(node);
+	struct ext2_data* data;
+
+	if (node == NULL)
+		return;
+
+	data = node->data;
+
+	if ((node != &data->diropen) && (node != currroot))
+		data->node_pool_used &= ~(1 << (node - data->node_pool));
 }
 
-static ext4_extent_header_t ext4_find_leaf(struct ext2_data* data, char* buf, ext4_extent_header_t ext_block, uint32_t fileblock)
+/* Find leaf for fileblock, first / end receive the file blocks the leaf covers */
+static ext4_extent_header_t ext4_find_leaf(struct ext2_data* data, ext4_extent_header_t ext_block, uint32_t fileblock, uint32_t* first, uint32_t* end)
 {
 	struct ext4_extent_idx* index;
 
+	*first = 0;
+	*end = 0xFFFFFFFF;
+
 	while (1)
 	{
 		int i;
@@ -312,103 +908,235 @@ static ext4_extent_header_t ext4_find_leaf(struct ext2_data* data, char* buf, ex
 				break;
 		}
 
-		if (--i < 0)
+		if (i < __le16_to_cpu(ext_block->entries))
+			*end = __le32_to_cpu(index[i].block);
+
+		if (i == 0 && __le16_to_cpu(ext_block->entries) == 0)
 			return NULL;
 
+		/* A hole in front of the first index belongs to it (like in the kernel) */
+		if (--i < 0)
+			i = 0;
+		else
+			*first = __le32_to_cpu(index[i].block);
+
 		block = __le16_to_cpu(index[i].leaf_hi);
 		block = (block << 32) + __le32_to_cpu(index[i].leaf);
-		block = block << LOG2_EXT2_BLOCK_SIZE(data);
-		if (ext2fs_devread(block, 0, EXT2_BLOCK_SIZE(data), buf))
-			return NULL;
 
-		ext_block = (ext4_extent_header_t)buf;
+		ext_block = (ext4_extent_header_t)ext2fs_cache_block(data, block);
+		if (!ext_block)
+			return NULL;
 	}
 }
 
-static uint64_t ext2fs_read_block(ext2fs_node_t node, uint64_t fileblock)
+/* Find the extent holding fileblock (-1 = before the first one) */
+static int ext4_find_extent(struct ext4_extent_cursor* cursor, uint32_t fileblock)
 {
-	struct ext2_data* data = node->data;
-	struct ext2_inode* inode = &node->inode;
-	uint64_t blknr;
-	int blksz = EXT2_BLOCK_SIZE(data);
-	int log2_blksz = LOG2_EXT2_BLOCK_SIZE(data);
-	int status;
+	struct ext4_extent* ext = (struct ext4_extent*)(cursor->leaf + 1);
+	int entries = __le16_to_cpu(cursor->leaf->entries);
+	int i = cursor->index;
+	int lo, hi, mid;
 
-	/* Ext4 extension */
-	if (__le32_to_cpu(inode->flags) & EXT4_EXTENTS_FLAG)
+	/* Sequential access: same or the following extent */
+	if (i >= 0 && i < entries && fileblock >= __le32_to_cpu(ext[i].block))
 	{
-		char buf[EXT2_BLOCK_SIZE(data)];
-		ext4_extent_header_t leaf;
-		struct ext4_extent* ext;
-		int i;
+		if (i + 1 == entries || fileblock < __le32_to_cpu(ext[i + 1].block))
+			return i;
 
-		leaf = ext4_find_leaf(data, buf, (ext4_extent_header_t)inode->b.blocks.dir_blocks, fileblock);
-		if (!leaf)
-			return -1;
+		if (i + 2 == entries || fileblock < __le32_to_cpu(ext[i + 2].block))
+			return i + 1;
+	}
 
-		ext = (struct ext4_extent*)(leaf + 1);
-		for (i = 0; i < __le16_to_cpu(leaf->entries); i++)
-		{
-			if (fileblock < __le32_to_cpu(ext[i].block))
-				break;
+	/* Binary search for the last extent starting at or before fileblock */
+	lo = 0;
+	hi = entries - 1;
+	i = -1;
+
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+
+		if (__le32_to_cpu(ext[mid].block) <= fileblock)
+		{
+			i = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+
+	return i;
+}
+
+/* Length of the extent in blocks, unwritten receives whether it's preallocated */
+static uint32_t ext4_extent_len(struct ext4_extent* ext, int* unwritten)
+{
+	uint32_t len = __le16_to_cpu(ext->len);
+
+	*unwritten = len > EXT4_EXT_INIT_MAX_LEN;
+	return *unwritten ? len - EXT4_EXT_INIT_MAX_LEN : len;
+}
+
+/* Blocks from index on in a block map that are all holes or consecutive on disk */
+static uint32_t ext2fs_indir_run(uint32_t* map, uint32_t index, uint32_t count)
+{
+	uint32_t first = __le32_to_cpu(map[index]);
+	uint32_t i;
+
+	for (i = 1; index + i < count; i++)
+	{
+		if (__le32_to_cpu(map[index + i]) != (first ? first + i : 0))
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * Map file block to filesystem block (0 = hole, -1 = error). Run receives the
+ * number of blocks from fileblock on known to be physically contiguous, or for
+ * a hole (or an unwritten extent) the number of blocks known to read as zeroes.
+ * A hole run may go past the end of the file.
+ */
+static uint64_t ext2fs_read_block(ext2fs_node_t node, uint64_t fileblock, uint32_t* run)
+{
+	struct ext2_data* data = node->data;
+	struct ext2_inode* inode = &node->inode;
+	uint64_t blknr;
+	int blksz = EXT2_BLOCK_SIZE(data);
+	uint32_t* indir;
+
+	*run = 1;
+
+	/* Ext4 extension */
+	if (__le32_to_cpu(inode->flags) & EXT4_EXTENTS_FLAG)
+	{
+		struct ext4_extent_cursor* cursor = &node->cursor;
+		ext4_extent_header_t leaf;
+		struct ext4_extent* ext;
+		int i;
+
+		/* Walk the tree only when leaving the current leaf */
+		if (!cursor->leaf || fileblock < cursor->first || fileblock >= cursor->end)
+		{
+			cursor->leaf = NULL;
+			cursor->index = -1;
+
+			leaf = ext4_find_leaf(data, (ext4_extent_header_t)inode->b.blocks.dir_blocks, fileblock, &cursor->first, &cursor->end);
+			if (!leaf)
+				return -1;
+
+			/* Leaves outside the inode live in the block cache, keep a copy */
+			if (leaf != (ext4_extent_header_t)inode->b.blocks.dir_blocks)
+			{
+				memcpy(cursor->buf, leaf, blksz);
+				leaf = (ext4_extent_header_t)cursor->buf;
+			}
+
+			cursor->leaf = leaf;
 		}
 
-		if (--i >= 0)
+		leaf = cursor->leaf;
+		ext = (struct ext4_extent*)(leaf + 1);
+
+		i = ext4_find_extent(cursor, fileblock);
+		cursor->index = i;
+
+		if (i >= 0)
 		{
-			fileblock -= __le32_to_cpu(ext[i].block);
-			if (fileblock >= __le16_to_cpu(ext[i].len))
-				return 0;
-			else
+			uint32_t offset = fileblock - __le32_to_cpu(ext[i].block);
+			uint32_t len;
+			int unwritten;
+
+			len = ext4_extent_len(&ext[i], &unwritten);
+			if (offset < len)
 			{
 				uint64_t start;
 
+				*run = len - offset;
+
+				/* Preallocated, reads as zeroes without touching the disk */
+				if (unwritten)
+					return 0;
+
 				start = __le16_to_cpu(ext[i].start_hi);
 				start = (start << 32) + __le32_to_cpu(ext[i].start);
 
-				return fileblock + start;
+				return offset + start;
 			}
 		}
+
+		/* Hole up to the next extent, or the end of the leaf */
+		if (i + 1 < __le16_to_cpu(leaf->entries))
+			*run = __le32_to_cpu(ext[i + 1].block) - fileblock;
 		else
-			return -1;
+			*run = cursor->end - fileblock;
+
+		return 0;
 	}
 
 	/* Direct blocks.  */
 	if (fileblock < INDIRECT_BLOCKS)
+	{
+		*run = ext2fs_indir_run(inode->b.blocks.dir_blocks, fileblock, INDIRECT_BLOCKS);
 		blknr = __le32_to_cpu(inode->b.blocks.dir_blocks[fileblock]);
+	}
 	/* Indirect.  */
 	else if (fileblock < (INDIRECT_BLOCKS + (blksz / 4)))
 	{
-		uint32_t indir[blksz / 4];
+		uint32_t perblock = blksz / 4;
+		uint32_t rblock = fileblock - INDIRECT_BLOCKS;
 
-		status = ext2fs_devread(__le32_to_cpu(inode->b.blocks.indir_block) << log2_blksz, 0, blksz, (char*)indir);
-		if (status)
+		/* No indirect block, the whole range is a hole */
+		if (!inode->b.blocks.indir_block)
+		{
+			*run = perblock - rblock;
+			return 0;
+		}
+
+		indir = (uint32_t*)ext2fs_cache_block(data, __le32_to_cpu(inode->b.blocks.indir_block));
+		if (!indir)
 		{
 			printf("** ext2fs read block (indir 1) failed. **\n");
 			return -1;
 		}
-		blknr = __le32_to_cpu(indir[fileblock - INDIRECT_BLOCKS]);
+
+		*run = ext2fs_indir_run(indir, rblock, perblock);
+		blknr = __le32_to_cpu(indir[rblock]);
 	}
 	/* Double indirect.  */
 	else if (fileblock < (INDIRECT_BLOCKS + (blksz / 4 * (blksz / 4 + 1))))
 	{
 		uint32_t perblock = blksz / 4;
 		uint32_t rblock = fileblock - (INDIRECT_BLOCKS  + blksz / 4);
-		uint32_t indir[blksz / 4];
 
-		status = ext2fs_devread(__le32_to_cpu(inode->b.blocks.double_indir_block) << log2_blksz, 0, blksz, (char*)indir);
-		if (status)
+		if (!inode->b.blocks.double_indir_block)
+		{
+			*run = perblock * perblock - rblock;
+			return 0;
+		}
+
+		indir = (uint32_t*)ext2fs_cache_block(data, __le32_to_cpu(inode->b.blocks.double_indir_block));
+		if (!indir)
 		{
 			printf("** ext2fs read block (indir 2 1) failed. **\n");
 			return -1;
 		}
 
-		status = ext2fs_devread(__le32_to_cpu(indir[rblock / perblock]) << log2_blksz, 0, blksz, (char*)indir);
-		if (status)
+		if (!indir[rblock / perblock])
+		{
+			*run = perblock - rblock % perblock;
+			return 0;
+		}
+
+		indir = (uint32_t*)ext2fs_cache_block(data, __le32_to_cpu(indir[rblock / perblock]));
+		if (!indir)
 		{
 			printf("** ext2fs read block (indir 2 2) failed. **\n");
 			return -1;
 		}
 
+		*run = ext2fs_indir_run(indir, rblock % perblock, perblock);
 		blknr = __le32_to_cpu(indir[rblock % perblock]);
 	}
 	/* Tripple indirect.  */
@@ -416,29 +1144,47 @@ static uint64_t ext2fs_read_block(ext2fs_node_t node, uint64_t fileblock)
 	{
 		uint32_t perblock = blksz / 4;
 		uint32_t rblock = fileblock - (INDIRECT_BLOCKS + blksz / 4 * (blksz / 4 + 1));
-		uint32_t indir[blksz / 4];
 
-		status = ext2fs_devread(__le32_to_cpu(inode->b.blocks.triple_indir_block) << log2_blksz, 0, blksz, (char*)indir);
-		if (status)
+		if (!inode->b.blocks.triple_indir_block)
+		{
+			*run = perblock * perblock * perblock - rblock;
+			return 0;
+		}
+
+		indir = (uint32_t*)ext2fs_cache_block(data, __le32_to_cpu(inode->b.blocks.triple_indir_block));
+		if (!indir)
 		{
 			printf("** ext2fs read block (indir 3 1) failed. **\n");
 			return -1;
 		}
 
-		status = ext2fs_devread(__le32_to_cpu(indir[rblock / perblock]) << log2_blksz, 0, blksz, (char*)indir);
-		if (status)
+		if (!indir[rblock / (perblock * perblock)])
+		{
+			*run = perblock * perblock - rblock % (perblock * perblock);
+			return 0;
+		}
+
+		indir = (uint32_t*)ext2fs_cache_block(data, __le32_to_cpu(indir[rblock / (perblock * perblock)]));
+		if (!indir)
 		{
 			printf("** ext2fs read block (indir 3 2) failed. **\n");
 			return -1;
 		}
 
-		status = ext2fs_devread(__le32_to_cpu(indir[rblock / perblock]) << log2_blksz, 0, blksz, (char*)indir);
-		if (status)
+		if (!indir[(rblock / perblock) % perblock])
+		{
+			*run = perblock - rblock % perblock;
+			return 0;
+		}
+
+		indir = (uint32_t*)ext2fs_cache_block(data, __le32_to_cpu(indir[(rblock / perblock) % perblock]));
+		if (!indir)
 		{
 			printf("** ext2fs read block (indir 3 3) failed. **\n");
 			return -1;
 		}
 
+		*run = ext2fs_indir_run(indir, rblock % perblock, perblock);
 		blknr = __le32_to_cpu(indir[rblock % perblock]);
 	}
 	else
@@ -452,12 +1198,16 @@ static uint64_t ext2fs_read_block(ext2fs_node_t node, uint64_t fileblock)
 
 int ext2fs_read_file(ext2fs_node_t node, int pos, unsigned int len, char* buf)
 {
-	uint64_t i;
-	int blockcnt;
+	uint64_t fileblock, lastblock, blknr, nextblk;
+	uint32_t run, nextrun, skipfirst, chunk;
+	unsigned int done;
 	int log2blocksize = LOG2_EXT2_BLOCK_SIZE(node->data);
 	int blocksize = 1 << (log2blocksize + DISK_SECTOR_BITS);
 	unsigned int filesize = __le32_to_cpu(node->inode.size);
 
+	if (pos < 0 || (unsigned int)pos >= filesize)
+		return 0;
+
 	/* Adjust len so it we can't read past the end of the file. */
 	if (pos + len > filesize)
 		len = filesize - pos;
@@ -465,593 +1215,2561 @@ int ext2fs_read_file(ext2fs_node_t node, int pos, unsigned int len, char* buf)
 	if (len == 0)
 		return 0;
 
-	blockcnt = ((len + pos) + blocksize - 1) / blocksize;
+	if (ext2fs_is_inline(node))
+		return ext2fs_read_inline(node, pos, len, buf);
 
-	for (i = pos / blocksize; i < blockcnt; i++)
-	{
-		uint64_t blknr;
-		uint32_t blockoff = pos % blocksize;
-		uint32_t blockend = blocksize;
-		uint32_t skipfirst = 0;
+	fileblock = pos / blocksize;
+	lastblock = (pos + len - 1) / blocksize;
+	skipfirst = pos % blocksize;
+	done = 0;
 
-		blknr = ext2fs_read_block(node, i);
-		if (blknr < 0)
+	/* Read whole physically contiguous runs at once, straight into buf */
+	while (fileblock <= lastblock)
+	{
+		blknr = ext2fs_read_block(node, fileblock, &run);
+		if (blknr == (uint64_t)-1)
 			return -1;
 
-		blknr = blknr << log2blocksize;
-
-		/* Last block.  */
-		if (i == blockcnt - 1)
+		while (fileblock + run <= lastblock)
 		{
-			blockend = (len + pos) % blocksize;
+			nextblk = ext2fs_read_block(node, fileblock + run, &nextrun);
+			if (nextblk == (uint64_t)-1)
+				return -1;
 
-			/* The last portion is exactly blocksize.  */
-			if (!blockend)
-				blockend = blocksize;
-		}
+			/* Holes merge with holes, blocks with the next block on disk */
+			if (blknr ? (nextblk != blknr + run) : (nextblk != 0))
+				break;
 
-		/* First block.  */
-		if (i == pos / blocksize)
-		{
-			skipfirst = blockoff;
-			blockend -= skipfirst;
+			/* Hole runs may reach far past the file */
+			if (nextrun > lastblock + 1 - fileblock - run)
+				nextrun = lastblock + 1 - fileblock - run;
+
+			run += nextrun;
 		}
 
-		/* If the block number is 0 this block is not stored on disk but
-		   is zero filled instead.  */
+		if (run > lastblock - fileblock + 1)
+			run = lastblock - fileblock + 1;
+
+		chunk = run * blocksize - skipfirst;
+		if (chunk > len - done)
+			chunk = len - done;
+
+		/* If the block number is 0 the run is not stored on disk (a hole
+		   or an unwritten extent) but is zero filled instead.  */
 		if (blknr)
 		{
-			int status;
-
-			status = ext2fs_devread(blknr, skipfirst, blockend, buf);
-			if (status)
+			if (ext2fs_devread(node->data, blknr << log2blocksize, skipfirst, chunk, buf + done))
 				return -1;
 		}
 		else
-			memset(buf, 0, blocksize - skipfirst);
+			memset(buf + done, 0, chunk);
 
-		buf += blocksize - skipfirst;
+		done += chunk;
+		fileblock += run;
+		skipfirst = 0;
 	}
+
 	return len;
 }
 
-static int ext2fs_iterate_dir(ext2fs_node_t dir, char* name, ext2fs_node_t* fnode, int* ftype)
+/* Create node for a matched directory entry */
+static int ext2fs_dir_match(struct ext2_data* data, struct ext2_dirent* dirent, ext2fs_node_t* fnode, int* ftype)
 {
-	unsigned int fpos = 0;
+	ext2fs_node_t fdiro;
+	int type = FILETYPE_UNKNOWN;
 	int status;
-	struct ext2fs_node* diro = (struct ext2fs_node*) dir;
 
-	if(!diro->inode_read)
+	fdiro = ext2fs_alloc_node(data, __le32_to_cpu(dirent->inode));
+	if (!fdiro)
+		return 1;
+
+	if (dirent->filetype != FILETYPE_UNKNOWN)
 	{
-		status = ext2fs_read_inode(diro->data, diro->ino, &diro->inode);
-		if (status)
-			return 1;
+		fdiro->inode_read = 0;
+
+		if (dirent->filetype == FILETYPE_DIRECTORY)
+			type = FILETYPE_DIRECTORY;
+		else if (dirent->filetype == FILETYPE_SYMLINK)
+			type = FILETYPE_SYMLINK;
+		else if (dirent->filetype == FILETYPE_REG)
+			type = FILETYPE_REG;
 	}
-
-	/* Search the file.  */
-	while(fpos < __le32_to_cpu(diro->inode.size))
+	else
 	{
-		struct ext2_dirent dirent;
-
-		status = ext2fs_read_file(diro, fpos, sizeof(struct ext2_dirent), (char*) &dirent);
-		if (status < 1)
+		/* The filetype can not be read from the dirent, get it from inode */
+		status = ext2fs_read_inode(data, fdiro->ino, &fdiro->inode);
+		if (status)
+		{
+			ext2fs_free_node(fdiro, NULL);
 			return 1;
+		}
+		fdiro->inode_read = 1;
+
+		if ((__le16_to_cpu(fdiro->inode.mode) & FILETYPE_INO_MASK) == FILETYPE_INO_DIRECTORY)
+			type = FILETYPE_DIRECTORY;
+		else if ((__le16_to_cpu(fdiro->inode.mode) & FILETYPE_INO_MASK) == FILETYPE_INO_SYMLINK)
+			type = FILETYPE_SYMLINK;
+		else if ((__le16_to_cpu(fdiro->inode.mode) & FILETYPE_INO_MASK) == FILETYPE_INO_REG)
+			type = FILETYPE_REG;
+	}
 
-		if (dirent.direntlen == 0)
-			return 1;
+	*ftype = type;
+	*fnode = fdiro;
+	return 0;
+}
 
-		if (dirent.namelen != 0)
-		{
-			char filename[dirent.namelen + 1];
-			ext2fs_node_t fdiro;
-			int type = FILETYPE_UNKNOWN;
+/*
+ * Directory hashes (as in linux fs/ext4/hash.c)
+ */
 
-			status = ext2fs_read_file(diro, fpos + sizeof(struct ext2_dirent), dirent.namelen, filename);
-			if (status < 1)
-				return 1;
+#define EXT2_ROL32(x, s)        (((x) << (s)) | ((x) >> (32 - (s))))
+#define EXT2_MD4_F(x, y, z)     ((z) ^ ((x) & ((y) ^ (z))))
+#define EXT2_MD4_G(x, y, z)     (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define EXT2_MD4_H(x, y, z)     ((x) ^ (y) ^ (z))
+#define EXT2_MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = EXT2_ROL32(a, s))
+#define EXT2_MD4_K2             013240474631UL
+#define EXT2_MD4_K3             015666365641UL
+#define EXT2_TEA_DELTA          0x9E3779B9
 
-			fdiro = malloc(sizeof(struct ext2fs_node));
-			if (!fdiro)
-				return 1;
+static void ext2fs_half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	/* Round 1 */
+	EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[0],  3);
+	EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[1],  7);
+	EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[2], 11);
+	EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[3], 19);
+	EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[4],  3);
+	EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[5],  7);
+	EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[6], 11);
+	EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[7], 19);
+
+	/* Round 2 */
+	EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[1] + EXT2_MD4_K2,  3);
+	EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[3] + EXT2_MD4_K2,  5);
+	EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[5] + EXT2_MD4_K2,  9);
+	EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[7] + EXT2_MD4_K2, 13);
+	EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[0] + EXT2_MD4_K2,  3);
+	EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[2] + EXT2_MD4_K2,  5);
+	EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[4] + EXT2_MD4_K2,  9);
+	EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[6] + EXT2_MD4_K2, 13);
+
+	/* Round 3 */
+	EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[3] + EXT2_MD4_K3,  3);
+	EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[7] + EXT2_MD4_K3,  9);
+	EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[2] + EXT2_MD4_K3, 11);
+	EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[6] + EXT2_MD4_K3, 15);
+	EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[1] + EXT2_MD4_K3,  3);
+	EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[5] + EXT2_MD4_K3,  9);
+	EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[0] + EXT2_MD4_K3, 11);
+	EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[4] + EXT2_MD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
 
-			fdiro->data = diro->data;
-			fdiro->ino = __le32_to_cpu(dirent.inode);
+static void ext2fs_tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
 
-			filename[dirent.namelen] = '\0';
+	do
+	{
+		sum += EXT2_TEA_DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	while (--n);
 
-			if (dirent.filetype != FILETYPE_UNKNOWN)
-			{
-				fdiro->inode_read = 0;
-
-				if (dirent.filetype == FILETYPE_DIRECTORY)
-					type = FILETYPE_DIRECTORY;
-				else if (dirent.filetype == FILETYPE_SYMLINK)
-					type = FILETYPE_SYMLINK;
-				else if (dirent.filetype == FILETYPE_REG)
-					type = FILETYPE_REG;
-			}
-			else
-			{
-				/* The filetype can not be read from the dirent, get it from inode */
-				status = ext2fs_read_inode(diro->data,  __le32_to_cpu(dirent.inode), &fdiro->inode);
-				if (status)
-				{
-					free(fdiro);
-					return 1;
-				}
-				fdiro->inode_read = 1;
-
-				if ((__le16_to_cpu(fdiro->inode.mode) & FILETYPE_INO_MASK) == FILETYPE_INO_DIRECTORY)
-					type = FILETYPE_DIRECTORY;
-				else if ((__le16_to_cpu(fdiro->inode.mode) & FILETYPE_INO_MASK) == FILETYPE_INO_SYMLINK)
-					type = FILETYPE_SYMLINK;
-				else if ((__le16_to_cpu(fdiro->inode.mode) & FILETYPE_INO_MASK) == FILETYPE_INO_REG)
-					type = FILETYPE_REG;
-			}
+	buf[0] += b0;
+	buf[1] += b1;
+}
 
-			if ((name != NULL) && (fnode != NULL) && (ftype != NULL))
-			{
-				if (strcmp(filename, name) == 0)
-				{
-					*ftype = type;
-					*fnode = fdiro;
-					return 0;
-				}
-			}
-			else
-			{
-				if (fdiro->inode_read == 0)
-				{
-					status = ext2fs_read_inode(diro->data,  __le32_to_cpu(dirent.inode), &fdiro->inode);
-					if (status)
-					{
-						free(fdiro);
-						return 1;
-					}
-					fdiro->inode_read = 1;
-				}
-			}
-			free(fdiro);
-		}
-		fpos += __le16_to_cpu(dirent.direntlen);
-	}
-	return 1;
+/* Character value, the hash differs for signed and unsigned char platforms */
+static int ext2fs_hash_char(const char* name, int i, int is_unsigned)
+{
+	if (is_unsigned)
+		return ((const unsigned char*)name)[i];
+	else
+		return ((const signed char*)name)[i];
 }
 
-static char* ext2fs_read_symlink(ext2fs_node_t node)
+static uint32_t ext2fs_legacy_hash(const char* name, int len, int is_unsigned)
 {
-	char* symlink;
-	struct ext2fs_node* diro = node;
-	int status;
+	uint32_t hash, hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+	int i;
 
-	if (!diro->inode_read)
+	for (i = 0; i < len; i++)
 	{
-		status = ext2fs_read_inode(diro->data, diro->ino, &diro->inode);
+		hash = hash1 + (hash0 ^ (ext2fs_hash_char(name, i, is_unsigned) * 7152373));
 
-		if (status)
-			return NULL;
-	}
-	symlink = malloc(__le32_to_cpu(diro->inode.size) + 1);
-	if (!symlink)
-		return NULL;
+		if (hash & 0x80000000)
+			hash -= 0x7FFFFFFF;
 
-	/* If the filesize of the symlink is bigger than
-	   60 the symlink is stored in a separate block,
-	   otherwise it is stored in the inode.  */
-	if (__le32_to_cpu(diro->inode.size) <= 60)
-	{
-		strncpy(symlink, diro->inode.b.symlink, __le32_to_cpu(diro->inode.size));
-		symlink[__le32_to_cpu(diro->inode.size) - 1] = '\0';
-	}
-	else
-	{
-		status = ext2fs_read_file(diro, 0, __le32_to_cpu(diro->inode.size), symlink);
-		if (status)
-		{
-			free(symlink);
-			return NULL;
-		}
+		hash1 = hash0;
+		hash0 = hash;
 	}
-	symlink[__le32_to_cpu(diro->inode.size)] = '\0';
-	return symlink;
-}
 
+	return hash0 << 1;
+}
 
-int ext2fs_find_file1(const char* currpath, ext2fs_node_t currroot, ext2fs_node_t* currfound, int* foundtype)
+static void ext2fs_str2hashbuf(const char* msg, int len, uint32_t* buf, int num, int is_unsigned)
 {
-	char fpath[strlen(currpath) + 1];
-	char* name = fpath;
-	char* next;
-	int status;
-	int type = FILETYPE_DIRECTORY;
-	ext2fs_node_t currnode = currroot;
-	ext2fs_node_t oldnode = currroot;
-
-	strncpy(fpath, currpath, ARRAY_SIZE(fpath));
-	fpath[ARRAY_SIZE(fpath) - 1] ='\0';
+	uint32_t pad, val;
+	int i;
 
-	/* Remove all leading slashes.  */
-	while (*name == '/')
-		name++;
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
 
-	if (!*name)
-	{
-		*currfound = currnode;
-		return 1;
-	}
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
 
-	for (;;)
+	for (i = 0; i < len; i++)
 	{
-		int found;
+		val = ext2fs_hash_char(msg, i, is_unsigned) + (val << 8);
 
-		/* Extract the actual part from the pathname.  */
-		next = strchr(name, '/');
-		if (next)
+		if ((i % 4) == 3)
 		{
-			/* Remove all leading slashes.  */
-			while (*next == '/')
-				*(next++) = '\0';
+			*buf++ = val;
+			val = pad;
+			num--;
 		}
+	}
 
-		/* At this point it is expected that the current node is a directory, check if this is true.  */
-		if (type != FILETYPE_DIRECTORY)
-		{
-			ext2fs_free_node(currnode, currroot);
-			return 1;
-		}
+	if (--num >= 0)
+		*buf++ = val;
 
-		oldnode = currnode;
+	while (--num >= 0)
+		*buf++ = pad;
+}
 
-		/* Iterate over the directory.  */
-		found = ext2fs_iterate_dir(currnode, name, &currnode, &type);
-		if (found == 1)
-			return 1;
+static uint32_t ext2fs_dirhash(struct ext2_data* data, const char* name, int len, int version)
+{
+	uint32_t buf[4], in[8], hash;
+	int i, is_unsigned;
 
-		if (found == -1)
+	/* Default seed, unless the filesystem has its own */
+	buf[0] = 0x67452301;
+	buf[1] = 0xEFCDAB89;
+	buf[2] = 0x98BADCFE;
+	buf[3] = 0x10325476;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (data->sblock.hash_seed[i])
 			break;
+	}
 
-		/* Read in the symlink and follow it.  */
-		if (type == FILETYPE_SYMLINK)
-		{
-			char* symlink;
+	if (i < 4)
+	{
+		for (i = 0; i < 4; i++)
+			buf[i] = __le32_to_cpu(data->sblock.hash_seed[i]);
+	}
 
-			/* Test if the symlink does not loop.  */
-			if (++symlinknest == 8)
-			{
-				ext2fs_free_node(currnode, currroot);
-				ext2fs_free_node(oldnode, currroot);
-				return 1;
-			}
+	is_unsigned = version >= EXT2_HASH_LEGACY_UNSIGNED;
 
-			symlink = ext2fs_read_symlink(currnode);
-			ext2fs_free_node(currnode, currroot);
+	switch (version)
+	{
+		case EXT2_HASH_LEGACY:
+		case EXT2_HASH_LEGACY_UNSIGNED:
+			hash = ext2fs_legacy_hash(name, len, is_unsigned);
+			break;
 
-			if (!symlink)
+		case EXT2_HASH_HALF_MD4:
+		case EXT2_HASH_HALF_MD4_UNSIGNED:
+			while (len > 0)
 			{
-				ext2fs_free_node(oldnode, currroot);
-				return 1;
+				ext2fs_str2hashbuf(name, len, in, 8, is_unsigned);
+				ext2fs_half_md4_transform(buf, in);
+				len -= 32;
+				name += 32;
 			}
+			hash = buf[1];
+			break;
 
-			/* The symlink is an absolute path, go back to the root inode.  */
-			if (symlink[0] == '/')
+		default:
+			while (len > 0)
 			{
-				ext2fs_free_node(oldnode, currroot);
-				oldnode = &ext2fs_root->diropen;
+				ext2fs_str2hashbuf(name, len, in, 4, is_unsigned);
+				ext2fs_tea_transform(buf, in);
+				len -= 16;
+				name += 16;
 			}
+			hash = buf[0];
+			break;
+	}
 
-			/* Lookup the node the symlink points to.  */
-			status = ext2fs_find_file1(symlink, oldnode, &currnode, &type);
+	hash = hash & ~1;
+	if (hash == (EXT2_HTREE_EOF << 1))
+		hash = (EXT2_HTREE_EOF - 1) << 1;
 
-			free(symlink);
+	return hash;
+}
 
-			if (status)
-			{
-				ext2fs_free_node(oldnode, currroot);
-				return 1;
-			}
-		}
+/*
+ * Look for name in the directory block in dir_buf.
+ * Returns 0 when found, 1 when not found, -1 on a corrupted block.
+ */
+static int ext2fs_scan_dir_block(struct ext2_data* data, int len, const char* name, unsigned int namelen, ext2fs_node_t* fnode, int* ftype)
+{
+	struct ext2_dirent* dirent;
+	unsigned int off, direntlen;
 
-		ext2fs_free_node(oldnode, currroot);
+	for (off = 0; off + sizeof(struct ext2_dirent) <= (unsigned int)len; off += direntlen)
+	{
+		dirent = (struct ext2_dirent*)(data->dir_buf + off);
+		direntlen = __le16_to_cpu(dirent->direntlen);
 
-		/* Found the node!  */
-		if (!next || *next == '\0')
-		{
-			*currfound = currnode;
-			*foundtype = type;
+		if (direntlen < sizeof(struct ext2_dirent) || off + direntlen > (unsigned int)len)
+			return -1;
+
+		/* Unused entry */
+		if (dirent->inode == 0 || dirent->namelen == 0)
+			continue;
+
+		if ((name == NULL) || (fnode == NULL) || (ftype == NULL))
+			continue;
+
+		if (dirent->namelen != namelen || sizeof(struct ext2_dirent) + namelen > direntlen)
+			continue;
+
+		if (memcmp(data->dir_buf + off + sizeof(struct ext2_dirent), name, namelen))
+			continue;
+
+		return ext2fs_dir_match(data, dirent, fnode, ftype) ? -1 : 0;
+	}
+
+	return 1;
+}
+
+/* Directory block through the block cache (index blocks) */
+static char* ext2fs_dir_index_block(ext2fs_node_t dir, uint32_t fileblock)
+{
+	uint64_t blknr;
+	uint32_t run;
+
+	if ((uint64_t)(fileblock + 1) * EXT2_BLOCK_SIZE(dir->data) > __le32_to_cpu(dir->inode.size))
+		return NULL;
+
+	blknr = ext2fs_read_block(dir, fileblock, &run);
+	if (blknr == (uint64_t)-1 || blknr == 0)
+		return NULL;
+
+	return ext2fs_cache_block(dir->data, blknr);
+}
+
+/*
+ * Hashed directory lookup, descends dx_root / dx_node blocks to the leaf.
+ * Returns 0 when found, 1 when not found, -1 when the index can't be used.
+ */
+static int ext2fs_dx_lookup(ext2fs_node_t dir, const char* name, unsigned int namelen, ext2fs_node_t* fnode, int* ftype)
+{
+	struct ext2_data* data = dir->data;
+	struct ext2_dx_root_info* info;
+	struct ext2_dx_entry* entries;
+	uint32_t path_block[EXT2_DX_MAX_LEVELS];
+	uint32_t path_offset[EXT2_DX_MAX_LEVELS];
+	int path_at[EXT2_DX_MAX_LEVELS];
+	int path_count[EXT2_DX_MAX_LEVELS];
+	uint32_t hash, block, offset;
+	int blksz = EXT2_BLOCK_SIZE(data);
+	int version, levels, level, count, lo, hi, mid, len, status;
+	char* buf;
+
+	buf = ext2fs_dir_index_block(dir, 0);
+	if (!buf)
+		return -1;
+
+	info = (struct ext2_dx_root_info*)(buf + EXT2_DX_ROOT_INFO_OFFSET);
+	if (info->reserved_zero != 0 || info->info_length < sizeof(struct ext2_dx_root_info) || info->hash_version > EXT2_HASH_TEA)
+		return -1;
+
+	version = info->hash_version;
+	if (__le32_to_cpu(data->sblock.flags) & EXT2_FLAGS_UNSIGNED_HASH)
+		version += EXT2_HASH_LEGACY_UNSIGNED;
+
+	levels = info->indirect_levels + 1;
+	if (levels > EXT2_DX_MAX_LEVELS)
+		return -1;
+
+	hash = ext2fs_dirhash(data, name, namelen, version);
+
+	/* Descend, at each level take the last entry with hash <= ours */
+	block = 0;
+	offset = EXT2_DX_ROOT_INFO_OFFSET + info->info_length;
+
+	for (level = 0; level < levels; level++)
+	{
+		if (level > 0)
+		{
+			buf = ext2fs_dir_index_block(dir, block);
+			if (!buf)
+				return -1;
+
+			offset = EXT2_DX_NODE_ENTRIES_OFFSET;
+		}
+
+		entries = (struct ext2_dx_entry*)(buf + offset);
+		count = __le16_to_cpu(((struct ext2_dx_countlimit*)entries)->count);
+		if (count < 1 || offset + count * sizeof(struct ext2_dx_entry) > (uint32_t)blksz)
+			return -1;
+
+		lo = 1;
+		hi = count - 1;
+
+		while (lo <= hi)
+		{
+			mid = (lo + hi) / 2;
+
+			if (__le32_to_cpu(entries[mid].hash) > hash)
+				hi = mid - 1;
+			else
+				lo = mid + 1;
+		}
+
+		path_block[level] = block;
+		path_offset[level] = offset;
+		path_at[level] = lo - 1;
+		path_count[level] = count;
+		block = __le32_to_cpu(entries[lo - 1].block) & EXT2_DX_BLOCK_MASK;
+	}
+
+	while (1)
+	{
+		len = ext2fs_read_file(dir, block * blksz, blksz, data->dir_buf);
+		if (len < (int)sizeof(struct ext2_dirent))
+			return -1;
+
+		status = ext2fs_scan_dir_block(data, len, name, namelen, fnode, ftype);
+		if (status != 1)
+			return status;
+
+		/* Names with the same hash may continue in the following leaf */
+		level = levels - 1;
+		while (++path_at[level] >= path_count[level])
+		{
+			if (level == 0)
+				return 1;
+
+			level--;
+		}
+
+		buf = ext2fs_dir_index_block(dir, path_block[level]);
+		if (!buf)
+			return -1;
+
+		entries = (struct ext2_dx_entry*)(buf + path_offset[level]);
+		if ((__le32_to_cpu(entries[path_at[level]].hash) & ~1) != hash)
+			return 1;
+
+		block = __le32_to_cpu(entries[path_at[level]].block) & EXT2_DX_BLOCK_MASK;
+
+		for (level++; level < levels; level++)
+		{
+			buf = ext2fs_dir_index_block(dir, block);
+			if (!buf)
+				return -1;
+
+			entries = (struct ext2_dx_entry*)(buf + EXT2_DX_NODE_ENTRIES_OFFSET);
+			count = __le16_to_cpu(((struct ext2_dx_countlimit*)entries)->count);
+			if (count < 1 || EXT2_DX_NODE_ENTRIES_OFFSET + count * sizeof(struct ext2_dx_entry) > (uint32_t)blksz)
+				return -1;
+
+			path_block[level] = block;
+			path_offset[level] = EXT2_DX_NODE_ENTRIES_OFFSET;
+			path_at[level] = 0;
+			path_count[level] = count;
+			block = __le32_to_cpu(entries[0].block) & EXT2_DX_BLOCK_MASK;
+		}
+	}
+}
+
+static int ext2fs_iterate_dir(ext2fs_node_t dir, char* name, ext2fs_node_t* fnode, int* ftype)
+{
+	struct ext2fs_node* diro = (struct ext2fs_node*) dir;
+	struct ext2_data* data = diro->data;
+	unsigned int fpos, dirsize, namelen;
+	int blksz = EXT2_BLOCK_SIZE(data);
+	int status, len, ino;
+
+	if(!diro->inode_read)
+	{
+		status = ext2fs_read_inode(diro->data, diro->ino, &diro->inode);
+		if (status)
+			return -1;
+
+		diro->inode_read = 1;
+	}
+
+	namelen = name ? strlen(name) : 0;
+	dirsize = __le32_to_cpu(diro->inode.size);
+
+	/* Hashed directory, fall back to the linear scan if the index is unusable */
+	if ((name != NULL) && (__le32_to_cpu(diro->inode.flags) & EXT2_INDEX_FLAG) &&
+	    (__le32_to_cpu(data->sblock.feature_compatibility) & EXT2_FEATURE_COMPAT_DIR_INDEX))
+	{
+		status = ext2fs_dx_lookup(diro, name, namelen, fnode, ftype);
+		if (status >= 0)
+			return status;
+	}
+
+	/* Inline directory: the parent inode, entries in i_block, more entries in the xattr */
+	if (ext2fs_is_inline(diro))
+	{
+		/* There are no "." and ".." entries, ".." is the parent inode */
+		if (name && name[0] == '.' && (namelen == 1 || (namelen == 2 && name[1] == '.')))
+		{
+			ino = namelen == 1 ? diro->ino : __le32_to_cpu(diro->inode.b.blocks.dir_blocks[0]);
+
+			*fnode = ext2fs_alloc_node(data, ino);
+			if (!*fnode)
+				return -1;
+
+			*ftype = FILETYPE_DIRECTORY;
 			return 0;
 		}
-		name = next;
+
+		len = ext2fs_read_file(diro, EXT4_INLINE_DOTDOT_SIZE, EXT4_MIN_INLINE_DATA_SIZE - EXT4_INLINE_DOTDOT_SIZE, data->dir_buf);
+		if (len < (int)sizeof(struct ext2_dirent))
+			return -1;
+
+		status = ext2fs_scan_dir_block(data, len, name, namelen, fnode, ftype);
+		if (status != 1 || dirsize <= EXT4_MIN_INLINE_DATA_SIZE)
+			return status;
+
+		len = ext2fs_read_file(diro, EXT4_MIN_INLINE_DATA_SIZE, dirsize - EXT4_MIN_INLINE_DATA_SIZE, data->dir_buf);
+		if (len < (int)sizeof(struct ext2_dirent))
+			return -1;
+
+		return ext2fs_scan_dir_block(data, len, name, namelen, fnode, ftype);
+	}
+
+	/* Search the file, a whole directory block at a time.  */
+	for (fpos = 0; fpos < dirsize; fpos += blksz)
+	{
+		len = ext2fs_read_file(diro, fpos, blksz, data->dir_buf);
+		if (len < (int)sizeof(struct ext2_dirent))
+			return -1;
+
+		status = ext2fs_scan_dir_block(data, len, name, namelen, fnode, ftype);
+		if (status != 1)
+			return status;
+	}
+
+	return 1;
+}
+
+/* Find cached entry name in directory parent */
+static struct ext2_dentry* ext2fs_dcache_find(struct ext2_data* data, int parent, const char* name)
+{
+	int i;
+
+	for (i = 0; i < EXT2FS_DCACHE_ENTRIES; i++)
+	{
+		if (data->dcache[i].parent == parent && !strcmp(data->dcache[i].name, name))
+		{
+			data->dcache[i].last_used = ++data->dcache_tick;
+			return &data->dcache[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Store lookup result, the least recently used entry is replaced */
+static void ext2fs_dcache_add(struct ext2_data* data, int parent, const char* name, int ino, int type)
+{
+	struct ext2_dentry* dentry;
+	int i;
+
+	if (strlen(name) >= EXT2FS_DCACHE_NAME)
+		return;
+
+	dentry = &data->dcache[0];
+	for (i = 0; i < EXT2FS_DCACHE_ENTRIES; i++)
+	{
+		if (data->dcache[i].parent == 0)
+		{
+			dentry = &data->dcache[i];
+			break;
+		}
+
+		if (data->dcache[i].last_used < dentry->last_used)
+			dentry = &data->dcache[i];
+	}
+
+	dentry->parent = parent;
+	dentry->ino = ino;
+	dentry->type = type;
+	dentry->last_used = ++data->dcache_tick;
+	dentry->symlink[0] = '\0';
+	strncpy(dentry->name, name, EXT2FS_DCACHE_NAME);
+}
+
+/* Cached target of symlink ino, or NULL */
+static char* ext2fs_dcache_symlink(struct ext2_data* data, int ino)
+{
+	int i;
+
+	for (i = 0; i < EXT2FS_DCACHE_ENTRIES; i++)
+	{
+		if (data->dcache[i].parent != 0 && data->dcache[i].ino == ino &&
+		    data->dcache[i].type == FILETYPE_SYMLINK && data->dcache[i].symlink[0] != '\0')
+		{
+			data->dcache[i].last_used = ++data->dcache_tick;
+			return data->dcache[i].symlink;
+		}
+	}
+
+	return NULL;
+}
+
+/* Remember the target of symlink ino if it is short enough */
+static void ext2fs_dcache_set_symlink(struct ext2_data* data, int ino, const char* symlink)
+{
+	int i;
+
+	if (strlen(symlink) >= EXT2FS_DCACHE_SYMLINK)
+		return;
+
+	for (i = 0; i < EXT2FS_DCACHE_ENTRIES; i++)
+	{
+		if (data->dcache[i].parent != 0 && data->dcache[i].ino == ino && data->dcache[i].type == FILETYPE_SYMLINK)
+			strncpy(data->dcache[i].symlink, symlink, EXT2FS_DCACHE_SYMLINK);
+	}
+}
+
+/*
+ * Look up name in directory dir through the directory entry cache.
+ * Returns 0 when found, 1 when not found, -1 on error.
+ */
+static int ext2fs_lookup(ext2fs_node_t dir, char* name, ext2fs_node_t* fnode, int* ftype)
+{
+	struct ext2_data* data = dir->data;
+	struct ext2_dentry* dentry;
+	int status;
+
+	dentry = ext2fs_dcache_find(data, dir->ino, name);
+	if (dentry)
+	{
+		data->dcache_hits++;
+		iostats_hit(IOSTATS_CACHE_DENTRY);
+
+		if (dentry->ino == 0)
+			return 1;
+
+		*fnode = ext2fs_alloc_node(data, dentry->ino);
+		if (!*fnode)
+			return -1;
+
+		*ftype = dentry->type;
+		return 0;
+	}
+
+	data->dcache_misses++;
+	iostats_miss(IOSTATS_CACHE_DENTRY);
+
+	status = ext2fs_iterate_dir(dir, name, fnode, ftype);
+	if (status == 0)
+		ext2fs_dcache_add(data, dir->ino, name, (*fnode)->ino, *ftype);
+	else if (status == 1)
+		ext2fs_dcache_add(data, dir->ino, name, 0, FILETYPE_UNKNOWN);
+
+	return status;
+}
+
+/* Read symlink target into the arena (caller releases it) */
+static char* ext2fs_read_symlink(ext2fs_node_t node)
+{
+	char* symlink;
+	struct ext2fs_node* diro = node;
+	int status;
+
+	unsigned int size;
+
+	if (!diro->inode_read)
+	{
+		status = ext2fs_read_inode(diro->data, diro->ino, &diro->inode);
+
+		if (status)
+			return NULL;
+
+		diro->inode_read = 1;
+	}
+
+	size = __le32_to_cpu(diro->inode.size);
+	if (size == 0)
+		return NULL;
+
+	symlink = ext2fs_arena_alloc(diro->data, size + 1);
+	if (!symlink)
+		return NULL;
+
+	/* Fast symlinks (shorter than 60) are stored in i_block, longer ones
+	   inline (i_block and the xattr) or in a separate block.  */
+	if (size < EXT4_MIN_INLINE_DATA_SIZE && !ext2fs_is_inline(diro))
+		memcpy(symlink, diro->inode.b.symlink, size);
+	else
+	{
+		status = ext2fs_read_file(diro, 0, size, symlink);
+		if (status != (int)size)
+			return NULL;
+	}
+
+	symlink[size] = '\0';
+	return symlink;
+}
+
+
+int ext2fs_find_file1(const char* currpath, ext2fs_node_t currroot, ext2fs_node_t* currfound, int* foundtype)
+{
+	char fpath[strlen(currpath) + 1];
+	char* name = fpath;
+	char* next;
+	int status;
+	int type = FILETYPE_DIRECTORY;
+	ext2fs_node_t currnode = currroot;
+	ext2fs_node_t oldnode = currroot;
+
+	strncpy(fpath, currpath, ARRAY_SIZE(fpath));
+	fpath[ARRAY_SIZE(fpath) - 1] ='\0';
+
+	/* Remove all leading slashes.  */
+	while (*name == '/')
+		name++;
+
+	if (!*name)
+	{
+		*currfound = currnode;
+		return 1;
 	}
 
-	return -1;
+	for (;;)
+	{
+		int found;
+
+		/* Extract the actual part from the pathname.  */
+		next = strchr(name, '/');
+		if (next)
+		{
+			/* Remove all leading slashes.  */
+			while (*next == '/')
+				*(next++) = '\0';
+		}
+
+		/* At this point it is expected that the current node is a directory, check if this is true.  */
+		if (type != FILETYPE_DIRECTORY)
+		{
+			ext2fs_free_node(currnode, currroot);
+			return 1;
+		}
+
+		oldnode = currnode;
+
+		/* Look the name up in the directory.  */
+		found = ext2fs_lookup(currnode, name, &currnode, &type);
+		if (found)
+		{
+			ext2fs_free_node(oldnode, currroot);
+			return found;
+		}
+
+		/* Read in the symlink and follow it.  */
+		if (type == FILETYPE_SYMLINK)
+		{
+			char* symlink;
+			char* cached;
+			uint32_t mark;
+
+			/* Test if the symlink does not loop.  */
+			if (++symlinknest == EXT2_MAX_SYMLINKCNT)
+			{
+				ext2fs_free_node(currnode, currroot);
+				ext2fs_free_node(oldnode, currroot);
+				return 1;
+			}
+
+			mark = ext2fs_arena_mark(currroot->data);
+			cached = ext2fs_dcache_symlink(currroot->data, currnode->ino);
+			if (cached)
+				symlink = cached;
+			else
+			{
+				symlink = ext2fs_read_symlink(currnode);
+				if (symlink)
+					ext2fs_dcache_set_symlink(currroot->data, currnode->ino, symlink);
+			}
+
+			ext2fs_free_node(currnode, currroot);
+
+			/* Not a miss, the target couldn't be read (or there's no space for it) */
+			if (!symlink)
+			{
+				ext2fs_arena_release(currroot->data, mark);
+				ext2fs_free_node(oldnode, currroot);
+				return -1;
+			}
+
+			/* The symlink is an absolute path, go back to the root inode.  */
+			if (symlink[0] == '/')
+			{
+				ext2fs_free_node(oldnode, currroot);
+				oldnode = &currroot->data->diropen;
+			}
+
+			/* Lookup the node the symlink points to (the path is copied first, so a cached target may be evicted).  */
+			status = ext2fs_find_file1(symlink, oldnode, &currnode, &type);
+
+			ext2fs_arena_release(currroot->data, mark);
+
+			if (status)
+			{
+				ext2fs_free_node(oldnode, currroot);
+				return status;
+			}
+		}
+
+		ext2fs_free_node(oldnode, currroot);
+
+		/* Found the node!  */
+		if (!next || *next == '\0')
+		{
+			*currfound = currnode;
+			*foundtype = type;
+			return 0;
+		}
+		name = next;
+	}
+
+	return -1;
+}
+
+
+int ext2fs_find_file(const char* path, ext2fs_node_t rootnode, ext2fs_node_t* foundnode, int expecttype)
+{
+	int status;
+	int foundtype = FILETYPE_DIRECTORY;
+
+	symlinknest = 0;
+	if (!path)
+		return 1;
+
+	/* 1 when there's no such file, -1 on an error */
+	status = ext2fs_find_file1(path, rootnode, foundnode, &foundtype);
+	if (status)
+		return status;
+
+	/* Check if the node that was found was of the expected type.  */
+	if ((expecttype == FILETYPE_REG) && (foundtype != expecttype))
+		return 1;
+	else if ((expecttype == FILETYPE_DIRECTORY)  && (foundtype != expecttype))
+		return 1;
+
+	return 0;
+}
+
+
+int ext2fs_ls(const char* dirname)
+{
+	ext2fs_node_t dirnode;
+	int status;
+
+	if (ext2fs_root == NULL)
+		return 1;
+
+	status = ext2fs_find_file(dirname, &ext2fs_root->diropen, &dirnode, FILETYPE_DIRECTORY);
+
+	if (status)
+	{
+		printf("** Can not find directory. **\n");
+		return 1;
+	}
+
+	ext2fs_iterate_dir(dirnode, NULL, NULL, NULL);
+	ext2fs_free_node(dirnode, &ext2fs_root->diropen);
+	return 0;
+}
+
+static void ext2fs_free_data(struct ext2_data* data)
+{
+	printf("EXT2FS: %s block cache %d hits, %d misses\n", data->partition, data->cache_hits, data->cache_misses);
+	printf("EXT2FS: %s dentry cache %d hits, %d misses\n", data->partition, data->dcache_hits, data->dcache_misses);
+	printf("EXT2FS: %s arena %d of %d bytes used at peak\n", data->partition, data->arena_peak, data->arena_size);
+
+	if (data->pt_handle != -1)
+		close_partition(data->pt_handle);
+
+	if (data->dev)
+		blockdev_close(data->dev);
+
+	if (data->arena)
+		free(data->arena);
+
+	free(data);
+}
+
+/* Set up the mount arena: node pool, block cache, directory buffer, inode table locations and scratch */
+static int ext2fs_init_arena(struct ext2_data* data)
+{
+	uint32_t desc_size, gdt_blocks, scratch;
+	int blksz = EXT2_BLOCK_SIZE(data);
+	int i;
+
+	gdt_blocks = ext2fs_descriptor_blocks(data, &desc_size);
+	if (!gdt_blocks)
+		return 1;
+
+	/* The descriptor table is read into the scratch space at mount */
+	scratch = EXT2FS_ARENA_SCRATCH(blksz);
+	if (gdt_blocks * blksz > scratch)
+		scratch = gdt_blocks * blksz;
+
+	data->arena_size = ((EXT2FS_NODE_POOL * sizeof(struct ext2fs_node) + 7) & ~7) +
+	                   (EXT2FS_NODE_POOL + EXT2FS_CACHE_BLOCKS + 2) * blksz +
+	                   ((data->group_count * sizeof(uint64_t) + 7) & ~7) +
+	                   scratch;
+
+	data->arena = malloc(data->arena_size);
+	if (!data->arena)
+		return 1;
+
+	data->node_pool = ext2fs_arena_alloc(data, EXT2FS_NODE_POOL * sizeof(struct ext2fs_node));
+	for (i = 0; i < EXT2FS_NODE_POOL; i++)
+		data->node_pool[i].cursor.buf = ext2fs_arena_alloc(data, blksz);
+
+	for (i = 0; i < EXT2FS_CACHE_BLOCKS; i++)
+		data->cache[i].buf = ext2fs_arena_alloc(data, blksz);
+
+	data->dir_buf = ext2fs_arena_alloc(data, blksz);
+	data->diropen.cursor.buf = ext2fs_arena_alloc(data, blksz);
+	return 0;
+}
+
+/* Device access setting of partition */
+static int ext2fs_get_io(const char* partition)
+{
+	int i;
+
+	for (i = 0; i < EXT2FS_MAX_IO_PREFS; i++)
+	{
+		if (!strcmp(ext2fs_io_prefs[i].partition, partition))
+			return ext2fs_io_prefs[i].io;
+	}
+
+	return ext2fs_default_io;
+}
+
+/* Switch the device access of a mount, raw access falls back to the partition API */
+static void ext2fs_mount_set_io(struct ext2_data* data, int io)
+{
+	/* SD card mount, there is no partition API */
+	if (data->pt_handle == -1)
+		return;
+
+	data->pt_pos = (uint64_t)-1;
+
+	if (io == EXT2FS_IO_RAW && data->dev == NULL)
+	{
+		data->dev = blockdev_open(data->partition, data->pt_size);
+		if (!data->dev)
+			printf("EXT2FS: %s raw access unavailable, using the partition API\n", data->partition);
+	}
+	else if (io == EXT2FS_IO_PARTITION && data->dev != NULL)
+	{
+		blockdev_close(data->dev);
+		data->dev = NULL;
+	}
+}
+
+static struct ext2_data* ext2fs_mount_partition(const char* partition)
+{
+	struct ext2_data* data;
+	int status;
+
+	data = malloc(sizeof(struct ext2_data));
+	if (!data)
+		return NULL;
+
+	memset(data, 0, sizeof(struct ext2_data));
+	strncpy(data->partition, partition, ARRAY_SIZE(data->partition));
+	data->partition[ARRAY_SIZE(data->partition) - 1] = '\0';
+	data->pt_handle = -1;
+	data->pt_pos = (uint64_t)-1;
+
+	if (blockdev_sd_partition(partition))
+	{
+		/* SD card partitions are only reachable through the block device */
+		data->dev = blockdev_open(partition, 0);
+		if (!data->dev)
+			goto fail;
+
+		data->pt_size = blockdev_size(data->dev);
+	}
+	else
+	{
+		/* Open the partition */
+		status = open_partition(partition, PARTITION_OPEN_READ, &data->pt_handle);
+		if (status)
+		{
+			data->pt_handle = -1;
+			goto fail;
+		}
+
+		/* Get partition size */
+		if (get_partition_size(partition, &data->pt_size))
+			goto fail;
+
+		ext2fs_mount_set_io(data, ext2fs_get_io(partition));
+	}
+
+	/* Read the superblock.  */
+	status = ext2fs_devread(data, 1 * 2, 0, sizeof(struct ext2_sblock), (char*) &data->sblock);
+	if (status)
+		goto fail;
+
+	/* Make sure this is an ext2 filesystem.  */
+	if (__le16_to_cpu(data->sblock.magic) != EXT2_MAGIC)
+		goto fail;
+
+	if (__le32_to_cpu(data->sblock.revision_level) == 0)
+		data->inode_size = 128;
+	else
+		data->inode_size = __le16_to_cpu(data->sblock.inode_size);
+
+	/* Set up the arena (block cache and the rest) */
+	if (ext2fs_init_arena(data))
+		goto fail;
+
+	/* Read the group descriptors */
+	if (ext2fs_read_descriptors(data))
+		goto fail;
+
+	data->diropen.data = data;
+	data->diropen.ino = 2;
+	data->diropen.inode_read = 1;
+	data->inode = &data->diropen.inode;
+
+	status = ext2fs_read_inode(data, 2, data->inode);
+	if (status)
+		goto fail;
+
+	return data;
+
+fail:
+	printf("Failed to mount ext2 filesystem...\n");
+	ext2fs_free_data(data);
+	return NULL;
+}
+
+static struct ext2fs_file* ext2fs_get_file(int fd)
+{
+	if (fd < 0 || fd >= EXT2FS_MAX_FILES || ext2fs_files[fd].node == NULL)
+		return NULL;
+
+	return &ext2fs_files[fd];
+}
+
+/* Is any file open on the filesystem */
+static int ext2fs_mount_busy(struct ext2_data* data)
+{
+	int i;
+
+	for (i = 0; i < EXT2FS_MAX_FILES; i++)
+	{
+		if (ext2fs_files[i].node != NULL && ext2fs_files[i].node->data == data)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Find or create the mount of partition */
+static struct ext2_data* ext2fs_get_mount(const char* partition)
+{
+	struct ext2_data* data;
+	int i, slot;
+
+	slot = -1;
+	for (i = 0; i < EXT2FS_MAX_MOUNTS; i++)
+	{
+		data = ext2fs_mounts[i];
+
+		if (data != NULL && !strcmp(data->partition, partition))
+		{
+			data->last_used = ++ext2fs_mount_tick;
+			return data;
+		}
+
+		/* Free slot, or the least recently used one without open files */
+		if (data == NULL)
+		{
+			if (slot == -1 || ext2fs_mounts[slot] != NULL)
+				slot = i;
+		}
+		else if (data != ext2fs_root && !ext2fs_mount_busy(data))
+		{
+			if (slot == -1 || (ext2fs_mounts[slot] != NULL && data->last_used < ext2fs_mounts[slot]->last_used))
+				slot = i;
+		}
+	}
+
+	if (slot == -1)
+		return NULL;
+
+	if (ext2fs_mounts[slot] != NULL)
+	{
+		ext2fs_free_data(ext2fs_mounts[slot]);
+		ext2fs_mounts[slot] = NULL;
+	}
+
+	data = ext2fs_mount_partition(partition);
+	if (!data)
+		return NULL;
+
+	data->last_used = ++ext2fs_mount_tick;
+	ext2fs_mounts[slot] = data;
+	return data;
+}
+
+static int ext2fs_fopen_node(struct ext2_data* data, const char* filename)
+{
+	struct ext2fs_file* file = NULL;
+	ext2fs_node_t fdiro = NULL;
+	int i, status;
+
+	for (i = 0; i < EXT2FS_MAX_FILES; i++)
+	{
+		if (ext2fs_files[i].node == NULL)
+		{
+			file = &ext2fs_files[i];
+			break;
+		}
+	}
+
+	if (file == NULL)
+		return -1;
+
+	status = ext2fs_find_file(filename, &data->diropen, &fdiro, FILETYPE_REG);
+	if (status < 0)
+		printf("EXT2FS: %s:%s lookup failed\n", data->partition, filename);
+
+	if (status)
+		goto fail;
+
+	if (!fdiro->inode_read)
+	{
+		status = ext2fs_read_inode(fdiro->data, fdiro->ino, &fdiro->inode);
+		if (status)
+			goto fail;
+
+		fdiro->inode_read = 1;
+	}
+
+	file->node = fdiro;
+	file->pos = 0;
+	file->size = __le32_to_cpu(fdiro->inode.size);
+	file->lines = NULL;
+	file->ra = NULL;
+	return i;
+
+fail:
+	ext2fs_free_node(fdiro, &data->diropen);
+	return -1;
+}
+
+/* Split PARTITION:path, partition must hold 8 chars */
+static const char* ext2fs_split_path(const char* path, char* partition)
+{
+	const char* ptr;
+	int len;
+
+	ptr = strchr(path, ':');
+	len = ((int)(ptr - path));
+
+	if (ptr == NULL || len > 4)
+		return NULL;
+
+	strncpy(partition, path, len);
+	partition[len] = '\0';
+	return ptr + 1;
+}
+
+/*
+ * Open file in BL format (PARTITION:path), returns file descriptor or -1.
+ * The partition gets mounted if it isn't yet.
+ */
+int ext2fs_fopen(const char* path)
+{
+	struct ext2_data* data;
+	char partition[8];
+	const char* filename;
+
+	filename = ext2fs_split_path(path, partition);
+	if (!filename)
+		return -1;
+
+	data = ext2fs_get_mount(partition);
+	if (!data)
+		return -1;
+
+	return ext2fs_fopen_node(data, filename);
+}
+
+/*
+ * Inode of an open file
+ */
+int ext2fs_fstat(int fd, struct ext2fs_stat* st)
+{
+	struct ext2fs_file* file = ext2fs_get_file(fd);
+
+	if (!file)
+		return 1;
+
+	st->ino = file->node->ino;
+	st->size = __le32_to_cpu(file->node->inode.size);
+	st->mtime = __le32_to_cpu(file->node->inode.mtime);
+	st->ctime = __le32_to_cpu(file->node->inode.ctime);
+	st->generation = __le32_to_cpu(file->node->inode.version);
+	st->nlinks = __le16_to_cpu(file->node->inode.nlinks);
+	return 0;
+}
+
+/*
+ * Read inode ino of the filesystem on a BL partition (mounting it if needed),
+ * lets callers that know a file by its inode check it is unchanged.
+ */
+int ext2fs_stat_ino(const char* partition, unsigned int ino, struct ext2fs_stat* st)
+{
+	struct ext2_data* data;
+	struct ext2_inode inode;
+
+	data = ext2fs_get_mount(partition);
+	if (!data || ino == 0)
+		return 1;
+
+	if (ext2fs_read_inode(data, ino, &inode))
+		return 1;
+
+	st->ino = ino;
+	st->size = __le32_to_cpu(inode.size);
+	st->mtime = __le32_to_cpu(inode.mtime);
+	st->ctime = __le32_to_cpu(inode.ctime);
+	st->generation = __le32_to_cpu(inode.version);
+	st->nlinks = __le16_to_cpu(inode.nlinks);
+	return 0;
+}
+
+/*
+ * Where position pos of inode ino is stored: offset receives the byte offset from
+ * the partition start (0 for a hole or an unwritten extent), len the number of
+ * bytes from pos on that continue it. Lets callers check a block map recorded
+ * elsewhere still matches the inode.
+ */
+int ext2fs_map_ino(const char* partition, unsigned int ino, unsigned int pos, uint64_t* offset, unsigned int* len)
+{
+	struct ext2_data* data;
+	ext2fs_node_t node;
+	uint64_t blknr, bytes;
+	uint32_t run, blocksize;
+	int ret = 1;
+
+	data = ext2fs_get_mount(partition);
+	if (!data || ino == 0)
+		return 1;
+
+	node = ext2fs_alloc_node(data, ino);
+	if (!node)
+		return 1;
+
+	if (ext2fs_read_inode(data, ino, &node->inode))
+		goto out;
+
+	node->inode_read = 1;
+
+	/* Inline data has no blocks to check */
+	if (ext2fs_is_inline(node))
+		goto out;
+
+	blocksize = EXT2_BLOCK_SIZE(data);
+
+	blknr = ext2fs_read_block(node, pos / blocksize, &run);
+	if (blknr == (uint64_t)-1)
+		goto out;
+
+	/* Hole runs may reach far past the end of the file */
+	bytes = (uint64_t)run * blocksize - pos % blocksize;
+
+	*offset = blknr ? blknr * blocksize + pos % blocksize : 0;
+	*len = bytes > 0xFFFFFFFF ? 0xFFFFFFFF : bytes;
+	ret = 0;
+
+out:
+	ext2fs_free_node(node, NULL);
+	return ret;
+}
+
+int ext2fs_fclose(int fd)
+{
+	struct ext2fs_file* file = ext2fs_get_file(fd);
+
+	if (file == NULL)
+		return 1;
+
+	if (file->ra)
+	{
+		free(file->ra->mem);
+		free(file->ra);
+		file->ra = NULL;
+	}
+
+	if (file->lines)
+	{
+		free(file->lines);
+		file->lines = NULL;
+	}
+
+	ext2fs_free_node(file->node, &file->node->data->diropen);
+	file->node = NULL;
+	return 0;
+}
+
+int ext2fs_fsize(int fd)
+{
+	struct ext2fs_file* file = ext2fs_get_file(fd);
+
+	if (file == NULL)
+		return -1;
+
+	return file->size;
+}
+
+/*
+ * Fill the empty slots with the runs following the window, a slot holds (up to chunk
+ * bytes of) one run. Slots next to each other in the ring whose runs continue on disk
+ * are read at once. Returns 1 if something was read, 0 if there is nothing to do, -1
+ * on error.
+ */
+static int ext2fs_ra_fill(struct ext2fs_file* file)
+{
+	struct ext2fs_readahead* ra = file->ra;
+	struct ext2_data* data = file->node->data;
+	int log2blocksize = LOG2_EXT2_BLOCK_SIZE(data);
+	unsigned int blocksize = EXT2_BLOCK_SIZE(data);
+	uint64_t blknr, bytes, pend_blk;
+	unsigned int pend_len;
+	char* pend_buf;
+	uint32_t run;
+	int idx, ret;
+
+	if (ra->filled == ra->slots || ra->next >= file->size)
+		return 0;
+
+	idx = (ra->head + ra->filled) % ra->slots;
+
+	/* Inline data is in the inode, it fits in one slot */
+	if (ext2fs_is_inline(file->node))
+	{
+		ret = ext2fs_read_file(file->node, ra->next, ra->chunk, ra->slot[idx]);
+		if (ret <= 0)
+			return -1;
+
+		ra->pos[idx] = ra->next;
+		ra->len[idx] = ret;
+		ra->next += ret;
+		ra->filled++;
+		return 1;
+	}
+
+	pend_blk = 0;
+	pend_len = 0;
+	pend_buf = NULL;
+
+	while (ra->filled < ra->slots && ra->next < file->size)
+	{
+		/* next stays block aligned, only the last run of the file is cut short */
+		blknr = ext2fs_read_block(file->node, ra->next / blocksize, &run);
+		if (blknr == (uint64_t)-1)
+			return -1;
+
+		bytes = (uint64_t)run * blocksize;
+		if (bytes > ra->chunk)
+			bytes = ra->chunk;
+
+		if (bytes > file->size - ra->next)
+			bytes = file->size - ra->next;
+
+		/* Holes are zero filled, blocks join the pending read if they continue it */
+		if (!blknr)
+			memset(ra->slot[idx], 0, bytes);
+		else if (pend_len && pend_buf + pend_len == ra->slot[idx] && pend_blk + pend_len / blocksize == blknr)
+			pend_len += bytes;
+		else
+		{
+			if (pend_len && ext2fs_devread(data, pend_blk << log2blocksize, 0, pend_len, pend_buf))
+				return -1;
+
+			pend_blk = blknr;
+			pend_len = bytes;
+			pend_buf = ra->slot[idx];
+		}
+
+		ra->pos[idx] = ra->next;
+		ra->len[idx] = bytes;
+		ra->next += bytes;
+		ra->filled++;
+		idx = (idx + 1) % ra->slots;
+	}
+
+	if (pend_len && ext2fs_devread(data, pend_blk << log2blocksize, 0, pend_len, pend_buf))
+		return -1;
+
+	return 1;
+}
+
+/* Read through the readahead window */
+static int ext2fs_ra_read(struct ext2fs_file* file, char* buf, unsigned int len)
+{
+	struct ext2fs_readahead* ra = file->ra;
+	unsigned int blocksize = EXT2_BLOCK_SIZE(file->node->data);
+	unsigned int off, chunk, done;
+
+	if (file->pos >= file->size)
+		return 0;
+
+	if (len > file->size - file->pos)
+		len = file->size - file->pos;
+
+	for (done = 0; done < len; done += chunk)
+	{
+		/* Consumed slots are free for the runs that follow */
+		while (ra->filled && file->pos >= ra->pos[ra->head] + ra->len[ra->head])
+		{
+			ra->head = (ra->head + 1) % ra->slots;
+			ra->filled--;
+		}
+
+		/* Before the window (seek back), start over */
+		if (ra->filled && file->pos < ra->pos[ra->head])
+			ra->filled = 0;
+
+		if (!ra->filled)
+		{
+			ra->next = file->pos - file->pos % blocksize;
+			if (ext2fs_ra_fill(file) <= 0)
+				return -1;
+		}
+
+		off = file->pos - ra->pos[ra->head];
+		chunk = ra->len[ra->head] - off;
+		if (chunk > len - done)
+			chunk = len - done;
+
+		memcpy(buf + done, ra->slot[ra->head] + off, chunk);
+		file->pos += chunk;
+	}
+
+	return done;
+}
+
+/* Read at the file position, through the readahead window if there is one */
+static int ext2fs_file_read(struct ext2fs_file* file, char* buf, unsigned int len)
+{
+	int status;
+
+	if (file->ra)
+		return ext2fs_ra_read(file, buf, len);
+
+	status = ext2fs_read_file(file->node, file->pos, len, buf);
+	if (status > 0)
+		file->pos += status;
+
+	return status;
+}
+
+int ext2fs_fread(int fd, char* buf, unsigned int len)
+{
+	struct ext2fs_file* file = ext2fs_get_file(fd);
+
+	if (file == NULL)
+		return -1;
+
+	return ext2fs_file_read(file, buf, len);
+}
+
+/*
+ * Enable readahead of the next slots runs (of at most chunk bytes, rounded to blocks)
+ * on a file that is read sequentially, slots 0 disables it.
+ */
+int ext2fs_freadahead(int fd, int slots, unsigned int chunk)
+{
+	struct ext2fs_file* file = ext2fs_get_file(fd);
+	struct ext2fs_readahead* ra;
+	unsigned int blocksize;
+	char* base;
+	int i;
+
+	if (file == NULL || slots < 0 || slots > EXT2FS_RA_MAX_SLOTS || chunk > EXT2FS_RA_MAX_CHUNK)
+		return 1;
+
+	if (file->ra)
+	{
+		free(file->ra->mem);
+		free(file->ra);
+		file->ra = NULL;
+	}
+
+	if (slots == 0)
+		return 0;
+
+	blocksize = EXT2_BLOCK_SIZE(file->node->data);
+	chunk = (chunk + blocksize - 1) & ~(blocksize - 1);
+	if (chunk == 0)
+		chunk = blocksize;
+
+	ra = malloc(sizeof(struct ext2fs_readahead));
+	if (!ra)
+		return 1;
+
+	ra->mem = malloc(slots * chunk + EXT2FS_RA_ALIGN - 1);
+	if (!ra->mem)
+	{
+		free(ra);
+		return 1;
+	}
+
+	base = ra->mem + ((EXT2FS_RA_ALIGN - ((unsigned long)ra->mem & (EXT2FS_RA_ALIGN - 1))) & (EXT2FS_RA_ALIGN - 1));
+
+	for (i = 0; i < slots; i++)
+	{
+		ra->slot[i] = base + i * chunk;
+		ra->len[i] = 0;
+	}
+
+	ra->chunk = chunk;
+	ra->slots = slots;
+	ra->next = file->pos - file->pos % blocksize;
+	ra->head = 0;
+	ra->filled = 0;
+
+	file->ra = ra;
+	return 0;
+}
+
+int ext2fs_fseek(int fd, int pos)
+{
+	struct ext2fs_file* file = ext2fs_get_file(fd);
+
+	if (file == NULL)
+		return 1;
+
+	if (pos < 0 || (unsigned int)pos > file->size)
+		return 1;
+
+	file->pos = pos;
+
+	if (file->lines)
+	{
+		file->lines->len = 0;
+		file->lines->off = 0;
+	}
+
+	return 0;
+}
+
+/* First '\n' in [p, end) or NULL, compares a word at a time */
+static char* ext2fs_find_newline(char* p, char* end)
+{
+	uint32_t w;
+
+	while (p < end && ((unsigned long)p & 3))
+	{
+		if (*p == '\n')
+			return p;
+
+		p++;
+	}
+
+	/* A byte of w ^ 0x0A0A0A0A is zero where there's a '\n' */
+	while (p + 4 <= end)
+	{
+		w = *(uint32_t*)p ^ 0x0A0A0A0A;
+		if ((w - 0x01010101) & ~w & 0x80808080)
+			break;
+
+		p += 4;
+	}
+
+	while (p < end)
+	{
+		if (*p == '\n')
+			return p;
+
+		p++;
+	}
+
+	return NULL;
+}
+
+/* Refill the line block up to the next block boundary, returns bytes read, 0 at the end */
+static int ext2fs_lines_fill(struct ext2fs_file* file)
+{
+	struct ext2fs_lines* lines = file->lines;
+	unsigned int blocksize = EXT2_BLOCK_SIZE(file->node->data);
+	int ret;
+
+	lines->off = 0;
+	lines->len = 0;
+
+	if (file->pos >= file->size)
+		return 0;
+
+	ret = ext2fs_file_read(file, lines->block, blocksize - file->pos % blocksize);
+	if (ret > 0)
+		lines->len = ret;
+
+	return ret;
+}
+
+/*
+ * Next line of at most max bytes (max <= EXT2FS_LINE_MAX), handed out from the
+ * line block. Only a line crossing the end of the block is copied (into spill).
+ */
+static int ext2fs_next_line(struct ext2fs_file* file, unsigned int max, char** line)
+{
+	struct ext2fs_lines* lines = file->lines;
+	unsigned int blocksize, avail, n, k;
+	char *start, *nl;
+	int ret;
+
+	if (!lines)
+	{
+		blocksize = EXT2_BLOCK_SIZE(file->node->data);
+
+		lines = malloc(sizeof(struct ext2fs_lines) + blocksize + EXT2FS_LINE_MAX);
+		if (!lines)
+			return -1;
+
+		lines->block = (char*)(lines + 1);
+		lines->spill = lines->block + blocksize;
+		lines->len = 0;
+		lines->off = 0;
+		file->lines = lines;
+	}
+
+	if (lines->off == lines->len)
+	{
+		ret = ext2fs_lines_fill(file);
+		if (ret <= 0)
+			return ret;
+	}
+
+	start = lines->block + lines->off;
+	avail = lines->len - lines->off;
+
+	nl = ext2fs_find_newline(start, start + (avail < max ? avail : max));
+	if (nl || avail >= max)
+	{
+		n = nl ? (unsigned int)(nl - start) + 1 : max;
+		lines->off += n;
+		*line = start;
+		return n;
+	}
+
+	/* The line continues in the next block */
+	memcpy(lines->spill, start, avail);
+	lines->off = lines->len;
+	n = avail;
+
+	while (n < max)
+	{
+		ret = ext2fs_lines_fill(file);
+		if (ret < 0)
+			return -1;
+		else if (ret == 0)
+			break;
+
+		k = lines->len < max - n ? lines->len : max - n;
+
+		nl = ext2fs_find_newline(lines->block, lines->block + k);
+		if (nl)
+			k = (unsigned int)(nl - lines->block) + 1;
+
+		memcpy(lines->spill + n, lines->block, k);
+		lines->off = k;
+		n += k;
+
+		if (nl)
+			break;
+	}
+
+	*line = lines->spill;
+	return n;
+}
+
+int ext2fs_fgetline(int fd, char** line)
+{
+	struct ext2fs_file* file = ext2fs_get_file(fd);
+
+	if (file == NULL)
+		return -1;
+
+	return ext2fs_next_line(file, EXT2FS_LINE_MAX, line);
+}
+
+int ext2fs_fgets(int fd, char* buf, int bufsize)
+{
+	struct ext2fs_file* file = ext2fs_get_file(fd);
+	char* line;
+	int len;
+
+	if (file == NULL || bufsize < 2)
+		return 0;
+
+	len = ext2fs_next_line(file, bufsize - 1 < EXT2FS_LINE_MAX ? bufsize - 1 : EXT2FS_LINE_MAX, &line);
+	if (len <= 0)
+	{
+		buf[0] = '\0';
+		return 0;
+	}
+
+	memcpy(buf, line, len);
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Single file API working on the filesystem selected by ext2fs_mount
+ */
+
+int ext2fs_open(const char* filename)
+{
+	if (ext2fs_root == NULL)
+		return -1;
+
+	ext2fs_close();
+
+	ext2fs_fd = ext2fs_fopen_node(ext2fs_root, filename);
+	if (ext2fs_fd < 0)
+		return -1;
+
+	return ext2fs_fsize(ext2fs_fd);
+}
+
+int ext2fs_close(void)
+{
+	if (ext2fs_fd >= 0)
+	{
+		ext2fs_fclose(ext2fs_fd);
+		ext2fs_fd = -1;
+	}
+
+	return 0;
+}
+
+int ext2fs_read(char* buf, unsigned int len)
+{
+	return ext2fs_fread(ext2fs_fd, buf, len);
+}
+
+int ext2fs_seek(int pos)
+{
+	return ext2fs_fseek(ext2fs_fd, pos);
+}
+
+int ext2fs_gets(char* buf, int bufsize)
+{
+	return ext2fs_fgets(ext2fs_fd, buf, bufsize);
+}
+
+int ext2fs_getline(char** line)
+{
+	return ext2fs_fgetline(ext2fs_fd, line);
+}
+
+/*
+ * Select the filesystem on partition, mounting it if it isn't yet.
+ * Mounts are kept until ext2fs_invalidate.
+ */
+int ext2fs_mount(const char* partition)
+{
+	ext2fs_unmount();
+
+	ext2fs_root = ext2fs_get_mount(partition);
+	if (ext2fs_root == NULL)
+		return 1;
+
+	return 0;
+}
+
+/* Deselect the filesystem (it stays mounted) */
+int ext2fs_unmount(void)
+{
+	if (ext2fs_root == NULL)
+		return 1;
+
+	ext2fs_close();
+	ext2fs_root = NULL;
+	return 0;
+}
+
+/*
+ * Drop the mount of partition (all mounts if NULL), must be called
+ * before the partition gets written or erased. Files open on it are closed.
+ */
+int ext2fs_invalidate(const char* partition)
+{
+	struct ext2_data* data;
+	int i, j;
+
+	for (i = 0; i < EXT2FS_MAX_MOUNTS; i++)
+	{
+		data = ext2fs_mounts[i];
+
+		if (data == NULL || (partition != NULL && strcmp(data->partition, partition)))
+			continue;
+
+		if (data == ext2fs_root)
+			ext2fs_unmount();
+
+		for (j = 0; j < EXT2FS_MAX_FILES; j++)
+		{
+			if (ext2fs_files[j].node != NULL && ext2fs_files[j].node->data == data)
+				ext2fs_fclose(j);
+		}
+
+		ext2fs_free_data(data);
+		ext2fs_mounts[i] = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Select how the filesystem on partition (all partitions without their own
+ * setting if NULL) reads the device: EXT2FS_IO_PARTITION goes through the BL
+ * partition API, EXT2FS_IO_RAW reads the eMMC sectors directly. Mounts the raw
+ * access isn't possible for keep using the partition API.
+ */
+int ext2fs_set_io(const char* partition, int io)
+{
+	struct ext2_data* data;
+	int i, slot;
+
+	if (partition == NULL)
+		ext2fs_default_io = io;
+	else
+	{
+		slot = -1;
+		for (i = 0; i < EXT2FS_MAX_IO_PREFS; i++)
+		{
+			if (!strcmp(ext2fs_io_prefs[i].partition, partition))
+			{
+				slot = i;
+				break;
+			}
+
+			if (slot == -1 && ext2fs_io_prefs[i].partition[0] == '\0')
+				slot = i;
+		}
+
+		if (slot == -1)
+			return 1;
+
+		strncpy(ext2fs_io_prefs[slot].partition, partition, ARRAY_SIZE(ext2fs_io_prefs[slot].partition));
+		ext2fs_io_prefs[slot].partition[ARRAY_SIZE(ext2fs_io_prefs[slot].partition) - 1] = '\0';
+		ext2fs_io_prefs[slot].io = io;
+	}
+
+	for (i = 0; i < EXT2FS_MAX_MOUNTS; i++)
+	{
+		data = ext2fs_mounts[i];
+
+		if (data != NULL)
+			ext2fs_mount_set_io(data, ext2fs_get_io(data->partition));
+	}
+
+	return 0;
+}
+
+/* Physically contiguous piece of a file being loaded (blknr 0 is a hole) */
+struct ext2fs_load_run
+{
+	struct ext2_data* data;
+	uint64_t blknr;
+	char* dest;
+	uint32_t len;
+};
+
+/* Run list being built, grows by doubling */
+struct ext2fs_load_runs
+{
+	struct ext2fs_load_run* run;
+	int count;
+	int max;
+};
+
+/* Inode on the path of a boot file and its check value */
+struct ext2fs_bmap_inode
+{
+	uint32_t ino;
+	uint32_t check;
+};
+
+/* Boot file, with every inode from the root down to the file itself */
+struct ext2fs_bmap_file
+{
+	char path[256];
+	uint32_t fs_id[4];
+	uint32_t size;
+	uint32_t mtime;
+	uint32_t generation;
+	uint32_t depth;
+	struct ext2fs_bmap_inode inodes[EXT2FS_BMAP_MAX_DEPTH];
+};
+
+struct ext2fs_bmap_run
+{
+	uint64_t blknr;
+	uint32_t file;
+	uint32_t offset;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/* Boot block map record, the runs are in disk order */
+struct ext2fs_bmap
+{
+	uint32_t magic;
+	uint32_t checksum;
+	uint32_t num_files;
+	uint32_t num_runs;
+	struct ext2fs_bmap_file files[EXT2FS_BMAP_MAX_FILES];
+	struct ext2fs_bmap_run runs[EXT2FS_BMAP_MAX_RUNS];
+};
+
+/* Inode check value, access time and the osd2 area (holding the checksum that follows it) are left out */
+static uint32_t ext2fs_inode_check(struct ext2_inode* inode)
+{
+	struct ext2_inode copy;
+
+	memcpy(&copy, inode, sizeof(struct ext2_inode));
+	copy.atime = 0;
+	memset(copy.osd2, 0, sizeof(copy.osd2));
+
+	return ext2fs_hash_bytes(EXT2FS_HASH_INIT, &copy, sizeof(struct ext2_inode));
+}
+
+static int ext2fs_add_run(struct ext2fs_load_runs* runs, struct ext2_data* data, uint64_t blknr, char* dest, uint32_t len)
+{
+	struct ext2fs_load_run* grown;
+	int max;
+
+	if (runs->count == runs->max)
+	{
+		max = runs->max ? runs->max * 2 : 64;
+		grown = malloc(max * sizeof(struct ext2fs_load_run));
+		if (!grown)
+			return 1;
+
+		if (runs->run)
+		{
+			memcpy(grown, runs->run, runs->count * sizeof(struct ext2fs_load_run));
+			free(runs->run);
+		}
+
+		runs->run = grown;
+		runs->max = max;
+	}
+
+	runs->run[runs->count].data = data;
+	runs->run[runs->count].blknr = blknr;
+	runs->run[runs->count].dest = dest;
+	runs->run[runs->count].len = len;
+	runs->count++;
+	return 0;
+}
+
+/* Add the runs of the whole file to the list */
+static int ext2fs_collect_runs(struct ext2fs_load_runs* runs, ext2fs_node_t node, unsigned int size, char* dest)
+{
+	uint64_t fileblock, blocks, blknr, nextblk;
+	uint32_t run, nextrun, len;
+	int log2blocksize = LOG2_EXT2_BLOCK_SIZE(node->data);
+	int blocksize = 1 << (log2blocksize + DISK_SECTOR_BITS);
+
+	blocks = (size + blocksize - 1) / blocksize;
+
+	for (fileblock = 0; fileblock < blocks; fileblock += run)
+	{
+		blknr = ext2fs_read_block(node, fileblock, &run);
+		if (blknr == (uint64_t)-1)
+			return 1;
+
+		while (fileblock + run < blocks)
+		{
+			nextblk = ext2fs_read_block(node, fileblock + run, &nextrun);
+			if (nextblk == (uint64_t)-1)
+				return 1;
+
+			if (blknr ? (nextblk != blknr + run) : (nextblk != 0))
+				break;
+
+			if (nextrun > blocks - fileblock - run)
+				nextrun = blocks - fileblock - run;
+
+			run += nextrun;
+		}
+
+		if (run > blocks - fileblock)
+			run = blocks - fileblock;
+
+		len = run * blocksize;
+		if (fileblock * blocksize + len > size)
+			len = size - fileblock * blocksize;
+
+		if (ext2fs_add_run(runs, node->data, blknr, dest + fileblock * blocksize, len))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Disk order: by filesystem, then by block */
+static int ext2fs_run_before(struct ext2fs_load_run* a, struct ext2fs_load_run* b)
+{
+	if (a->data != b->data)
+		return a->data < b->data;
+
+	return a->blknr < b->blknr;
 }
 
+static void ext2fs_sift_runs(struct ext2fs_load_run* run, int root, int count)
+{
+	struct ext2fs_load_run tmp;
+	int child;
 
-int ext2fs_find_file(const char* path, ext2fs_node_t rootnode, ext2fs_node_t* foundnode, int expecttype)
+	while ((child = 2 * root + 1) < count)
+	{
+		if (child + 1 < count && ext2fs_run_before(&run[child], &run[child + 1]))
+			child++;
+
+		if (!ext2fs_run_before(&run[root], &run[child]))
+			return;
+
+		tmp = run[root];
+		run[root] = run[child];
+		run[child] = tmp;
+		root = child;
+	}
+}
+
+/* Heap sort, no recursion and no extra memory */
+static void ext2fs_sort_runs(struct ext2fs_load_run* run, int count)
 {
-	int status;
-	int foundtype = FILETYPE_DIRECTORY;
+	struct ext2fs_load_run tmp;
+	int i;
 
-	symlinknest = 0;
-	if (!path)
-		return 1;
+	for (i = count / 2 - 1; i >= 0; i--)
+		ext2fs_sift_runs(run, i, count);
 
-	status = ext2fs_find_file1(path, rootnode, foundnode, &foundtype);
-	if (status)
-		return 1;
+	for (i = count - 1; i > 0; i--)
+	{
+		tmp = run[0];
+		run[0] = run[i];
+		run[i] = tmp;
+		ext2fs_sift_runs(run, 0, i);
+	}
+}
 
-	/* Check if the node that was found was of the expected type.  */
-	if ((expecttype == FILETYPE_REG) && (foundtype != expecttype))
-		return 1;
-	else if ((expecttype == FILETYPE_DIRECTORY)  && (foundtype != expecttype))
-		return 1;
+/* Read (or zero for a hole) one run, seeks is counted up if it doesn't continue the previous read, returns 0 on success */
+static int ext2fs_read_run(struct ext2_data* data, uint64_t blknr, char* dest, uint32_t len, int* seeks)
+{
+	int log2blocksize = LOG2_EXT2_BLOCK_SIZE(data);
 
-	return 0;
+	if (!blknr)
+	{
+		memset(dest, 0, len);
+		return 0;
+	}
+
+	if (data->pt_pos != (blknr << (log2blocksize + DISK_SECTOR_BITS)))
+		(*seeks)++;
+
+	return ext2fs_devread(data, blknr << log2blocksize, 0, len, dest);
 }
 
+/* Give every item a buffer of its size */
+static int ext2fs_alloc_items(struct ext2fs_load_item* items, int count, ext2fs_alloc_t alloc, void* arg)
+{
+	int i;
 
-int ext2fs_ls(const char* dirname)
+	if (alloc)
+		return alloc(items, count, arg);
+
+	for (i = 0; i < count; i++)
+	{
+		items[i].data = malloc(items[i].size);
+		if (!items[i].data)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Record the inodes from the root to the file (the prefixes hit the dentry cache) */
+static int ext2fs_bmap_path(struct ext2_data* data, const char* filename, struct ext2fs_bmap_file* file)
 {
-	ext2fs_node_t dirnode;
-	int status;
+	char path[256];
+	ext2fs_node_t node;
+	int i, len;
 
-	if (ext2fs_root == NULL)
+	len = strlen(filename);
+	if (len >= (int)sizeof(path))
 		return 1;
 
-	status = ext2fs_find_file(dirname, &ext2fs_root->diropen, &dirnode, FILETYPE_DIRECTORY);
+	file->depth = 0;
+	file->inodes[file->depth].ino = data->diropen.ino;
+	file->inodes[file->depth].check = ext2fs_inode_check(&data->diropen.inode);
+	file->depth++;
 
-	if (status)
+	for (i = 1; i <= len; i++)
 	{
-		printf("** Can not find directory. **\n");
-		return 1;
+		if (i < len && filename[i] != '/')
+			continue;
+
+		if (filename[i - 1] == '/')
+			continue;
+
+		if (file->depth == EXT2FS_BMAP_MAX_DEPTH)
+			return 1;
+
+		memcpy(path, filename, i);
+		path[i] = '\0';
+
+		if (ext2fs_find_file(path, &data->diropen, &node, FILETYPE_UNKNOWN))
+			return 1;
+
+		if (!node->inode_read && ext2fs_read_inode(data, node->ino, &node->inode))
+		{
+			ext2fs_free_node(node, &data->diropen);
+			return 1;
+		}
+
+		file->inodes[file->depth].ino = node->ino;
+		file->inodes[file->depth].check = ext2fs_inode_check(&node->inode);
+		file->depth++;
+
+		if (i == len)
+		{
+			file->size = __le32_to_cpu(node->inode.size);
+			file->mtime = __le32_to_cpu(node->inode.mtime);
+			file->generation = __le32_to_cpu(node->inode.version);
+		}
+
+		ext2fs_free_node(node, &data->diropen);
 	}
 
-	ext2fs_iterate_dir(dirnode, NULL, NULL, NULL);
-	ext2fs_free_node(dirnode, &ext2fs_root->diropen);
+	memcpy(file->fs_id, data->sblock.unique_id, sizeof(file->fs_id));
+	strncpy(file->path, filename, sizeof(file->path));
 	return 0;
 }
 
-int ext2fs_open(const char* filename)
+/* Fill in the block map of a loaded batch (sorted runs), leaves magic 0 if it doesn't fit */
+static void ext2fs_bmap_record(struct ext2fs_bmap* bmap, struct ext2fs_load_item* items, int count, struct ext2fs_load_runs* runs)
 {
-	ext2fs_node_t fdiro = NULL;
-	int status;
-	int len;
+	struct ext2fs_load_run* run;
+	struct ext2_data* data;
+	const char* filename;
+	char partition[8];
+	int i, f;
 
-	if (ext2fs_root == NULL)
-		return -1;
+	memset(bmap, 0, sizeof(struct ext2fs_bmap));
 
-	ext2fs_file = NULL;
-	status = ext2fs_find_file(filename, &ext2fs_root->diropen, &fdiro, FILETYPE_REG);
-	if (status)
-		goto fail;
+	if (count > EXT2FS_BMAP_MAX_FILES || runs->count > EXT2FS_BMAP_MAX_RUNS)
+		return;
 
-	if (!fdiro->inode_read)
+	for (f = 0; f < count; f++)
 	{
-		status = ext2fs_read_inode(fdiro->data, fdiro->ino, &fdiro->inode);
-		if (status)
-			goto fail;
+		filename = ext2fs_split_path(items[f].path, partition);
+		if (!filename)
+			return;
+
+		data = ext2fs_get_mount(partition);
+		if (!data || ext2fs_bmap_path(data, filename, &bmap->files[f]))
+			return;
+
+		/* Keep the full BL path */
+		if (strlen(items[f].path) >= sizeof(bmap->files[f].path))
+			return;
+
+		strncpy(bmap->files[f].path, items[f].path, sizeof(bmap->files[f].path));
 	}
 
-	len = __le32_to_cpu(fdiro->inode.size);
-	ext2fs_file = fdiro;
-	ext2fs_pos = 0;
-	gets_buffer[0] = '\0';
-	gets_buffer_ptr = gets_buffer;
-	return len;
+	for (i = 0; i < runs->count; i++)
+	{
+		run = &runs->run[i];
 
-fail:
-	ext2fs_free_node(fdiro, &ext2fs_root->diropen);
-	return -1;
+		for (f = 0; f < count; f++)
+		{
+			if (run->dest >= items[f].data && run->dest < items[f].data + items[f].size)
+				break;
+		}
+
+		if (f == count)
+			return;
+
+		bmap->runs[i].blknr = run->blknr;
+		bmap->runs[i].file = f;
+		bmap->runs[i].offset = run->dest - items[f].data;
+		bmap->runs[i].len = run->len;
+	}
+
+	bmap->num_files = count;
+	bmap->num_runs = runs->count;
+	bmap->checksum = ext2fs_hash_bytes(EXT2FS_HASH_INIT, &bmap->num_files, sizeof(struct ext2fs_bmap) - 2 * sizeof(uint32_t));
+	bmap->magic = EXT2FS_BMAP_MAGIC;
 }
 
-int ext2fs_close(void)
+/* Load the batch through the filesystem, records the block map if bmap is given */
+static int ext2fs_load_batch(struct ext2fs_load_item* items, int count, ext2fs_alloc_t alloc, void* arg, struct ext2fs_bmap* bmap)
 {
-	if ((ext2fs_file != NULL) && (ext2fs_root != NULL))
+	struct ext2fs_load_runs runs;
+	struct ext2fs_load_run* run;
+	struct ext2fs_file* file;
+	int fds[EXT2FS_MAX_FILES];
+	uint32_t bytes;
+	int i, seeks, inline_files, ret = 1;
+
+	if (count < 1 || count > EXT2FS_MAX_FILES)
+		return 1;
+
+	memset(&runs, 0, sizeof(runs));
+
+	for (i = 0; i < count; i++)
 	{
-		ext2fs_free_node(ext2fs_file, &ext2fs_root->diropen);
-		ext2fs_file = NULL;
+		fds[i] = -1;
+		items[i].data = NULL;
+		items[i].size = 0;
 	}
 
-	if (ext2fs_root != NULL)
+	/* Open everything */
+	for (i = 0; i < count; i++)
 	{
-		free(ext2fs_root);
-		ext2fs_root = NULL;
+		fds[i] = ext2fs_fopen(items[i].path);
+		if (fds[i] < 0)
+			goto out;
+
+		file = ext2fs_get_file(fds[i]);
+		if ((int)file->size <= 0)
+			goto out;
+
+		items[i].size = file->size;
 	}
 
-	return 0;
-}
+	if (ext2fs_alloc_items(items, count, alloc, arg))
+		goto out;
 
-int ext2fs_read(char* buf, unsigned int len)
-{
-	int status;
+	/* Collect where the data lives, inline files are copied from the inode right away */
+	inline_files = 0;
 
-	if (ext2fs_root == NULL)
-		return 1;
+	for (i = 0; i < count; i++)
+	{
+		file = ext2fs_get_file(fds[i]);
 
-	if (ext2fs_file == NULL)
-		return 1;
+		if (ext2fs_is_inline(file->node))
+		{
+			if (ext2fs_read_file(file->node, 0, file->size, items[i].data) != (int)file->size)
+				goto out;
 
-	status = ext2fs_read_file(ext2fs_file, ext2fs_pos, len, buf);
-	ext2fs_pos += status;
-	return status;
+			inline_files++;
+		}
+		else if (ext2fs_collect_runs(&runs, file->node, file->size, items[i].data))
+			goto out;
+	}
+
+	/* One sweep over the disk, reads that continue the previous one don't seek */
+	ext2fs_sort_runs(runs.run, runs.count);
+
+	bytes = 0;
+	seeks = 0;
+
+	for (i = 0; i < runs.count; i++)
+	{
+		run = &runs.run[i];
+
+		if (ext2fs_read_run(run->data, run->blknr, run->dest, run->len, &seeks))
+			goto out;
+
+		bytes += run->len;
+	}
+
+	printf("EXT2FS: loaded %d files, %d bytes in %d runs, %d seeks\n", count, bytes, runs.count, seeks);
+	ret = 0;
+
+	/* The block map only replays runs, it can't hold inline files */
+	if (bmap && inline_files)
+		memset(bmap, 0, sizeof(struct ext2fs_bmap));
+	else if (bmap)
+		ext2fs_bmap_record(bmap, items, count, &runs);
+
+out:
+	if (runs.run)
+		free(runs.run);
+
+	for (i = 0; i < count; i++)
+	{
+		if (fds[i] >= 0)
+			ext2fs_fclose(fds[i]);
+
+		if (ret && !alloc && items[i].data)
+		{
+			free(items[i].data);
+			items[i].data = NULL;
+		}
+	}
+
+	return ret;
 }
 
-int ext2fs_seek(int pos)
+/* Read or write the block map record on MSC */
+static int ext2fs_bmap_io(struct ext2fs_bmap* bmap, int write)
 {
-	if (ext2fs_root == NULL)
-		return 1;
+	uint64_t pt_size;
+	uint32_t processed_bytes;
+	int handle, ret = 1;
 
-	if (ext2fs_file == NULL)
+	if (get_partition_size(EXT2FS_BMAP_PARTITION, &pt_size) || pt_size < EXT2FS_BMAP_OFFSET + sizeof(struct ext2fs_bmap))
 		return 1;
 
-	if (pos < 0 && pos > __le32_to_cpu(ext2fs_file->inode.size))
+	if (open_partition(EXT2FS_BMAP_PARTITION, write ? PARTITION_OPEN_WRITE : PARTITION_OPEN_READ, &handle))
 		return 1;
 
-	ext2fs_pos = pos;
-	return 0;
+	if (iostats_set_partition_position(handle, EXT2FS_BMAP_OFFSET, PARTITION_SETPOS_ABSOLUTE))
+		goto out;
+
+	if (write)
+		ret = iostats_write_partition(handle, bmap, sizeof(struct ext2fs_bmap), &processed_bytes);
+	else
+		ret = iostats_read_partition(handle, bmap, sizeof(struct ext2fs_bmap), &processed_bytes);
+
+	if (processed_bytes != sizeof(struct ext2fs_bmap))
+		ret = 1;
+
+out:
+	close_partition(handle);
+	return ret;
 }
 
-int ext2fs_gets(char* buf, int bufsize)
+/*
+ * Check the runs of file f still map where the inode says. A moved extent (e4defrag)
+ * only rewrites the leaf block, the inode and its check value stay the same.
+ */
+static int ext2fs_bmap_check_runs(struct ext2_data* data, struct ext2_inode* inode, struct ext2fs_bmap* bmap, int f)
 {
-	char* chr = strchr(gets_buffer_ptr, '\n');
-	int l, ret, acc;
+	struct ext2fs_bmap_file* file = &bmap->files[f];
+	struct ext2fs_bmap_run* run;
+	ext2fs_node_t node;
+	uint64_t fileblock, end, blknr, expected;
+	uint32_t blocksize, count;
+	int i, ret = 1;
+
+	node = ext2fs_alloc_node(data, file->inodes[file->depth - 1].ino);
+	if (!node)
+		return 1;
 
-	acc = 0;
-	buf[0] = '\0';
+	memcpy(&node->inode, inode, sizeof(struct ext2_inode));
+	node->inode_read = 1;
+	blocksize = EXT2_BLOCK_SIZE(data);
 
-	while (!chr)
+	for (i = 0; i < (int)bmap->num_runs; i++)
 	{
-		l = strlen(gets_buffer_ptr);
+		run = &bmap->runs[i];
+		if (run->file != (uint32_t)f)
+			continue;
 
-		if (l >= (bufsize - 1))
-		{
-			strncpy(&(buf[acc]), gets_buffer_ptr, (bufsize - 1));
-			buf[acc + (bufsize - 1)] = '\0';
-			gets_buffer_ptr += (bufsize - 1);
-			return acc + (bufsize - 1);
-		}
-		else if (l != 0)
-		{
-			strncpy(&(buf[acc]), gets_buffer_ptr, l);
-			buf[acc + l] = '\0';
-			bufsize -= l;
-			acc += l;
-		}
+		if (run->offset > file->size || run->len > file->size - run->offset || run->offset % blocksize)
+			goto out;
 
-		ret = ext2fs_read(gets_buffer, ARRAY_SIZE(gets_buffer) - 1);
+		end = ((uint64_t)run->offset + run->len + blocksize - 1) / blocksize;
 
-		if (ret > 0)
-		{
-			gets_buffer[ret] = '\0';
-			gets_buffer_ptr = gets_buffer;
-		}
-		else
+		for (fileblock = run->offset / blocksize; fileblock < end; fileblock += count)
 		{
-			/* EOF, return */
-			gets_buffer[0] = '\0';
-			gets_buffer_ptr = gets_buffer;
-			return acc;
-		}
+			blknr = ext2fs_read_block(node, fileblock, &count);
+			if (blknr == (uint64_t)-1 || count == 0)
+				goto out;
 
-		chr = strchr(gets_buffer_ptr, '\n');
+			expected = run->blknr ? run->blknr + fileblock - run->offset / blocksize : 0;
+			if (blknr != expected)
+				goto out;
+		}
 	}
 
-	/* i now is pointing to some '\n' */
-	l = ((int)(chr - gets_buffer_ptr)) / sizeof(char);
-	if (l + 1 >= (bufsize - 1))
-	{
-		strncpy(&(buf[acc]), gets_buffer_ptr, (bufsize - 1));
-		buf[acc + (bufsize - 1)] = '\0';
-		gets_buffer_ptr += (bufsize - 1);
-		return acc + (bufsize - 1);
-	}
+	ret = 0;
 
-	strncpy(&(buf[acc]), gets_buffer_ptr, l + 1);
-	buf[acc + (l + 1)] = '\0';
-	gets_buffer_ptr += l + 1;
-	return acc + (l + 1);
+out:
+	ext2fs_free_node(node, NULL);
+	return ret;
 }
 
-int ext2fs_mount(const char* partition)
+/* Load the batch straight from the recorded runs, if every inode on the way is unchanged and the runs still match */
+static int ext2fs_bmap_load(struct ext2fs_bmap* bmap, struct ext2fs_load_item* items, int count, ext2fs_alloc_t alloc, void* arg, int* loaded)
 {
-	struct ext2_data* data;
-	int status;
+	struct ext2_data* mounts[EXT2FS_BMAP_MAX_FILES];
+	struct ext2fs_bmap_file* file;
+	struct ext2fs_bmap_run* run;
+	struct ext2_inode inode;
+	char partition[8];
+	uint32_t bytes;
+	int i, f, seeks;
+
+	*loaded = 0;
 
-	/* Open the partition */
-	if (ext_pt_handle != -1)
+	if (bmap->magic != EXT2FS_BMAP_MAGIC || bmap->num_files != (uint32_t)count || bmap->num_runs > EXT2FS_BMAP_MAX_RUNS)
 		return 1;
 
-	data = malloc(sizeof(struct ext2_data));
-	if (!data)
+	if (bmap->checksum != ext2fs_hash_bytes(EXT2FS_HASH_INIT, &bmap->num_files, sizeof(struct ext2fs_bmap) - 2 * sizeof(uint32_t)))
 		return 1;
 
-	status = open_partition(partition, PARTITION_OPEN_READ, &ext_pt_handle);
-	if (status)
-		goto fail;
+	for (f = 0; f < count; f++)
+	{
+		file = &bmap->files[f];
+		file->path[sizeof(file->path) - 1] = '\0';
 
-	/* Get partition size */
-	if (get_partition_size(partition, &pt_size))
-		goto fail;
+		if (strcmp(file->path, items[f].path) || !ext2fs_split_path(file->path, partition))
+			return 1;
 
-	/* Read the superblock.  */
-	status = ext2fs_devread(1 * 2, 0, sizeof(struct ext2_sblock), (char*) &data->sblock);
-	if (status)
-		goto fail;
+		mounts[f] = ext2fs_get_mount(partition);
+		if (!mounts[f] || memcmp(file->fs_id, mounts[f]->sblock.unique_id, sizeof(file->fs_id)))
+			return 1;
 
-	/* Make sure this is an ext2 filesystem.  */
-	if (__le16_to_cpu(data->sblock.magic) != EXT2_MAGIC)
-		goto fail;
+		if (file->depth < 2 || file->depth > EXT2FS_BMAP_MAX_DEPTH)
+			return 1;
 
-	if (__le32_to_cpu(data->sblock.revision_level == 0))
-		inode_size = 128;
-	else
-		inode_size = __le16_to_cpu(data->sblock.inode_size);
+		for (i = 0; i < (int)file->depth; i++)
+		{
+			if (ext2fs_read_inode(mounts[f], file->inodes[i].ino, &inode) || ext2fs_inode_check(&inode) != file->inodes[i].check)
+				return 1;
+		}
 
-	data->diropen.data = data;
-	data->diropen.ino = 2;
-	data->diropen.inode_read = 1;
-	data->inode = &data->diropen.inode;
+		/* inode is the file itself now */
+		if (__le32_to_cpu(inode.size) != file->size || __le32_to_cpu(inode.mtime) != file->mtime ||
+		    __le32_to_cpu(inode.version) != file->generation || file->size == 0)
+			return 1;
 
-	status = ext2fs_read_inode(data, 2, data->inode);
-	if (status)
+		items[f].size = file->size;
+		items[f].data = NULL;
+	}
+
+	for (i = 0; i < (int)bmap->num_runs; i++)
+	{
+		if (bmap->runs[i].file >= (uint32_t)count)
+			return 1;
+	}
+
+	/* The inode check doesn't cover extent tree blocks, the runs are checked against them */
+	for (f = 0; f < count; f++)
+	{
+		file = &bmap->files[f];
+
+		if (ext2fs_read_inode(mounts[f], file->inodes[file->depth - 1].ino, &inode) ||
+		    ext2fs_bmap_check_runs(mounts[f], &inode, bmap, f))
+		{
+			printf("EXT2FS: block map of %s is out of date\n", file->path);
+			return 1;
+		}
+	}
+
+	/* Valid, from here on errors are real */
+	*loaded = 1;
+
+	if (ext2fs_alloc_items(items, count, alloc, arg))
 		goto fail;
 
-	ext2fs_root = data;
+	bytes = 0;
+	seeks = 0;
+
+	for (i = 0; i < (int)bmap->num_runs; i++)
+	{
+		run = &bmap->runs[i];
+
+		if (ext2fs_read_run(mounts[run->file], run->blknr, items[run->file].data + run->offset, run->len, &seeks))
+			goto fail;
+
+		bytes += run->len;
+	}
+
+	printf("EXT2FS: block map loaded %d files, %d bytes in %d runs, %d seeks\n", count, bytes, bmap->num_runs, seeks);
 	return 0;
 
 fail:
-	printf("Failed to mount ext2 filesystem...\n");
-	free(data);
-	ext2fs_root = NULL;
+	if (!alloc)
+	{
+		for (f = 0; f < count; f++)
+		{
+			if (items[f].data)
+				free(items[f].data);
+
+			items[f].data = NULL;
+		}
+	}
+
 	return 1;
 }
 
-int ext2fs_unmount(void)
+int ext2fs_loadfiles(struct ext2fs_load_item* items, int count)
 {
-	ext2fs_close();
+	return ext2fs_load_batch(items, count, NULL, NULL, NULL);
+}
+
+int ext2fs_loadboot(struct ext2fs_load_item* items, int count, ext2fs_alloc_t alloc, void* arg)
+{
+	struct ext2fs_bmap* bmap;
+	int ret, loaded;
+
+	if (count > EXT2FS_BMAP_MAX_FILES)
+		return ext2fs_load_batch(items, count, alloc, arg, NULL);
 
-	if (ext_pt_handle != -1)
+	bmap = malloc(sizeof(struct ext2fs_bmap));
+	if (!bmap)
+		return ext2fs_load_batch(items, count, alloc, arg, NULL);
+
+	/* Known layout, stream it without walking the filesystem */
+	if (!ext2fs_bmap_io(bmap, 0))
 	{
-		close_partition(ext_pt_handle);
-		ext_pt_handle = -1;
-		return 0;
+		ret = ext2fs_bmap_load(bmap, items, count, alloc, arg, &loaded);
+		if (loaded)
+		{
+			free(bmap);
+			return ret;
+		}
 	}
 
-	return 1;
+	ret = ext2fs_load_batch(items, count, alloc, arg, bmap);
+	if (!ret && bmap->magic == EXT2FS_BMAP_MAGIC)
+	{
+		if (ext2fs_bmap_io(bmap, 1))
+			printf("EXT2FS: failed to store the block map\n");
+	}
+
+	free(bmap);
+	return ret;
 }
 
 int ext2fs_loadfile(char** data, int* size, const char* path)
 {
-	char partition[8];
-	char* ptr;
-	int len;
-
-	ptr = strchr(path, ':');
-	len = ((int)(ptr - path));
+	struct ext2fs_load_item item;
 
-	if (ptr == NULL || len > 4)
-		return 1;
-
-	strncpy(partition, path, len);
-	partition[len] = '\0';
-	ptr++;
-
-	if (ext2fs_mount(partition))
+	item.path = path;
+	if (ext2fs_loadfiles(&item, 1))
 		return 1;
 
-	len = ext2fs_open(ptr);
-	if (len <= 0)
-		goto fail;
-
-	*data = malloc(len);
-	*size = len;
-
-	ext2fs_read(*data, len);
-	ext2fs_close();
-	ext2fs_unmount();
+	*data = item.data;
+	*size = item.size;
 	return 0;
-
-fail:
-	ext2fs_unmount();
-	return 1;
 }
@@ -26,6 +26,7 @@
 #include "byteorder.h"
 #include "fastboot.h"
 #include "ext2fs.h"
+#include "iostats.h"
 #include "mystdlib.h"
 #include "debug.h"
 
@@ -109,45 +110,39 @@ void fastboot_get_var_baseband_version(char* reply_buffer, int reply_buffer_size
 /* Android version */
 void fastboot_get_var_android_version(char* reply_buffer, int reply_buffer_size)
 {
-	int len;
-	char *ptr, *chr;
-	char line[128];
+	int fd, len, prop_len;
+	char* line;
 
-	/* Mount system partition */
-	if (ext2fs_mount("APP"))
+	/* Open build.prop file */
+	fd = ext2fs_fopen("APP:/build.prop");
+	if (fd < 0)
 		return;
 
-	/* Open build.prop file */
-	if (ext2fs_open("/build.prop") < 0)
-		goto fail;
+	ext2fs_freadahead(fd, EXT2FS_RA_TEXT_SLOTS, EXT2FS_RA_TEXT_CHUNK);
 
-	len = strlen(ANDROID_VERSION_PROP_NAME "=");
+	prop_len = strlen(ANDROID_VERSION_PROP_NAME "=");
+	reply_buffer[0] = '\0';
 
-	while(1)
+	while ((len = ext2fs_fgetline(fd, &line)) > 0)
 	{
-		if (!ext2fs_gets(line, ARRAY_SIZE(line)))
-		{
-			reply_buffer[0] = '\0';
-			return;
-		}
+		if (len < prop_len || memcmp(line, ANDROID_VERSION_PROP_NAME "=", prop_len))
+			continue;
 
-		if (!strncmp(line, ANDROID_VERSION_PROP_NAME "=", len))
-		{
-			ptr = &line[len];
-			chr = strchr(line, '\n');
-			if (chr)
-				*chr = '\0';
+		line += prop_len;
+		len -= prop_len;
 
-			strncpy(reply_buffer, ptr, reply_buffer_size);
-			reply_buffer[reply_buffer_size - 1] = '\0';
-			break;
-		}
-	}
+		if (len > 0 && line[len - 1] == '\n')
+			len--;
 
-	ext2fs_close();
+		if (len > reply_buffer_size - 1)
+			len = reply_buffer_size - 1;
+
+		memcpy(reply_buffer, line, len);
+		reply_buffer[len] = '\0';
+		break;
+	}
 
-fail:
-	ext2fs_unmount();
+	ext2fs_fclose(fd);
 }
 
 /* Protocol version */
@@ -571,6 +566,7 @@ int fastboot_oem_cmd_set_boot_file(int fastboot_handle, const char* args)
 	{
 		msc_cmd.boot_file[0] = '\0';
 		msc_cmd_write();
+		invalidate_boot_images();
 
 		fastboot_status = fastboot_send(fastboot_handle, info_reply_empty, strlen(info_reply_empty));
 		return fastboot_cmd_status(fastboot_status);
@@ -592,6 +588,7 @@ int fastboot_oem_cmd_set_boot_file(int fastboot_handle, const char* args)
 	strncpy(msc_cmd.boot_file, args, ARRAY_SIZE(msc_cmd.boot_file));
 	msc_cmd.boot_file[ARRAY_SIZE(msc_cmd.boot_file) - 1] = '\0';
 	msc_cmd_write();
+	invalidate_boot_images();
 
 	snprintf(ok_reply_buffer, ARRAY_SIZE(ok_reply_buffer), info_reply_ok, msc_cmd.boot_file);
 	fastboot_status = fastboot_send(fastboot_handle, ok_reply_buffer, strlen(ok_reply_buffer));
@@ -688,6 +685,38 @@ int fastboot_oem_cmd_set_show_fb_rec(int fastboot_handle, const char* args)
 	return fastboot_cmd_status(fastboot_status);
 }
 
+/* Raw eMMC access for EXTFS ON/OFF */
+int fastboot_oem_cmd_set_raw_io(int fastboot_handle, const char* args)
+{
+	int fastboot_status;
+	const char* info_reply_on = FASTBOOT_RESP_INFO "EXTFS is read straight from the eMMC!";
+	const char* info_reply_off = FASTBOOT_RESP_INFO "EXTFS is read through the partition API!";
+	const char* info_reply_bad = FASTBOOT_RESP_INFO "Invalid argument!";
+	const char* reply;
+
+	if (!strcmp(args, "on"))
+	{
+		msc_cmd.settings |= MSC_SETTINGS_RAW_IO;
+		msc_cmd_write();
+		ext2fs_set_io(NULL, EXT2FS_IO_RAW);
+
+		reply = info_reply_on;
+	}
+	else if (!strcmp(args, "off"))
+	{
+		msc_cmd.settings &= ~MSC_SETTINGS_RAW_IO;
+		msc_cmd_write();
+		ext2fs_set_io(NULL, EXT2FS_IO_PARTITION);
+
+		reply = info_reply_off;
+	}
+	else
+		reply = info_reply_bad;
+
+	fastboot_status = fastboot_send(fastboot_handle, reply, strlen(reply));
+	return fastboot_cmd_status(fastboot_status);
+}
+
 /* Lock (cough cough) */
 int fastboot_oem_cmd_lock(int fastboot_handle, const char* args)
 {
@@ -729,6 +758,36 @@ int fastboot_oem_cmd_all_vars(int fastboot_handle, const char* args)
 	return fastboot_cmd_status(fastboot_status);
 }
 
+/* I/O counters (io-stats reset clears them afterwards) */
+int fastboot_oem_cmd_io_stats(int fastboot_handle, const char* args)
+{
+	int fastboot_status, i;
+	char reply_buffer[0x100];
+	int len = strlen(FASTBOOT_RESP_INFO);
+	const char* info_reply_bad = FASTBOOT_RESP_INFO "Invalid argument!";
+
+	if (strcmp(args, "") && strcmp(args, "reset"))
+	{
+		fastboot_status = fastboot_send(fastboot_handle, info_reply_bad, strlen(info_reply_bad));
+		return fastboot_cmd_status(fastboot_status);
+	}
+
+	snprintf(reply_buffer, ARRAY_SIZE(reply_buffer), FASTBOOT_RESP_INFO);
+	fastboot_status = 0;
+
+	for (i = 0; !iostats_format(i, &(reply_buffer[len]), ARRAY_SIZE(reply_buffer) - len); i++)
+	{
+		fastboot_status = fastboot_send(fastboot_handle, reply_buffer, strlen(reply_buffer));
+		if (fastboot_cmd_status(fastboot_status))
+			return fastboot_cmd_status(fastboot_status);
+	}
+
+	if (!strcmp(args, "reset"))
+		iostats_reset();
+
+	return fastboot_cmd_status(fastboot_status);
+}
+
 /* Some debugging functions */
 #ifdef BOOTLOADER_ENABLE_DEBUG
 
@@ -1030,6 +1089,10 @@ struct fastboot_oem_cmd_list_item fastboot_oem_command_table[] =
 		.cmd_name = "set-show-fb-rec",
 		.cmd_handler = &fastboot_oem_cmd_set_show_fb_rec,
 	},
+	{
+		.cmd_name = "set-raw-io",
+		.cmd_handler = &fastboot_oem_cmd_set_raw_io,
+	},
 	{
 		.cmd_name = "lock",
 		.cmd_handler = &fastboot_oem_cmd_lock,
@@ -1042,6 +1105,10 @@ struct fastboot_oem_cmd_list_item fastboot_oem_command_table[] =
 		.cmd_name = "all-vars",
 		.cmd_handler = &fastboot_oem_cmd_all_vars,
 	},
+	{
+		.cmd_name = "io-stats",
+		.cmd_handler = &fastboot_oem_cmd_io_stats,
+	},
 #ifdef BOOTLOADER_ENABLE_DEBUG
 	{
 		.cmd_name = "bldebug dump",
@@ -1321,6 +1388,10 @@ void fastboot_main(void* global_handle, uint32_t ram_base, char* error_msg, int
 					fb_refresh();
 				}
 
+				/* Cached filesystem and boot images are about to become stale */
+				ext2fs_invalidate(partition);
+				invalidate_boot_images();
+
 				fastboot_status = open_partition(partition, PARTITION_OPEN_WRITE, &pt_handle);
 
 				if (fastboot_status != 0)
@@ -1341,7 +1412,7 @@ void fastboot_main(void* global_handle, uint32_t ram_base, char* error_msg, int
 					else
 						download_chunk_size = download_left;
 
-					write_partition(pt_handle, downloaded_data_ptr, download_chunk_size, &processed_bytes);
+					iostats_write_partition(pt_handle, downloaded_data_ptr, download_chunk_size, &processed_bytes);
 
 					if (processed_bytes != download_chunk_size)
 					{
@@ -1372,6 +1443,8 @@ void fastboot_main(void* global_handle, uint32_t ram_base, char* error_msg, int
 						check_bootloader_update(global_handle);
 
 						/* We returned => bad flash, format CAC */
+						ext2fs_invalidate("CAC");
+						invalidate_boot_images();
 						format_partition("CAC");
 
 						/* Error */
@@ -1454,6 +1527,10 @@ void fastboot_main(void* global_handle, uint32_t ram_base, char* error_msg, int
 				fb_printf("Erasing %s partition...\n\n", partition);
 				fb_refresh();
 
+				/* Cached filesystem and boot images are about to become stale */
+				ext2fs_invalidate(partition);
+				invalidate_boot_images();
+
 				fastboot_status = format_partition(partition);
 
 				if (fastboot_status == 0)
@@ -0,0 +1,242 @@
+#!/bin/sh
+#
+# Test images for the ext2fs benchmark (see host/host_bench.c)
+#
+# Usage: mkimages.sh BOOTMENU-BENCH OUTPUT_DIR
+#
+# Needs mke2fs (with -d) and debugfs from e2fsprogs. The images are the same
+# on every run with the same e2fsprogs version: fixed UUID and hash seed, and
+# the file data comes from bootmenu-bench -g.
+#
+# Fragmented files are written after the image is filled up and every other
+# filler file is deleted, so their blocks can only go into the holes. Commands
+# in $WORK/NAME/debugfs (e.g. fallocate) run on the image right after mke2fs.
+#
+
+set -e
+
+BENCH="$1"
+OUT="$2"
+
+if [ -z "$BENCH" ] || [ -z "$OUT" ]; then
+	echo "Usage: $0 BOOTMENU-BENCH OUTPUT_DIR" >&2
+	exit 1
+fi
+
+UUID=6b8f2a4e-5d0c-4c1e-9a57-3e2d1f0b7c11
+export E2FSPROGS_FAKE_TIME=1356998400
+
+mkdir -p "$OUT"
+WORK="$OUT/work"
+rm -rf "$WORK"
+
+# gen SIZE SEED FILE
+gen()
+{
+	mkdir -p "$(dirname "$3")"
+	"$BENCH" -g "$1:$2" > "$3"
+}
+
+# deep FILE_IN_ROOT LEVELS: path of a file LEVELS directories down
+deep()
+{
+	path=""
+	i=1
+	while [ $i -le $2 ]; do
+		path="$path/d$i"
+		i=$((i + 1))
+	done
+
+	echo "$path/$1"
+}
+
+# longlink TARGET LINK: symlink to TARGET padded with slashes to a whole 1 KiB block
+longlink()
+{
+	mkdir -p "$(dirname "$2")"
+	ln -sf "$(printf '%*s' $((1000 - ${#1})) '' | tr ' ' '/')$1" "$2"
+}
+
+# sparse FILE SIZE SEED BLOCK_SIZE BLOCK...: SIZE bytes, data only in the given blocks
+sparse()
+{
+	mkdir -p "$(dirname "$1")"
+	rm -f "$1"
+	"$BENCH" -g "$4:$3" > "$1.blk"
+	blk_size=$4
+	file=$1
+	size=$2
+	shift 4
+	for b in "$@"; do
+		dd if="$file.blk" of="$file" bs=$blk_size seek=$b conv=notrunc 2> /dev/null
+	done
+	truncate -s "$size" "$file"
+	rm -f "$file.blk"
+}
+
+# fill NAME BLOCK_SIZE BLOCKS COUNT: COUNT filler files of BLOCKS blocks
+fill()
+{
+	mkdir -p "$WORK/$1/root/fill"
+	"$BENCH" -g "$(($2 * $3 * $4)):99" > "$WORK/$1/fill.bin"
+	(cd "$WORK/$1/root/fill" && split -a 4 -d -b $(($2 * $3)) ../../fill.bin f)
+	rm -f "$WORK/$1/fill.bin"
+}
+
+# image NAME TYPE BLOCK_SIZE SIZE_KIB
+# $WORK/NAME/root goes in with mke2fs -d, files in $WORK/NAME/frag go in the holes
+image()
+{
+	img="$OUT/$1.img"
+	rm -f "$img"
+
+	mke2fs -q -F -t "$2" -b "$3" -U "$UUID" -E "hash_seed=$UUID,root_owner=0:0" \
+		-d "$WORK/$1/root" "$img" "${4}k"
+
+	if [ -f "$WORK/$1/debugfs" ]; then
+		debugfs -w -f "$WORK/$1/debugfs" "$img" > /dev/null 2>&1
+	fi
+
+	[ -d "$WORK/$1/frag" ] || return 0
+
+	# Fill up the free space (debugfs leaves zero blocks out, hence the 0xFF)
+	free=$(dumpe2fs -h "$img" 2>/dev/null | awk -F: '/^Free blocks/ { print $2 + 0 }')
+	head -c $(((free - 64) * $3)) /dev/zero | tr '\0' '\377' > "$WORK/$1/pad"
+
+	count=$(ls "$WORK/$1/root/fill" | wc -l)
+
+	{
+		echo "write $WORK/$1/pad /pad"
+		seq -f "rm /fill/f%04g" 1 2 $((count - 1))
+		(cd "$WORK/$1/frag" && find . -type d ! -name . | sort | sed 's|^\.|mkdir |')
+		(cd "$WORK/$1/frag" && find . -type f | sort | sed "s|^\./\(.*\)|write $WORK/$1/frag/\1 /\1|")
+	} | debugfs -w "$img" > /dev/null 2>&1
+
+	e2fsck -fn "$img" > /dev/null 2>&1 || { echo "$0: $img is corrupted" >&2; exit 1; }
+}
+
+# depth NAME PATH DEPTH: check the extent tree depth of a file
+depth()
+{
+	d=$(debugfs -R "ex $2" "$OUT/$1.img" 2>/dev/null | awk 'NR == 2 { print $2 }')
+	if [ "$d" != "$3" ]; then
+		echo "$0: $1:$2 has extent depth ${d:-?}, expected $3" >&2
+		exit 1
+	fi
+}
+
+# le32 VALUE: VALUE as 4 little endian bytes
+le32()
+{
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($1 & 255)) $(($1 >> 8 & 255)) $(($1 >> 16 & 255)) $(($1 >> 24 & 255)))"
+}
+
+# move NAME PATH: copy of the image in moved/ with the single block extents of PATH
+# (depth 1, one leaf) moved to free blocks and the old ones zeroed, the way e4defrag
+# moves them: only the leaf block changes, the inode stays the same
+move()
+{
+	img="$OUT/$1.img"
+	moved="$OUT/moved/$1.img"
+	mkdir -p "$OUT/moved"
+	cp "$img" "$moved"
+
+	bs=$(dumpe2fs -h "$img" 2>/dev/null | awk -F: '/^Block size/ { print $2 + 0 }')
+	debugfs -R "ex $2" "$img" 2>/dev/null | sed 's|^ *[0-9]*/ *[0-9]* *[0-9]*/ *[0-9]* *||' > "$WORK/$1.ex"
+	leaf=$(awk 'NR == 2 { print $4 }' "$WORK/$1.ex")
+	n=$(($(wc -l < "$WORK/$1.ex") - 2))
+	free=$(debugfs -R "ffb $n" "$img" 2>/dev/null | sed 's/^Free blocks found: //')
+
+	i=0
+	tail -n +3 "$WORK/$1.ex" | while read -r first dash last phys rest; do
+		new=$(echo $free | cut -d ' ' -f $((i + 1)))
+		if [ "$first" != "$last" ] || [ -z "$new" ]; then
+			echo "$0: cannot move $1:$2" >&2
+			exit 1
+		fi
+
+		dd if="$img" of="$moved" bs=$bs skip=$phys seek=$new count=1 conv=notrunc 2> /dev/null
+		dd if=/dev/zero of="$moved" bs=$bs seek=$phys count=1 conv=notrunc 2> /dev/null
+		le32 $new | dd of="$moved" bs=1 seek=$((leaf * bs + 12 + 12 * i + 8)) count=4 conv=notrunc 2> /dev/null
+		i=$((i + 1))
+	done
+
+	# Same file, somewhere else (the leaf checksum is stale, hence -n)
+	debugfs -R "dump $2 $WORK/$1.old" "$img" > /dev/null 2>&1
+	debugfs -n -R "dump $2 $WORK/$1.new" "$moved" > /dev/null 2>&1
+	cmp -s "$WORK/$1.old" "$WORK/$1.new" || { echo "$0: moving $1:$2 failed" >&2; exit 1; }
+}
+
+# ext2, 1 KiB blocks: kernel through the double indirect block, deep directories,
+# sparse file without the indirect block, chain of block sized symlinks
+gen 6000000 1 "$WORK/E2K1/root/boot/zImage"
+gen 400000 2 "$WORK/E2K1/root$(deep initrd.img 16)"
+sparse "$WORK/E2K1/root/sparse.img" 2000000 9 1024 0 1 5 1000 1001 1900
+gen 3000 13 "$WORK/E2K1/root/chain/end"
+for i in 1 2 3 4; do
+	longlink "chain/l$((i + 1))" "$WORK/E2K1/root/chain/l$i"
+done
+longlink chain/end "$WORK/E2K1/root/chain/l5"
+image E2K1 ext2 1024 24576
+
+# ext3, 4 KiB blocks: kernel scattered in single block holes (indirect blocks)
+fill E3K4 4096 1 2100
+gen 4000000 3 "$WORK/E3K4/frag/boot/zImage"
+gen 300000 4 "$WORK/E3K4/root$(deep initrd.img 8)"
+image E3K4 ext3 4096 32768
+
+# ext4, 4 KiB blocks: contiguous kernel (depth 0), deep directories
+gen 8000000 5 "$WORK/E4K4/root/boot/zImage"
+gen 600000 6 "$WORK/E4K4/root$(deep initrd.img 16)"
+image E4K4 ext4 4096 32768
+depth E4K4 /boot/zImage 0
+
+# ext4, 4 KiB blocks: kernel in two block holes (depth 1)
+fill E4F4 4096 2 1200
+gen 2000000 7 "$WORK/E4F4/frag/boot/zImage"
+image E4F4 ext4 4096 16384
+depth E4F4 /boot/zImage 1
+
+# ext4, 1 KiB blocks: kernel in single block holes (depth 2)
+fill E4F1 1024 1 1200
+gen 500000 8 "$WORK/E4F1/frag/boot/zImage"
+image E4F1 ext4 1024 8192
+depth E4F1 /boot/zImage 2
+
+# ext4, 4 KiB blocks, inline_data: tiny files, inline directories and symlinks (one
+# going through ".." of an inline directory)
+LONG=a_rather_long_directory_name_for_the_system_partition_contents
+mkdir -p "$WORK/EIL4/root/boot" "$WORK/EIL4/root/$LONG"
+printf 'title=Inline\nzImage=UBN:/boot/zImage\n' > "$WORK/EIL4/root/boot/menu.skrilax"
+gen 120 12 "$WORK/EIL4/root/boot/small.bin"
+for i in 1 2 3 4 5; do
+	gen $((i * 40)) $((20 + i)) "$WORK/EIL4/root/$LONG/prop$i"
+done
+ln -s "$LONG" "$WORK/EIL4/root/system"
+ln -s boot/menu.skrilax "$WORK/EIL4/root/menu.skrilax"
+ln -s ../system/prop5 "$WORK/EIL4/root/boot/prop5"
+mke2fs -q -F -t ext4 -O inline_data -I 256 -b 4096 -U "$UUID" -E "hash_seed=$UUID,root_owner=0:0" \
+	-d "$WORK/EIL4/root" "$OUT/EIL4.img" 8192k
+
+# ext4, 4 KiB blocks: sparse file, preallocated (unwritten) ramdisk
+sparse "$WORK/E4S4/root/sparse.img" 8000000 10 4096 0 1 2 1000 1500 1501
+mkdir -p "$WORK/E4S4/root/boot"
+cat > "$WORK/E4S4/debugfs" << EOF
+write /dev/null /boot/ramdisk
+fallocate /boot/ramdisk 0 999
+sif /boot/ramdisk size 4000000
+EOF
+image E4S4 ext4 4096 16384
+depth E4S4 /boot/ramdisk 0
+
+# ext4, 4 KiB blocks: ramdisk in single block holes (depth 1), and a copy with its
+# extents moved for checking the boot block map (on MSC) notices
+fill EMV4 4096 1 200
+gen 40000 14 "$WORK/EMV4/frag/boot/ramdisk"
+image EMV4 ext4 4096 8192
+depth EMV4 /boot/ramdisk 1
+move EMV4 /boot/ramdisk
+head -c 65536 /dev/zero > "$OUT/MSC.img"
+ln -sf ../MSC.img "$OUT/moved/MSC.img"
+
+rm -rf "$WORK"
@@ -0,0 +1,1116 @@
+/*
+ * Host (Linux PC) stand-in for the routines mapped from the Acer bootloader.
+ *
+ * Copyright (C) 2013 Skrilax_CZ
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * This file replaces bl_0_03_14.c in the host build. Every function there
+ * (and the ARM libc symbols from ld-script that differ from the host libc)
+ * gets an implementation backed by the PC:
+ *
+ * - partitions are files in a directory (LNX.img, APP.img, UBN.img, ...)
+ * - the framebuffer is a memory buffer which can be dumped as PPM
+ * - GPIO keys follow a scripted key sequence
+ * - sleep() advances a virtual clock instead of waiting
+ * - fastboot runs over a pipe
+ * - the eMMC (hsmmc) is put together from the partition images
+ * - the SD card is a whole disk image (with its own partition table)
+ * - reads and writes of both can be charged by a device cost model
+ *
+ * NOTE: unistd.h must not be included, sleep() here takes milliseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "host.h"
+#include "bootimg.h"
+
+#define SCREEN_WIDTH            1280
+#define SCREEN_HEIGHT           800
+
+#define HOST_MAX_PARTITIONS     16
+#define HOST_MAX_KEY_EVENTS     256
+
+/* Default key hold time and gap before a key without explicit time */
+#define HOST_KEY_HOLD_MS        100
+#define HOST_KEY_GAP_MS         60
+
+/* Same values the BL uses in the original headers */
+#define PARTITION_OPEN_READ         1
+#define PARTITION_OPEN_WRITE        2
+#define PARTITION_SETPOS_ABSOLUTE   0
+#define PARTITION_SETPOS_RELATIVE   1
+
+/* Implemented in the bootmenu sources */
+void configure_custom_cmdline(char* cmdline, int size);
+void finalize_atags();
+void debug_write(const char* text);
+
+struct host_config host_cfg =
+{
+	.partition_dir = ".",
+	.idle_ms = HOST_DEFAULT_IDLE_MS,
+};
+
+struct host_io_stats host_io;
+uint64_t host_clock_ms = 0;
+
+/* ===========================================================================
+ * Variables
+ * ===========================================================================
+ */
+
+static uint8_t host_framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT * 4];
+static uint8_t* host_framebuffer_addr = host_framebuffer;
+static uint32_t host_framebuffer_size = sizeof(host_framebuffer);
+static int host_fastboot_unk;
+static int host_frame_count;
+
+/* Bootloader version */
+const char* bootloader_version = "0.03.14-ICS (host)";
+
+/* Framebuffer */
+uint8_t** framebuffer_ptr = &host_framebuffer_addr;
+
+/* Framebuffer size */
+uint32_t* framebuffer_size_ptr = &host_framebuffer_size;
+
+/* Fastboot unknown */
+int* fastboot_unk_handle_var = &host_fastboot_unk;
+
+/* ===========================================================================
+ * Standard library (differs from the host libc)
+ * ===========================================================================
+ */
+
+/* Bootloader log, mirrored into the debug buffer like the patched BL does */
+int printf(const char* format, ...)
+{
+	char buffer[1024];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	debug_write(buffer);
+
+	if (host_cfg.log)
+		fputs(buffer, host_cfg.log);
+
+	return strlen(buffer);
+}
+
+/* ===========================================================================
+ * GPIO / scripted keys
+ * ===========================================================================
+ */
+
+struct host_key
+{
+	const char* name;
+	int row;
+	int column;
+	int active_low;
+};
+
+/* Same wiring as device_keys in bootmenu.c */
+static const struct host_key host_keys[] =
+{
+	{ "up",       16, 4, 1 },
+	{ "down",     16, 5, 1 },
+	{ "rotation", 16, 2, 1 },
+	{ "power",     8, 3, 0 },
+};
+
+struct host_key_event
+{
+	int key;
+	int64_t start;  /* -1 = schedule when the previous event finished */
+	uint32_t hold;
+};
+
+static struct host_key_event host_key_events[HOST_MAX_KEY_EVENTS];
+static int host_key_events_count = 0;
+static int host_key_next = 0;
+static uint64_t host_key_last_end = 0;
+
+/*
+ * Script is a comma separated list of KEY[@TIME][+HOLD], times in virtual ms.
+ * Without @TIME the key goes down shortly after the bootmenu next polls the
+ * keys once the previous key was released (e.g. "up@0+200,down,down,power").
+ */
+int host_keys_parse(const char* script)
+{
+	char token[64];
+	const char *ptr, *end;
+	char *at, *plus;
+	struct host_key_event* ev;
+	int i, len;
+
+	ptr = script;
+
+	while (*ptr)
+	{
+		end = strchr(ptr, ',');
+		if (!end)
+			end = ptr + strlen(ptr);
+
+		len = (int)(end - ptr);
+		if (len <= 0 || len >= (int)sizeof(token) || host_key_events_count >= HOST_MAX_KEY_EVENTS)
+			return 1;
+
+		memcpy(token, ptr, len);
+		token[len] = '\0';
+
+		ev = &host_key_events[host_key_events_count];
+		ev->start = -1;
+		ev->hold = HOST_KEY_HOLD_MS;
+
+		plus = strchr(token, '+');
+		if (plus)
+		{
+			*plus++ = '\0';
+			ev->hold = strtoul(plus, NULL, 10);
+		}
+
+		at = strchr(token, '@');
+		if (at)
+		{
+			*at++ = '\0';
+			ev->start = strtoll(at, NULL, 10);
+		}
+
+		ev->key = -1;
+		for (i = 0; i < (int)(sizeof(host_keys) / sizeof(host_keys[0])); i++)
+		{
+			if (!strcmp(token, host_keys[i].name))
+				ev->key = i;
+		}
+
+		if (ev->key < 0)
+			return 1;
+
+		host_key_events_count++;
+		ptr = *end ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+/* Drop finished events, schedule relative ones */
+static struct host_key_event* host_keys_current(void)
+{
+	struct host_key_event* ev;
+
+	while (host_key_next < host_key_events_count)
+	{
+		ev = &host_key_events[host_key_next];
+
+		if (ev->start < 0)
+			ev->start = host_clock_ms + HOST_KEY_GAP_MS;
+
+		if (host_clock_ms < (uint64_t)ev->start + ev->hold)
+			return ev;
+
+		host_key_last_end = ev->start + ev->hold;
+		host_key_next++;
+	}
+
+	return NULL;
+}
+
+int get_gpio(int row, int column)
+{
+	const struct host_key* key;
+	struct host_key_event* ev;
+	int i, pressed;
+
+	ev = host_keys_current();
+
+	for (i = 0; i < (int)(sizeof(host_keys) / sizeof(host_keys[0])); i++)
+	{
+		key = &host_keys[i];
+
+		if (key->row != row || key->column != column)
+			continue;
+
+		pressed = ev && ev->key == i && host_clock_ms >= (uint64_t)ev->start;
+
+		if (key->active_low)
+			return !pressed;
+		else
+			return pressed;
+	}
+
+	return 0;
+}
+
+/* Virtual clock */
+void sleep(int ms)
+{
+	if (ms > 0)
+		host_clock_ms += ms;
+
+	/* Nothing left to press, the bootmenu would wait forever */
+	if (!host_keys_current() && host_clock_ms > host_key_last_end + host_cfg.idle_ms)
+		host_exit(0, "idle (key script exhausted)");
+}
+
+void toggle_vibrator(int state)
+{
+}
+
+/* Virtual clock plus the simulated device time */
+uint32_t get_timer_us()
+{
+	return (uint32_t)(host_clock_ms * 1000 + host_io.device_ns / 1000);
+}
+
+/* ===========================================================================
+ * Display functions
+ * ===========================================================================
+ */
+
+void println_display(const char* fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	fprintf(stderr, "DISPLAY: ");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+void println_display_error(const char* fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	fprintf(stderr, "DISPLAY ERROR: ");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+void print_bootlogo()
+{
+}
+
+void clear_screen()
+{
+	memset(host_framebuffer, 0, sizeof(host_framebuffer));
+}
+
+/* Screen refresh - dump the framebuffer (RGBX) as PPM */
+void framebuffer_unknown_call()
+{
+	char path[1024];
+	FILE* f;
+	int i;
+
+	host_frame_count++;
+
+	if (!host_cfg.screenshot)
+		return;
+
+	if (strstr(host_cfg.screenshot, "%d"))
+		snprintf(path, sizeof(path), host_cfg.screenshot, host_frame_count);
+	else
+		snprintf(path, sizeof(path), "%s", host_cfg.screenshot);
+
+	f = fopen(path, "wb");
+	if (!f)
+		return;
+
+	fprintf(f, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+
+	for (i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+		fwrite(&host_framebuffer[4 * i], 1, 3, f);
+
+	fclose(f);
+}
+
+/* ===========================================================================
+ * Device cost model
+ * ===========================================================================
+ */
+
+/* Where the previous command on a device ended */
+struct host_device
+{
+	uint64_t next;
+	int used;
+};
+
+static struct host_device host_emmc_device;
+static struct host_device host_sd_device;
+
+int host_device_parse(struct host_device_model* model, const char* spec)
+{
+	uint64_t values[3] = { 0, 0, 0 };
+	char* endp;
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		values[i] = strtoull(spec, &endp, 0);
+		if (endp == spec)
+			return 1;
+
+		if (*endp == '\0')
+			break;
+
+		if (*endp != ',' || i == 2)
+			return 1;
+
+		spec = endp + 1;
+	}
+
+	model->latency_us = values[0];
+	model->bandwidth_kib = values[1];
+	model->seek_us = values[2];
+	return 0;
+}
+
+void host_device_reset(void)
+{
+	memset(&host_emmc_device, 0, sizeof(host_emmc_device));
+	memset(&host_sd_device, 0, sizeof(host_sd_device));
+}
+
+/* Charge a command of bytes at offset (in bytes from the start of the device) */
+static void host_device_cost(struct host_device* dev, uint64_t offset, uint64_t bytes)
+{
+	const struct host_device_model* model = &host_cfg.device;
+	uint64_t ns;
+
+	ns = model->latency_us * 1000;
+
+	if (model->bandwidth_kib)
+		ns += bytes * 1000000000ULL / (model->bandwidth_kib * 1024);
+
+	if (!dev->used || dev->next != offset)
+	{
+		ns += model->seek_us * 1000;
+		host_io.device_seeks++;
+	}
+
+	dev->next = offset + bytes;
+	dev->used = 1;
+	host_io.device_ns += ns;
+}
+
+/* ===========================================================================
+ * Partitions
+ * ===========================================================================
+ */
+
+struct host_partition
+{
+	FILE* file;
+	uint64_t position;
+	uint64_t base;      /* offset on the eMMC, for the cost model */
+	int open_type;
+};
+
+static uint64_t host_emmc_partition_offset(const char* partition);
+
+static struct host_partition host_partitions[HOST_MAX_PARTITIONS];
+
+static FILE* host_partition_fopen(const char* partition, const char* mode)
+{
+	char path[1024];
+
+	snprintf(path, sizeof(path), "%s/%s.img", host_cfg.partition_dir, partition);
+	return fopen(path, mode);
+}
+
+/* Handles are index + 1, so that 0 is never valid */
+static struct host_partition* host_partition_get(int partition_handle)
+{
+	if (partition_handle < 1 || partition_handle > HOST_MAX_PARTITIONS)
+		return NULL;
+
+	if (!host_partitions[partition_handle - 1].file)
+		return NULL;
+
+	return &host_partitions[partition_handle - 1];
+}
+
+int open_partition(const char* partition, int open_type, int* partition_handle)
+{
+	int i;
+
+	for (i = 0; i < HOST_MAX_PARTITIONS; i++)
+	{
+		if (host_partitions[i].file)
+			continue;
+
+		host_partitions[i].file = host_partition_fopen(partition, (open_type & PARTITION_OPEN_WRITE) ? "r+b" : "rb");
+		if (!host_partitions[i].file)
+			return 1;
+
+		host_partitions[i].position = 0;
+		host_partitions[i].base = host_emmc_partition_offset(partition);
+		host_partitions[i].open_type = open_type;
+		*partition_handle = i + 1;
+		host_io.opens++;
+		return 0;
+	}
+
+	return 1;
+}
+
+int get_partition_position(int partition_handle, uint64_t* postition)
+{
+	struct host_partition* pt = host_partition_get(partition_handle);
+
+	if (!pt)
+		return 1;
+
+	*postition = pt->position;
+	return 0;
+}
+
+int set_partition_position(int partition_handle, int64_t offset, int origin)
+{
+	struct host_partition* pt = host_partition_get(partition_handle);
+
+	if (!pt)
+		return 1;
+
+	host_io.seek_calls++;
+
+	if (origin == PARTITION_SETPOS_RELATIVE)
+		offset += pt->position;
+
+	if (offset < 0)
+		return 1;
+
+	pt->position = offset;
+	return 0;
+}
+
+int read_partition(int partition_handle, void* buffer, uint32_t buffer_length, uint32_t* processed_bytes)
+{
+	struct host_partition* pt = host_partition_get(partition_handle);
+	size_t n;
+
+	*processed_bytes = 0;
+
+	if (!pt)
+		return 1;
+
+	host_io.read_calls++;
+
+	if (fseeko(pt->file, pt->position, SEEK_SET))
+		return 1;
+
+	n = fread(buffer, 1, buffer_length, pt->file);
+	host_device_cost(&host_emmc_device, pt->base + pt->position, n);
+	pt->position += n;
+	*processed_bytes = n;
+	host_io.read_bytes += n;
+	return 0;
+}
+
+int write_partition(int partition_handle, void* buffer, uint32_t data_size, uint32_t* processed_bytes)
+{
+	struct host_partition* pt = host_partition_get(partition_handle);
+	size_t n;
+
+	*processed_bytes = 0;
+
+	if (!pt || !(pt->open_type & PARTITION_OPEN_WRITE))
+		return 1;
+
+	host_io.write_calls++;
+
+	if (fseeko(pt->file, pt->position, SEEK_SET))
+		return 1;
+
+	n = fwrite(buffer, 1, data_size, pt->file);
+	fflush(pt->file);
+	host_device_cost(&host_emmc_device, pt->base + pt->position, n);
+	pt->position += n;
+	*processed_bytes = n;
+	host_io.write_bytes += n;
+	return 0;
+}
+
+int close_partition(int partition_handle)
+{
+	struct host_partition* pt = host_partition_get(partition_handle);
+
+	if (!pt)
+		return 1;
+
+	fclose(pt->file);
+	pt->file = NULL;
+	return 0;
+}
+
+int get_partition_size(const char* partition, uint64_t* partition_size)
+{
+	FILE* f = host_partition_fopen(partition, "rb");
+
+	if (!f)
+		return 1;
+
+	fseeko(f, 0, SEEK_END);
+	*partition_size = ftello(f);
+	fclose(f);
+	return 0;
+}
+
+/* Erase keeps the size, content becomes zeroes */
+int format_partition(const char* partition)
+{
+	static const char zeroes[65536];
+	uint64_t size, left;
+	size_t chunk;
+	FILE* f;
+
+	if (get_partition_size(partition, &size))
+		return 1;
+
+	f = host_partition_fopen(partition, "r+b");
+	if (!f)
+		return 1;
+
+	left = size;
+	while (left > 0)
+	{
+		chunk = left > sizeof(zeroes) ? sizeof(zeroes) : left;
+		fwrite(zeroes, 1, chunk, f);
+		left -= chunk;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* ===========================================================================
+ * Miscellaneous
+ * ===========================================================================
+ */
+
+int is_wifi_only()
+{
+	return 1;
+}
+
+void get_serial_no(uint32_t* serial_no)
+{
+	serial_no[0] = 0x89ABCDEF;
+	serial_no[1] = 0x01234567;
+}
+
+void reboot(void* global_handle)
+{
+	host_exit(0, "reboot");
+}
+
+int check_bootloader_update(void* global_handle)
+{
+	return 0;
+}
+
+/* ===========================================================================
+ * Booting
+ * ===========================================================================
+ */
+
+static uint32_t host_page_align(uint32_t size, uint32_t page_size)
+{
+	return ((size + page_size - 1) / page_size) * page_size;
+}
+
+int android_load_image(struct boot_img_hdr** bootimg_ptr, uint32_t* bootimg_size, const char* partition)
+{
+	struct boot_img_hdr hdr;
+	uint32_t size;
+	FILE* f;
+	char* data;
+
+	f = host_partition_fopen(partition, "rb");
+	if (!f)
+		return 0;
+
+	if (fread(&hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) || !hdr.page_size)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	size = host_page_align(sizeof(hdr), hdr.page_size) + host_page_align(hdr.kernel_size, hdr.page_size) +
+	       host_page_align(hdr.ramdisk_size, hdr.page_size) + host_page_align(hdr.second_size, hdr.page_size);
+
+	data = calloc(1, size);
+	if (!data)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	fseeko(f, 0, SEEK_SET);
+	host_io.read_calls++;
+	host_io.read_bytes += fread(data, 1, size, f);
+	fclose(f);
+
+	*bootimg_ptr = (struct boot_img_hdr*)data;
+	*bootimg_size = size;
+	return 1;
+}
+
+/* Doesn't return on success, like the real one */
+void android_boot_image(struct boot_img_hdr* bootimg, uint32_t bootimg_size, uint32_t ram_base)
+{
+	char custom_cmdline[1024];
+
+	if (memcmp(bootimg->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) || !bootimg->page_size)
+		return;
+
+	/* The patched BL calls back into the bootmenu while preparing ATAGs */
+	custom_cmdline[0] = '\0';
+	configure_custom_cmdline(custom_cmdline, sizeof(custom_cmdline));
+	finalize_atags();
+
+	host_report_boot((const uint8_t*)bootimg, bootimg_size, custom_cmdline);
+	host_exit(0, "booted kernel image");
+}
+
+int add_atag(uint32_t atag, uint32_t size, void* data)
+{
+	return 0;
+}
+
+/* ===========================================================================
+ * Direct device access
+ * ===========================================================================
+ */
+
+/*
+ * The eMMC is made up from the partition images found: an MBR with the first
+ * three as primary partitions and an extended partition with an EBR in front
+ * of each of the others, every partition starting on a 1 MiB boundary. The
+ * sectors of a partition are read from its image. Read only.
+ */
+
+#define HOST_SECTOR_SIZE   512
+#define HOST_EMMC_ALIGN         2048
+#define HOST_EMMC_PRIMARY       3
+
+static const char* host_emmc_layout[] = { "SOS", "LNX", "APP", "CAC", "MSC", "FLX", "AKB", "UDA", "UBN" };
+
+struct host_emmc_part
+{
+	const char* name;
+	FILE* file;
+	uint32_t ebr;      /* 0 for a primary partition */
+	uint32_t start;
+	uint32_t sectors;
+};
+
+static struct host_emmc_part host_emmc_parts[HOST_MAX_PARTITIONS];
+static int host_emmc_count = -1;
+static int host_emmc_handle;
+
+static uint32_t host_emmc_align(uint32_t sector)
+{
+	return ((sector + HOST_EMMC_ALIGN - 1) / HOST_EMMC_ALIGN) * HOST_EMMC_ALIGN;
+}
+
+static void host_emmc_build(void)
+{
+	struct host_emmc_part* part;
+	uint32_t next;
+	uint64_t size;
+	FILE* f;
+	int i;
+
+	host_emmc_count = 0;
+	next = HOST_EMMC_ALIGN;
+
+	for (i = 0; i < (int)(sizeof(host_emmc_layout) / sizeof(host_emmc_layout[0])); i++)
+	{
+		if (get_partition_size(host_emmc_layout[i], &size) || size < HOST_SECTOR_SIZE)
+			continue;
+
+		f = host_partition_fopen(host_emmc_layout[i], "rb");
+		if (!f)
+			continue;
+
+		part = &host_emmc_parts[host_emmc_count];
+		part->name = host_emmc_layout[i];
+		part->file = f;
+		part->sectors = size / HOST_SECTOR_SIZE;
+
+		if (host_emmc_count < HOST_EMMC_PRIMARY)
+		{
+			part->ebr = 0;
+			part->start = next;
+		}
+		else
+		{
+			part->ebr = next;
+			part->start = next + HOST_EMMC_ALIGN;
+		}
+
+		next = host_emmc_align(part->start + part->sectors);
+		host_emmc_count++;
+	}
+}
+
+/* Partitions outside of the layout start at 0 */
+static uint64_t host_emmc_partition_offset(const char* partition)
+{
+	int i;
+
+	if (host_emmc_count < 0)
+		host_emmc_build();
+
+	for (i = 0; i < host_emmc_count; i++)
+	{
+		if (!strcmp(host_emmc_parts[i].name, partition))
+			return (uint64_t)host_emmc_parts[i].start * HOST_SECTOR_SIZE;
+	}
+
+	return 0;
+}
+
+static void host_emmc_entry(uint8_t* entry, uint8_t type, uint32_t start, uint32_t sectors)
+{
+	int i;
+
+	entry[4] = type;
+
+	for (i = 0; i < 4; i++)
+	{
+		entry[8 + i] = (start >> (8 * i)) & 0xFF;
+		entry[12 + i] = (sectors >> (8 * i)) & 0xFF;
+	}
+}
+
+/* MBR, an EBR or nothing */
+static void host_emmc_table_sector(uint32_t sector, uint8_t* buf)
+{
+	struct host_emmc_part *part, *last;
+	uint32_t ext_start;
+	int i;
+
+	memset(buf, 0, HOST_SECTOR_SIZE);
+
+	if (host_emmc_count > HOST_EMMC_PRIMARY)
+	{
+		ext_start = host_emmc_parts[HOST_EMMC_PRIMARY].ebr;
+		last = &host_emmc_parts[host_emmc_count - 1];
+	}
+	else
+	{
+		ext_start = 0;
+		last = NULL;
+	}
+
+	if (sector == 0)
+	{
+		for (i = 0; i < host_emmc_count && i < HOST_EMMC_PRIMARY; i++)
+			host_emmc_entry(buf + 0x1BE + 16 * i, 0x83, host_emmc_parts[i].start, host_emmc_parts[i].sectors);
+
+		if (last)
+			host_emmc_entry(buf + 0x1BE + 16 * HOST_EMMC_PRIMARY, 0x05, ext_start, last->start + last->sectors - ext_start);
+	}
+	else
+	{
+		for (i = HOST_EMMC_PRIMARY; i < host_emmc_count; i++)
+		{
+			part = &host_emmc_parts[i];
+			if (part->ebr != sector)
+				continue;
+
+			host_emmc_entry(buf + 0x1BE, 0x83, part->start - part->ebr, part->sectors);
+
+			if (i + 1 < host_emmc_count)
+			{
+				part = &host_emmc_parts[i + 1];
+				host_emmc_entry(buf + 0x1BE + 16, 0x05, part->ebr - ext_start, part->start + part->sectors - part->ebr);
+			}
+
+			break;
+		}
+
+		if (i == host_emmc_count)
+			return;
+	}
+
+	buf[510] = 0x55;
+	buf[511] = 0xAA;
+}
+
+int hsmmc_open(int major, int minor, int** handle)
+{
+	if (host_emmc_count < 0)
+		host_emmc_build();
+
+	if (host_emmc_count == 0)
+		return 1;
+
+	*handle = &host_emmc_handle;
+	return 0;
+}
+
+int hsmmc_close(int* handle)
+{
+	return handle != &host_emmc_handle;
+}
+
+int hsmmc_read_sector(int* handle, uint32_t sector, void* buffer, uint32_t num_sectors)
+{
+	struct host_emmc_part* part;
+	uint8_t* dest = buffer;
+	uint32_t count;
+	int i;
+
+	if (handle != &host_emmc_handle)
+		return 1;
+
+	host_io.emmc_reads++;
+	host_io.emmc_bytes += (uint64_t)num_sectors * HOST_SECTOR_SIZE;
+	host_device_cost(&host_emmc_device, (uint64_t)sector * HOST_SECTOR_SIZE, (uint64_t)num_sectors * HOST_SECTOR_SIZE);
+
+	while (num_sectors > 0)
+	{
+		part = NULL;
+		for (i = 0; i < host_emmc_count; i++)
+		{
+			if (sector >= host_emmc_parts[i].start && sector < host_emmc_parts[i].start + host_emmc_parts[i].sectors)
+				part = &host_emmc_parts[i];
+		}
+
+		if (part)
+		{
+			count = part->start + part->sectors - sector;
+			if (count > num_sectors)
+				count = num_sectors;
+
+			if (fseeko(part->file, (off_t)(sector - part->start) * HOST_SECTOR_SIZE, SEEK_SET) ||
+			    fread(dest, HOST_SECTOR_SIZE, count, part->file) != count)
+				return 1;
+		}
+		else
+		{
+			count = 1;
+			host_emmc_table_sector(sector, dest);
+		}
+
+		dest += count * HOST_SECTOR_SIZE;
+		sector += count;
+		num_sectors -= count;
+	}
+
+	return 0;
+}
+
+int hsmmc_ioctl(int* handle, uint32_t opcode, uint32_t input_size, uint32_t output_size, const void* input_args, void* output_args) { return 1; }
+int hsmmc_power_up(int* handle)                                                                                                     { return 1; }
+int hsmmc_power_down(int* handle)                                                                                                   { return 1; }
+int hsmmc_write_sector(int* handle, uint32_t sector, void* buffer, uint32_t num_sectors)                                            { return 1; }
+
+/* SD card, present if an image was given. Read only. */
+static FILE* host_sd_file = NULL;
+static int host_sd_handle;
+
+int sd_open(int major, int minor, int** handle)
+{
+	if (!host_cfg.sdcard)
+		return 1;
+
+	if (!host_sd_file)
+	{
+		host_sd_file = fopen(host_cfg.sdcard, "rb");
+		if (!host_sd_file)
+			return 1;
+	}
+
+	*handle = &host_sd_handle;
+	return 0;
+}
+
+int sd_close(int* handle)
+{
+	return handle != &host_sd_handle;
+}
+
+int sd_read_sector(int* handle, uint32_t sector, void* buffer, uint32_t num_sectors)
+{
+	if (handle != &host_sd_handle || !host_sd_file)
+		return 1;
+
+	host_io.sd_reads++;
+	host_io.sd_bytes += (uint64_t)num_sectors * HOST_SECTOR_SIZE;
+	host_device_cost(&host_sd_device, (uint64_t)sector * HOST_SECTOR_SIZE, (uint64_t)num_sectors * HOST_SECTOR_SIZE);
+
+	if (fseeko(host_sd_file, (off_t)sector * HOST_SECTOR_SIZE, SEEK_SET) ||
+	    fread(buffer, HOST_SECTOR_SIZE, num_sectors, host_sd_file) != num_sectors)
+		return 1;
+
+	return 0;
+}
+
+int sd_ioctl(int* handle, uint32_t opcode, uint32_t input_size, uint32_t output_size, const void* input_args, void* output_args)    { return 1; }
+int sd_power_up(int* handle)                                                                                                        { return 1; }
+int sd_power_down(int* handle)                                                                                                      { return 1; }
+int sd_write_sector(int* handle, uint32_t sector, void* buffer, uint32_t num_sectors)                                               { return 1; }
+
+/* ===========================================================================
+ * Fastboot (pipe transport)
+ * ===========================================================================
+ */
+
+/*
+ * Commands and replies are one per line. After a "DATA%08x" reply the given
+ * amount of raw bytes follows on the input, just like the USB data phase.
+ */
+
+static FILE* host_fastboot_in = NULL;
+static FILE* host_fastboot_out = NULL;
+static uint32_t host_fastboot_data_left = 0;
+
+int host_fastboot_open(const char* in, const char* out)
+{
+	host_fastboot_in = strcmp(in, "-") ? fopen(in, "rb") : stdin;
+	host_fastboot_out = strcmp(out, "-") ? fopen(out, "wb") : stdout;
+
+	return host_fastboot_in == NULL || host_fastboot_out == NULL;
+}
+
+void fastboot_init_unk0(void* global_handle)
+{
+}
+
+void fastboot_init_unk1()
+{
+}
+
+int fastboot_load_handle(int* fastboot_handle)
+{
+	if (!host_fastboot_in)
+		host_exit(1, "fastboot mode without transport");
+
+	if (feof(host_fastboot_in) || ferror(host_fastboot_in))
+		host_exit(0, "fastboot transport closed");
+
+	*fastboot_handle = 1;
+	return 0;
+}
+
+void fastboot_unload_handle(int fastboot_handle)
+{
+}
+
+int fastboot_send(int fastboot_handle, const char *command, uint32_t command_length)
+{
+	if (!host_fastboot_out)
+		return 1;
+
+	fwrite(command, 1, command_length, host_fastboot_out);
+	fputc('\n', host_fastboot_out);
+	fflush(host_fastboot_out);
+
+	if (command_length == 12 && !strncmp(command, "DATA", 4))
+		host_fastboot_data_left = strtoul(command + 4, NULL, 16);
+
+	return 0;
+}
+
+static int host_fastboot_recv(char* cmd_buffer, uint32_t buffer_length, uint32_t* cmd_length)
+{
+	uint32_t len;
+
+	*cmd_length = 0;
+
+	if (!host_fastboot_in)
+		return 1;
+
+	/* Data phase */
+	if (host_fastboot_data_left > 0)
+	{
+		len = buffer_length < host_fastboot_data_left ? buffer_length : host_fastboot_data_left;
+		len = fread(cmd_buffer, 1, len, host_fastboot_in);
+		host_fastboot_data_left -= len;
+		*cmd_length = len;
+		return len == 0;
+	}
+
+	/* Command phase */
+	if (!fgets(cmd_buffer, buffer_length, host_fastboot_in))
+		return 1;
+
+	len = strcspn(cmd_buffer, "\r\n");
+	cmd_buffer[len] = '\0';
+	*cmd_length = len;
+	return 0;
+}
+
+int fastboot_recv0(int fastboot_handle, char* cmd_buffer, uint32_t buffer_length, uint32_t* cmd_length)
+{
+	return host_fastboot_recv(cmd_buffer, buffer_length, cmd_length);
+}
+
+int fastboot_recv5(int fastboot_handle, char* cmd_buffer, uint32_t buffer_length, uint32_t* cmd_length)
+{
+	return host_fastboot_recv(cmd_buffer, buffer_length, cmd_length);
+}
+
+/* ===========================================================================
+ * Host helpers
+ * ===========================================================================
+ */
+
+uint32_t host_crc32(const uint8_t* data, uint32_t size)
+{
+	static uint32_t table[256];
+	static int table_ready = 0;
+	uint32_t crc, c;
+	int i, j;
+
+	if (!table_ready)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+
+			table[i] = c;
+		}
+
+		table_ready = 1;
+	}
+
+	crc = 0xFFFFFFFF;
+	while (size--)
+		crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+}
@@ -0,0 +1,133 @@
+/*
+ * Host (Linux PC) stand-in for the Acer bootloader.
+ *
+ * Copyright (C) 2013 Skrilax_CZ
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * The bootmenu sources are compiled unchanged with -DBOOTMENU_HOST and linked
+ * against host/bl_host.c, which replaces every routine bl_0_03_14.c maps from
+ * the Acer binary. This header is only shared by the host side files, it must
+ * not be included together with bl_0_03_14.h (the BL libc prototypes differ).
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* The bootloader image regions framebuffer.c reads directly (see skin.h) */
+#define HOST_BL_REGION_START      0x19F000
+#define HOST_BL_REGION_SIZE       0x38000
+
+/* Keys are considered forgotten after this much idle virtual time */
+#define HOST_DEFAULT_IDLE_MS      60000
+
+/*
+ * Cost model of the eMMC / SD card behind the partition and sector stand-ins.
+ * Every command costs latency_us, plus the transfer at bandwidth_kib KiB/s,
+ * plus seek_us when it doesn't continue where the previous command on the
+ * same device ended. All zero means the device is free (the default).
+ */
+struct host_device_model
+{
+	uint64_t latency_us;
+	uint64_t bandwidth_kib;
+	uint64_t seek_us;
+};
+
+/* Host configuration */
+struct host_config
+{
+	/* Directory holding LNX.img, APP.img, UBN.img, MSC.img, ... */
+	const char* partition_dir;
+
+	/* PPM screenshot path, may contain %d for numbered frames */
+	const char* screenshot;
+
+	/* Fastboot pipe transport ("-" for stdin / stdout) */
+	const char* fastboot_in;
+	const char* fastboot_out;
+
+	/* Bootloader log (printf) */
+	FILE* log;
+
+	/* Virtual idle time after the key script before giving up */
+	uint64_t idle_ms;
+
+	/* SD card image (whole disk), NULL if there's no card */
+	const char* sdcard;
+
+	/* Simulated block device (see host_device_cost in bl_host.c) */
+	struct host_device_model device;
+};
+
+/* Partition I/O seen by the stand-in layer */
+struct host_io_stats
+{
+	uint64_t read_calls;
+	uint64_t read_bytes;
+	uint64_t write_calls;
+	uint64_t write_bytes;
+	uint64_t seek_calls;
+	uint64_t opens;
+
+	/* Sector reads of the eMMC (hsmmc) */
+	uint64_t emmc_reads;
+	uint64_t emmc_bytes;
+
+	/* Sector reads of the SD card */
+	uint64_t sd_reads;
+	uint64_t sd_bytes;
+
+	/* Time the simulated block device spent on commands */
+	uint64_t device_ns;
+
+	/* Commands not continuing the previous one on the same device */
+	uint64_t device_seeks;
+};
+
+extern struct host_config host_cfg;
+extern struct host_io_stats host_io;
+
+/* Virtual clock, advanced by sleep() only */
+extern uint64_t host_clock_ms;
+
+/* Parse key script, returns 0 on success */
+int host_keys_parse(const char* script);
+
+/* Open fastboot transport, returns 0 on success */
+int host_fastboot_open(const char* in, const char* out);
+
+/* Print the session report and leave */
+void host_exit(int status, const char* reason) __attribute__((noreturn));
+
+/* Report booted image (called by the android_boot_image stand-in) */
+void host_report_boot(const uint8_t* bootimg, uint32_t bootimg_size, const char* custom_cmdline);
+
+/* Parse a device model "LATENCY_US[,BANDWIDTH_KIB[,SEEK_US]]", returns 0 on success */
+int host_device_parse(struct host_device_model* model, const char* spec);
+
+/* Forget where the previous commands ended (every device starts with a seek) */
+void host_device_reset(void);
+
+/* CRC32 helper for reports */
+uint32_t host_crc32(const uint8_t* data, uint32_t size);
+
+#endif //!HOST_H
@@ -0,0 +1,650 @@
+/*
+ * Host (Linux PC) ext2fs benchmark.
+ *
+ * Copyright (C) 2013 Skrilax_CZ
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Runs the ext2fs loaders over the images made by host/bench/mkimages.sh,
+ * through the same file backed partitions as bootmenu-host. Each scenario
+ * starts without any mounts, so the numbers include mounting and lookup.
+ *
+ * The BL call counts and bytes read don't depend on the machine, a scenario
+ * reading more than the baseline (or different data) fails. Wall time is only
+ * checked when asked for (-T).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "host.h"
+#include "ext2fs.h"
+
+#define BENCH_MAX_SCENARIOS     64
+#define BENCH_DEFAULT_RUNS      5
+
+/* Chunk of the ext2fs_read scenarios */
+#define BENCH_READ_CHUNK        0x10000
+
+/* Readahead window and (small) reads of the ext2fs_fread scenarios */
+#define BENCH_RA_SLOTS          4
+#define BENCH_RA_CHUNK          0x10000
+#define BENCH_RA_READ           0x1000
+
+/* Scenario operations */
+#define BENCH_OP_READ           0   /* ext2fs_mount, ext2fs_open and ext2fs_read */
+#define BENCH_OP_LOAD           1   /* ext2fs_loadfile */
+#define BENCH_OP_LINES          2   /* ext2fs_mount, ext2fs_open and ext2fs_getline */
+#define BENCH_OP_BOOT           3   /* ext2fs_loadboot with the block map it recorded */
+#define BENCH_OP_RA             4   /* ext2fs_fopen, ext2fs_freadahead and ext2fs_fread */
+
+static const char* bench_op_names[] = { "read", "load", "lines", "boot", "ra" };
+
+struct bench_result
+{
+	uint32_t size;
+	uint32_t crc;
+	uint64_t reads;
+	uint64_t seeks;
+	uint64_t opens;
+	uint64_t bytes;
+	uint64_t wall_us;
+	uint64_t device_ns;
+};
+
+struct bench_scenario
+{
+	char name[32];
+	int op;
+	char path[256];
+
+	/* boot: directory (under the partitions) the files are loaded from the second time */
+	char dir[32];
+
+	int has_baseline;
+	struct bench_result baseline;
+	struct bench_result result;
+};
+
+static struct bench_scenario bench_scenarios[BENCH_MAX_SCENARIOS];
+static int bench_count = 0;
+
+/* bl_host.c calls these when the bootmenu would leave, which never happens here */
+void host_exit(int status, const char* reason)
+{
+	fprintf(stderr, "BENCH: exit: %s\n", reason);
+	exit(status);
+}
+
+void host_report_boot(const uint8_t* bootimg, uint32_t bootimg_size, const char* custom_cmdline)
+{
+}
+
+static uint64_t bench_now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Pseudo random test data (xorshift32), so that the images are the same every time */
+static int bench_generate(const char* spec)
+{
+	uint32_t size, seed, i;
+	char* endp;
+
+	size = strtoul(spec, &endp, 0);
+	if (*endp != ':')
+		return 1;
+
+	seed = strtoul(endp + 1, &endp, 0);
+	if (*endp != '\0' || seed == 0)
+		return 1;
+
+	for (i = 0; i < size; i++)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		putchar(seed & 0xFF);
+	}
+
+	return 0;
+}
+
+/* Scenario list: name, operation (read, load, lines or boot), path in BL format and for boot a directory */
+static int bench_load_scenarios(const char* path)
+{
+	struct bench_scenario* sc;
+	char line[512], op[16];
+	FILE* f;
+	int n;
+
+	f = fopen(path, "r");
+	if (!f)
+	{
+		fprintf(stderr, "BENCH: cannot open scenarios %s\n", path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), f))
+	{
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		if (bench_count >= BENCH_MAX_SCENARIOS)
+		{
+			fprintf(stderr, "BENCH: too many scenarios\n");
+			break;
+		}
+
+		sc = &bench_scenarios[bench_count];
+		sc->dir[0] = '\0';
+		n = sscanf(line, "%31s %15s %255s %31s", sc->name, op, sc->path, sc->dir);
+
+		if ((n != 3 && (n != 4 || strcmp(op, "boot"))) ||
+		    (strcmp(op, "read") && strcmp(op, "load") && strcmp(op, "lines") && strcmp(op, "boot") && strcmp(op, "ra")))
+		{
+			fprintf(stderr, "BENCH: bad scenario line: %s", line);
+			fclose(f);
+			return 1;
+		}
+
+		if (!strcmp(op, "read"))
+			sc->op = BENCH_OP_READ;
+		else if (!strcmp(op, "lines"))
+			sc->op = BENCH_OP_LINES;
+		else if (!strcmp(op, "boot"))
+			sc->op = BENCH_OP_BOOT;
+		else if (!strcmp(op, "ra"))
+			sc->op = BENCH_OP_RA;
+		else
+			sc->op = BENCH_OP_LOAD;
+		bench_count++;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* Baseline: name crc32 reads seeks opens bytes wall_us */
+static int bench_load_baseline(const char* path)
+{
+	struct bench_result r;
+	char line[512], name[32];
+	FILE* f;
+	int i;
+
+	f = fopen(path, "r");
+	if (!f)
+	{
+		fprintf(stderr, "BENCH: cannot open baseline %s\n", path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), f))
+	{
+		if (line[0] == '#')
+			continue;
+
+		memset(&r, 0, sizeof(r));
+		if (sscanf(line, "%31s %x %llu %llu %llu %llu %llu", name, &r.crc,
+		           (unsigned long long*)&r.reads, (unsigned long long*)&r.seeks, (unsigned long long*)&r.opens,
+		           (unsigned long long*)&r.bytes, (unsigned long long*)&r.wall_us) != 7)
+			continue;
+
+		for (i = 0; i < bench_count; i++)
+		{
+			if (!strcmp(bench_scenarios[i].name, name))
+			{
+				bench_scenarios[i].baseline = r;
+				bench_scenarios[i].has_baseline = 1;
+			}
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int bench_write_baseline(const char* path)
+{
+	struct bench_result* r;
+	FILE* f;
+	int i;
+
+	f = fopen(path, "w");
+	if (!f)
+	{
+		fprintf(stderr, "BENCH: cannot write baseline %s\n", path);
+		return 1;
+	}
+
+	fprintf(f, "# ext2fs benchmark baseline (make bench-baseline)\n");
+	fprintf(f, "# name crc32 reads seeks opens bytes wall_us\n");
+
+	for (i = 0; i < bench_count; i++)
+	{
+		r = &bench_scenarios[i].result;
+		fprintf(f, "%s %08x %llu %llu %llu %llu %llu\n", bench_scenarios[i].name, r->crc,
+		        (unsigned long long)r->reads, (unsigned long long)r->seeks, (unsigned long long)r->opens,
+		        (unsigned long long)r->bytes, (unsigned long long)r->wall_us);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* Clear the MSC image of the partitions, so there's no block map from an earlier run */
+static int bench_clear_msc(void)
+{
+	char path[1024], zero[4096];
+	long size;
+	FILE* f;
+
+	snprintf(path, sizeof(path), "%s/MSC.img", host_cfg.partition_dir);
+
+	f = fopen(path, "r+b");
+	if (!f)
+		return 1;
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+
+	memset(zero, 0, sizeof(zero));
+	for (; size > 0; size -= sizeof(zero))
+		fwrite(zero, 1, size < (long)sizeof(zero) ? size : (long)sizeof(zero), f);
+
+	fclose(f);
+	return 0;
+}
+
+/* Boot load, records the block map on MSC the first time and uses it after */
+static int bench_loadboot(const char* path, char** data, int* size)
+{
+	struct ext2fs_load_item item;
+
+	item.path = path;
+	item.data = NULL;
+
+	if (ext2fs_loadboot(&item, 1, NULL, NULL))
+		return 1;
+
+	*data = item.data;
+	*size = item.size;
+	return 0;
+}
+
+/* Small sequential reads through a readahead window */
+static int bench_fread(const char* path, char** data, int* size)
+{
+	int fd, len, n;
+
+	fd = ext2fs_fopen(path);
+	if (fd < 0)
+		return 1;
+
+	*size = ext2fs_fsize(fd);
+	*data = malloc(*size + 1);
+
+	if (!*data || ext2fs_freadahead(fd, BENCH_RA_SLOTS, BENCH_RA_CHUNK))
+	{
+		ext2fs_fclose(fd);
+		return 1;
+	}
+
+	for (len = 0; len < *size; len += n)
+	{
+		n = ext2fs_fread(fd, *data + len, *size - len < BENCH_RA_READ ? *size - len : BENCH_RA_READ);
+		if (n <= 0)
+			break;
+	}
+
+	ext2fs_fclose(fd);
+	return len != *size;
+}
+
+/* One cold run, 0 on success */
+static int bench_run_once(struct bench_scenario* sc, struct bench_result* r)
+{
+	const char* partition_dir = host_cfg.partition_dir;
+	char partition[8], dir[1024];
+	char *data, *line;
+	const char* sep;
+	uint64_t start;
+	int size, len, n;
+
+	ext2fs_invalidate(NULL);
+	data = NULL;
+
+	/* Record the block map, the measured load is the second one (from dir if set) */
+	if (sc->op == BENCH_OP_BOOT)
+	{
+		if (bench_clear_msc() || bench_loadboot(sc->path, &data, &size))
+			return 1;
+
+		free(data);
+		data = NULL;
+		ext2fs_invalidate(NULL);
+
+		if (sc->dir[0])
+		{
+			snprintf(dir, sizeof(dir), "%s/%s", partition_dir, sc->dir);
+			host_cfg.partition_dir = dir;
+		}
+	}
+
+	memset(&host_io, 0, sizeof(host_io));
+	host_device_reset();
+
+	start = bench_now_us();
+
+	if (sc->op == BENCH_OP_READ || sc->op == BENCH_OP_LINES)
+	{
+		sep = strchr(sc->path, ':');
+		if (!sep || sep - sc->path >= (int)sizeof(partition))
+			return 1;
+
+		memcpy(partition, sc->path, sep - sc->path);
+		partition[sep - sc->path] = '\0';
+
+		if (ext2fs_mount(partition))
+			return 1;
+
+		size = ext2fs_open(sep + 1);
+		if (size < 0)
+		{
+			ext2fs_unmount();
+			return 1;
+		}
+
+		data = malloc(size + 1);
+		for (len = 0; data && len < size; len += n)
+		{
+			/* The lines put back together have to give the file */
+			if (sc->op == BENCH_OP_LINES)
+			{
+				n = ext2fs_getline(&line);
+				if (n <= 0 || n > size - len)
+					break;
+
+				memcpy(data + len, line, n);
+				continue;
+			}
+
+			n = ext2fs_read(data + len, size - len < BENCH_READ_CHUNK ? size - len : BENCH_READ_CHUNK);
+			if (n <= 0)
+				break;
+		}
+
+		ext2fs_close();
+		ext2fs_unmount();
+
+		if (!data || len != size)
+		{
+			free(data);
+			return 1;
+		}
+	}
+	else if (sc->op == BENCH_OP_BOOT)
+	{
+		n = bench_loadboot(sc->path, &data, &size);
+
+		ext2fs_invalidate(NULL);
+		host_cfg.partition_dir = partition_dir;
+
+		if (n)
+			return 1;
+	}
+	else if (sc->op == BENCH_OP_RA)
+	{
+		n = bench_fread(sc->path, &data, &size);
+
+		ext2fs_invalidate(NULL);
+
+		if (n)
+		{
+			free(data);
+			return 1;
+		}
+	}
+	else if (ext2fs_loadfile(&data, &size, sc->path))
+		return 1;
+
+	r->wall_us = bench_now_us() - start;
+	r->size = size;
+	r->crc = host_crc32((const uint8_t*)data, size);
+	r->reads = host_io.read_calls;
+	r->seeks = host_io.seek_calls;
+	r->opens = host_io.opens;
+	r->bytes = host_io.read_bytes;
+	r->device_ns = host_io.device_ns;
+
+	free(data);
+	return 0;
+}
+
+/* Best wall time of runs, the counts are the same every run */
+static int bench_run(struct bench_scenario* sc, int runs)
+{
+	struct bench_result r;
+	int i;
+
+	for (i = 0; i < runs; i++)
+	{
+		if (bench_run_once(sc, &r))
+			return 1;
+
+		if (i == 0 || r.wall_us < sc->result.wall_us)
+			sc->result = r;
+	}
+
+	return 0;
+}
+
+/* Compare with the baseline, prints the verdict, returns 1 on a regression */
+static int bench_check(struct bench_scenario* sc, double wall_factor, FILE* out)
+{
+	struct bench_result* r = &sc->result;
+	struct bench_result* b = &sc->baseline;
+
+	if (!sc->has_baseline)
+	{
+		fprintf(out, "  new\n");
+		return 0;
+	}
+
+	if (r->crc != b->crc)
+	{
+		fprintf(out, "  FAIL: data crc32 %08x, expected %08x\n", r->crc, b->crc);
+		return 1;
+	}
+
+	if (r->reads > b->reads || r->seeks > b->seeks || r->opens > b->opens || r->bytes > b->bytes)
+	{
+		fprintf(out, "  FAIL: baseline reads %llu, seeks %llu, opens %llu, %llu KiB\n",
+		        (unsigned long long)b->reads, (unsigned long long)b->seeks, (unsigned long long)b->opens,
+		        (unsigned long long)(b->bytes >> 10));
+		return 1;
+	}
+
+	if (wall_factor > 0 && r->wall_us > b->wall_us * wall_factor)
+	{
+		fprintf(out, "  FAIL: baseline wall %.3f ms\n", b->wall_us / 1000.0);
+		return 1;
+	}
+
+	if (r->reads < b->reads || r->seeks < b->seeks || r->opens < b->opens || r->bytes < b->bytes)
+		fprintf(out, "  better than baseline\n");
+	else
+		fprintf(out, "  ok\n");
+
+	return 0;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+	        "Usage: %s [options] -s SCENARIOS\n"
+	        "       %s -g SIZE:SEED\n"
+	        "\n"
+	        "  -p, --partitions DIR    directory with <PARTITION>.img files (default .)\n"
+	        "  -s, --scenarios FILE    scenario list (name, read|load|lines|boot, PARTITION:path[, dir])\n"
+	        "  -c, --compare FILE      baseline to compare with, regressions fail the run\n"
+	        "  -w, --write FILE        write the results as a new baseline\n"
+	        "  -n, --runs N            runs per scenario, the best wall time counts (default %d)\n"
+	        "  -T, --wall-factor F     also fail when wall time exceeds F times the baseline\n"
+	        "  -D, --device MODEL      simulated block device, LATENCY_US[,BANDWIDTH_KIB[,SEEK_US]]\n"
+	        "  -l, --log FILE          bootloader log (default none)\n"
+	        "  -g, --generate SIZE:SEED write SIZE bytes of test data to stdout\n",
+	        name, name, BENCH_DEFAULT_RUNS);
+}
+
+int main(int argc, char** argv)
+{
+	static const struct option options[] =
+	{
+		{ "partitions",   required_argument, NULL, 'p' },
+		{ "scenarios",    required_argument, NULL, 's' },
+		{ "compare",      required_argument, NULL, 'c' },
+		{ "write",        required_argument, NULL, 'w' },
+		{ "runs",         required_argument, NULL, 'n' },
+		{ "wall-factor",  required_argument, NULL, 'T' },
+		{ "device",       required_argument, NULL, 'D' },
+		{ "log",          required_argument, NULL, 'l' },
+		{ "generate",     required_argument, NULL, 'g' },
+		{ "help",         no_argument,       NULL, 'h' },
+		{ NULL,           0,                 NULL, 0   },
+	};
+
+	struct bench_scenario* sc;
+	const char* scenarios = NULL;
+	const char* compare = NULL;
+	const char* write = NULL;
+	double wall_factor = 0;
+	int runs = BENCH_DEFAULT_RUNS;
+	int failed = 0;
+	int c, i;
+
+	host_cfg.log = NULL;
+
+	while ((c = getopt_long(argc, argv, "p:s:c:w:n:T:D:l:g:h", options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'p': host_cfg.partition_dir = optarg; break;
+			case 's': scenarios = optarg; break;
+			case 'c': compare = optarg; break;
+			case 'w': write = optarg; break;
+			case 'n': runs = atoi(optarg); break;
+			case 'T': wall_factor = atof(optarg); break;
+
+			case 'D':
+				if (host_device_parse(&host_cfg.device, optarg))
+				{
+					fprintf(stderr, "BENCH: invalid device model \"%s\"\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'l':
+				host_cfg.log = fopen(optarg, "w");
+				if (!host_cfg.log)
+				{
+					fprintf(stderr, "BENCH: cannot open log %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'g':
+				if (bench_generate(optarg))
+				{
+					fprintf(stderr, "BENCH: invalid data spec \"%s\"\n", optarg);
+					return 1;
+				}
+				return 0;
+
+			case 'h':
+				usage(argv[0]);
+				return 0;
+
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (!scenarios || runs < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (bench_load_scenarios(scenarios))
+		return 1;
+
+	if (compare && bench_load_baseline(compare))
+		return 1;
+
+	for (i = 0; i < bench_count; i++)
+	{
+		sc = &bench_scenarios[i];
+
+		if (bench_run(sc, runs))
+		{
+			fprintf(stdout, "BENCH: %-16s %s: FAIL: cannot %s %s\n", sc->name, bench_op_names[sc->op],
+			        bench_op_names[sc->op], sc->path);
+			failed++;
+			continue;
+		}
+
+		fprintf(stdout, "BENCH: %-16s %s %8u bytes, reads %5llu, seeks %5llu, opens %2llu, read %6llu KiB, wall %8.3f ms",
+		        sc->name, bench_op_names[sc->op], sc->result.size,
+		        (unsigned long long)sc->result.reads, (unsigned long long)sc->result.seeks,
+		        (unsigned long long)sc->result.opens, (unsigned long long)(sc->result.bytes >> 10),
+		        sc->result.wall_us / 1000.0);
+
+		if (sc->result.device_ns)
+			fprintf(stdout, ", device %8.3f ms", sc->result.device_ns / 1000000.0);
+
+		if (compare)
+			failed += bench_check(sc, wall_factor, stdout);
+		else
+			fprintf(stdout, "\n");
+	}
+
+	ext2fs_invalidate(NULL);
+
+	if (write && bench_write_baseline(write))
+		return 1;
+
+	if (failed)
+	{
+		fprintf(stdout, "BENCH: %d of %d scenarios failed\n", failed, bench_count);
+		return 1;
+	}
+
+	fprintf(stdout, "BENCH: %d scenarios passed\n", bench_count);
+	return 0;
+}
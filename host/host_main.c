@@ -0,0 +1,326 @@
+/*
+ * Host (Linux PC) runner for the bootmenu.
+ *
+ * Copyright (C) 2013 Skrilax_CZ
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "host.h"
+#include "bootmenu.h"
+#include "ext2fs.h"
+
+/* Bootloader image layout (see skin.h and the Makefile) */
+#define HOST_FONT_OFFSET          0x1A0000
+#define HOST_FONT_SIZE_LIMIT      0x5000
+#define HOST_BOOTLOGO_OFFSET      0x1A5000
+#define HOST_BOOTLOGO_SIZE_LIMIT  0x32000
+
+/* bootmenu.c main(), renamed for the host build */
+void bootmenu_main(void* global_handle, uint32_t ram_base);
+
+static struct timespec host_start_time;
+static uint64_t host_boot_count = 0;
+
+static double host_wall_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - host_start_time.tv_sec) * 1000.0 + (now.tv_nsec - host_start_time.tv_nsec) / 1000000.0;
+}
+
+void host_report_boot(const uint8_t* bootimg, uint32_t bootimg_size, const char* custom_cmdline)
+{
+	const struct boot_img_hdr* hdr = (const struct boot_img_hdr*)bootimg;
+	uint32_t page, kernel_pages, ramdisk_offset;
+	FILE* f = host_cfg.log ? host_cfg.log : stderr;
+
+	page = hdr->page_size;
+	kernel_pages = (hdr->kernel_size + page - 1) / page;
+	ramdisk_offset = page + kernel_pages * page;
+
+	host_boot_count++;
+
+	fprintf(f, "HOST: boot image %u bytes, page size %u\n", bootimg_size, page);
+
+	if (page + hdr->kernel_size <= bootimg_size)
+		fprintf(f, "HOST: kernel %u bytes, crc32 %08x\n", hdr->kernel_size, host_crc32(bootimg + page, hdr->kernel_size));
+
+	if (ramdisk_offset + hdr->ramdisk_size <= bootimg_size)
+		fprintf(f, "HOST: ramdisk %u bytes, crc32 %08x\n", hdr->ramdisk_size, host_crc32(bootimg + ramdisk_offset, hdr->ramdisk_size));
+
+	fprintf(f, "HOST: cmdline \"%.*s\"\n", BOOT_ARGS_SIZE, (const char*)hdr->cmdline);
+	fprintf(f, "HOST: custom cmdline \"%s\"\n", custom_cmdline);
+}
+
+void host_exit(int status, const char* reason)
+{
+	FILE* f = host_cfg.log ? host_cfg.log : stderr;
+
+	fprintf(f, "HOST: exit: %s\n", reason);
+	fprintf(f, "HOST: virtual time %llu ms, wall time %.3f ms\n", (unsigned long long)host_clock_ms, host_wall_ms());
+	fprintf(f, "HOST: partition reads %llu (%llu bytes), seeks %llu, writes %llu (%llu bytes), opens %llu\n",
+	        (unsigned long long)host_io.read_calls, (unsigned long long)host_io.read_bytes,
+	        (unsigned long long)host_io.seek_calls,
+	        (unsigned long long)host_io.write_calls, (unsigned long long)host_io.write_bytes,
+	        (unsigned long long)host_io.opens);
+
+	if (host_io.emmc_reads)
+		fprintf(f, "HOST: eMMC reads %llu (%llu bytes)\n",
+		        (unsigned long long)host_io.emmc_reads, (unsigned long long)host_io.emmc_bytes);
+
+	if (host_io.sd_reads)
+		fprintf(f, "HOST: SD card reads %llu (%llu bytes)\n",
+		        (unsigned long long)host_io.sd_reads, (unsigned long long)host_io.sd_bytes);
+
+	if (host_io.device_ns)
+		fprintf(f, "HOST: device time %.3f ms, non sequential commands %llu\n",
+		        host_io.device_ns / 1000000.0, (unsigned long long)host_io.device_seeks);
+
+	fflush(f);
+	exit(status);
+}
+
+/* Map the BL image regions framebuffer.c reads directly and fill them */
+static int host_load_region(const char* path, uint32_t offset, uint32_t limit)
+{
+	FILE* f;
+	size_t n;
+
+	f = fopen(path, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "HOST: cannot open %s\n", path);
+		return 1;
+	}
+
+	n = fread((void*)(uintptr_t)offset, 1, limit, f);
+	fclose(f);
+
+	if (n == 0)
+	{
+		fprintf(stderr, "HOST: %s is empty\n", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int host_map_bl_region(const char* font, const char* bootlogo)
+{
+	void* region;
+
+	region = mmap((void*)HOST_BL_REGION_START, HOST_BL_REGION_SIZE, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+	if (region != (void*)HOST_BL_REGION_START)
+	{
+		fprintf(stderr, "HOST: cannot map bootloader region at 0x%X\n", HOST_BL_REGION_START);
+		return 1;
+	}
+
+	if (host_load_region(font, HOST_FONT_OFFSET, HOST_FONT_SIZE_LIMIT))
+		return 1;
+
+	if (host_load_region(bootlogo, HOST_BOOTLOGO_OFFSET, HOST_BOOTLOGO_SIZE_LIMIT))
+		return 1;
+
+	return 0;
+}
+
+/* Store boot file path in MSC (creates MSC.img if missing) */
+static int host_set_boot_file(const char* boot_file)
+{
+	struct msc_command cmd;
+	char path[1024];
+	FILE* f;
+
+	snprintf(path, sizeof(path), "%s/MSC.img", host_cfg.partition_dir);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.next_boot_image = 0xFF;
+
+	f = fopen(path, "r+b");
+	if (f)
+	{
+		if (fread(&cmd, 1, sizeof(cmd), f) != sizeof(cmd))
+		{
+			memset(&cmd, 0, sizeof(cmd));
+			cmd.next_boot_image = 0xFF;
+		}
+	}
+	else
+	{
+		f = fopen(path, "w+b");
+		if (!f)
+			return 1;
+	}
+
+	snprintf(cmd.boot_file, sizeof(cmd.boot_file), "%s", boot_file);
+
+	fseek(f, 0, SEEK_SET);
+	fwrite(&cmd, 1, sizeof(cmd), f);
+
+	/* Pad to a sane partition size */
+	fseek(f, 0, SEEK_END);
+	if (ftell(f) < 0x100000)
+	{
+		fseek(f, 0x100000 - 1, SEEK_SET);
+		fputc(0, f);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+	        "Usage: %s [options]\n"
+	        "\n"
+	        "  -p, --partitions DIR    directory with <PARTITION>.img files (default .)\n"
+	        "  -k, --keys SCRIPT       key script, KEY[@MS][+HOLD],... KEY = up, down, rotation, power\n"
+	        "  -s, --screenshot FILE   dump framebuffer as PPM on refresh (%%d = frame number)\n"
+	        "  -i, --fastboot-in FILE  fastboot commands (- for stdin)\n"
+	        "  -o, --fastboot-out FILE fastboot replies (- for stdout)\n"
+	        "  -l, --log FILE          bootloader log (default stderr)\n"
+	        "  -b, --boot-file PATH    store boot file path into MSC (e.g. UBN:/boot/menu.lst)\n"
+	        "  -f, --font FILE         font image (default font.jpg)\n"
+	        "  -g, --bootlogo FILE     bootlogo image (default bootlogo.jpg)\n"
+	        "  -t, --idle MS           virtual idle time before giving up (default %d)\n"
+	        "  -r, --ram-base ADDR     ram base passed to the bootmenu\n"
+	        "  -L, --read-latency US   simulated block device latency per command\n"
+	        "  -D, --device MODEL      simulated block device, LATENCY_US[,BANDWIDTH_KIB[,SEEK_US]]\n"
+	        "  -R, --raw-io            ext2fs reads the eMMC sectors instead of the partitions\n"
+	        "  -S, --sdcard FILE       SD card image (whole disk, partitions are SD1, SD2, ...)\n",
+	        name, HOST_DEFAULT_IDLE_MS);
+}
+
+int main(int argc, char** argv)
+{
+	static const struct option options[] =
+	{
+		{ "partitions",   required_argument, NULL, 'p' },
+		{ "keys",         required_argument, NULL, 'k' },
+		{ "screenshot",   required_argument, NULL, 's' },
+		{ "fastboot-in",  required_argument, NULL, 'i' },
+		{ "fastboot-out", required_argument, NULL, 'o' },
+		{ "log",          required_argument, NULL, 'l' },
+		{ "boot-file",    required_argument, NULL, 'b' },
+		{ "font",         required_argument, NULL, 'f' },
+		{ "bootlogo",     required_argument, NULL, 'g' },
+		{ "idle",         required_argument, NULL, 't' },
+		{ "ram-base",     required_argument, NULL, 'r' },
+		{ "read-latency", required_argument, NULL, 'L' },
+		{ "device",       required_argument, NULL, 'D' },
+		{ "raw-io",       no_argument,       NULL, 'R' },
+		{ "sdcard",       required_argument, NULL, 'S' },
+		{ "help",         no_argument,       NULL, 'h' },
+		{ NULL,           0,                 NULL, 0   },
+	};
+
+	const char* keys = NULL;
+	const char* boot_file = NULL;
+	const char* font = "font.jpg";
+	const char* bootlogo = "bootlogo.jpg";
+	uint32_t ram_base = 0;
+	int c;
+
+	clock_gettime(CLOCK_MONOTONIC, &host_start_time);
+	host_cfg.log = stderr;
+
+	while ((c = getopt_long(argc, argv, "p:k:s:i:o:l:b:f:g:t:r:L:D:RS:h", options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'p': host_cfg.partition_dir = optarg; break;
+			case 'k': keys = optarg; break;
+			case 's': host_cfg.screenshot = optarg; break;
+			case 'i': host_cfg.fastboot_in = optarg; break;
+			case 'o': host_cfg.fastboot_out = optarg; break;
+			case 'b': boot_file = optarg; break;
+			case 'f': font = optarg; break;
+			case 'g': bootlogo = optarg; break;
+			case 't': host_cfg.idle_ms = strtoull(optarg, NULL, 0); break;
+			case 'r': ram_base = strtoul(optarg, NULL, 0); break;
+			case 'L': host_cfg.device.latency_us = strtoull(optarg, NULL, 0); break;
+			case 'R': ext2fs_set_io(NULL, EXT2FS_IO_RAW); break;
+			case 'S': host_cfg.sdcard = optarg; break;
+
+			case 'D':
+				if (host_device_parse(&host_cfg.device, optarg))
+				{
+					fprintf(stderr, "HOST: invalid device model \"%s\"\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'l':
+				host_cfg.log = fopen(optarg, "w");
+				if (!host_cfg.log)
+				{
+					fprintf(stderr, "HOST: cannot open log %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'h':
+				usage(argv[0]);
+				return 0;
+
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (keys && host_keys_parse(keys))
+	{
+		fprintf(stderr, "HOST: invalid key script \"%s\"\n", keys);
+		return 1;
+	}
+
+	if (host_cfg.fastboot_in || host_cfg.fastboot_out)
+	{
+		if (host_fastboot_open(host_cfg.fastboot_in ? host_cfg.fastboot_in : "-",
+		                       host_cfg.fastboot_out ? host_cfg.fastboot_out : "-"))
+		{
+			fprintf(stderr, "HOST: cannot open fastboot transport\n");
+			return 1;
+		}
+	}
+
+	if (boot_file && host_set_boot_file(boot_file))
+	{
+		fprintf(stderr, "HOST: cannot write boot file into MSC\n");
+		return 1;
+	}
+
+	if (host_map_bl_region(font, bootlogo))
+		return 1;
+
+	bootmenu_main(NULL, ram_base);
+	host_exit(0, "bootmenu returned");
+}
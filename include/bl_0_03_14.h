@@ -38,7 +38,8 @@
 #define SD_CARD_MAJOR     2
 #define HSMMC_MAJOR       3
 
-#ifdef __thumb__
+/* The host build (see host/) provides every routine, so expose them all */
+#if defined(__thumb__) || defined(BOOTMENU_HOST)
 
 #include "bootimg.h"
 
@@ -132,6 +133,9 @@ void get_serial_no(uint32_t* serial_no);
 /* Toggle vibrator */
 void toggle_vibrator(int state);
 
+/* Free running microsecond counter */
+uint32_t get_timer_us();
+
 /* Reboot */
 void reboot(void* global_handle);
 
@@ -0,0 +1,56 @@
+/*
+ * Acer bootloader boot menu application raw block device access
+ *
+ * Copyright (C) 2013 Skrilax_CZ
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+/*
+ * Partitions read straight from the eMMC or the SD card with multi-sector
+ * commands. BL partitions on the eMMC are located in its MBR / EBR chain once,
+ * SD card partitions are named SDn (n as in Linux, MBR or GPT).
+ */
+
+#define BLOCKDEV_SECTOR_SIZE    0x200
+#define BLOCKDEV_SECTOR_BITS    9
+
+/* Prefix of SD card partitions (e.g. SD1:/boot/zImage) */
+#define BLOCKDEV_SD_PREFIX      "SD"
+
+struct blockdev;
+
+/* SD card partition number of partition, 0 if it is a BL partition */
+int blockdev_sd_partition(const char* partition);
+
+/*
+ * Open partition, NULL if it can't be found. A BL partition must have the
+ * given size, for an SD card partition size is ignored.
+ */
+struct blockdev* blockdev_open(const char* partition, uint64_t size);
+
+/* Size of the partition in bytes */
+uint64_t blockdev_size(struct blockdev* dev);
+
+/* Read len bytes at byte offset pos of the partition, 0 on success */
+int blockdev_read(struct blockdev* dev, uint64_t pos, uint32_t len, void* buf);
+
+void blockdev_close(struct blockdev* dev);
+
+#endif //!BLOCKDEV_H
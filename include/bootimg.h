@@ -76,6 +76,9 @@ struct boot_img_hdr
 **    else: jump to kernel_addr
 */
 
+/* Allocate the page aligned image for kernel_size and ramdisk_size and fill in the header, kernel and ramdisk receive the payload locations */
+int alloc_android_image(struct boot_img_hdr** bootimg, int* bootimg_size, char** kernel, int kernel_size, char** ramdisk, int ramdisk_size);
+
 /* The NVABoot kernel loading code is so awkward so it's easier to generate Android.mk on the fly and pass that as a structure */
 int create_android_image(struct boot_img_hdr** bootimg, int* bootimg_size, const char* kernel, int kernel_size, const char* ramdisk, int ramdisk_size);
 
@@ -23,6 +23,7 @@
 #define BOOTMENU_H
 
 #include "bootimg.h"
+#include "ext2fs.h"
 
 #define MSC_CMD_RECOVERY        "FOTA"
 #define MSC_CMD_FCTRY_RESET     "FactoryReset"
@@ -32,6 +33,14 @@
 #define MSC_SETTINGS_DEBUG_MODE  0x00000001
 #define MSC_SETTINGS_FORBID_EXT  0x00000002
 #define MSC_SETTINGS_SHOW_FB_REC 0x00000004
+#define MSC_SETTINGS_RAW_IO      0x00000008
+
+/*
+ * MSC partition layout:
+ * 0x00000 - MSC command
+ * 0x08000 - ext2fs boot block map (see ext2fs_loadboot)
+ * 0x10000 - compiled boot menu (bootloaderctl --compile-menu)
+ */
 
 /* MSC command */
 struct msc_command
@@ -107,8 +116,101 @@ struct boot_selection_item
 	char path_ramdisk[256];
 	char title[256];
 	char cmdline[512];
+
+	/* Entry of the compiled menu, -1 if none */
+	int compiled;
+};
+
+/* Menu file items */
+#define MENU_TITLE_PROP            "title"
+#define MENU_ANDROID_IMAGE_PROP    "android"
+#define MENU_ZIMAGE_PROP           "zImage"
+#define MENU_RAMDISK_PROP          "ramdisk"
+#define MENU_CMDLINE_PROP          "cmdline"
+
+/*
+ * Compiled boot menu: the menu file parsed in advance, with the physical extents
+ * of every file it boots. It is only used while the menu file and the boot files
+ * keep their inodes (number, size, mtime and generation).
+ */
+#define MSC_MENU_OFFSET            0x10000
+#define MSC_MENU_SIZE_LIMIT        0x10000
+#define MSC_MENU_MAGIC             0x554E454D
+#define MSC_MENU_VERSION           2
+#define MSC_MENU_MAX_ENTRIES       18
+
+/* Files of a compiled entry */
+#define MSC_MENU_FILE_ANDROID      0
+#define MSC_MENU_FILE_ZIMAGE       1
+#define MSC_MENU_FILE_RAMDISK      2
+#define MSC_MENU_FILES             3
+
+/* Extent flags */
+#define MSC_MENU_EXTENT_UNWRITTEN  0x00000001
+
+/* Physical extent, offsets are in bytes (physical is from the partition start) */
+struct msc_menu_extent
+{
+	uint64_t physical;
+	uint32_t logical;
+	uint32_t length;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/* File referenced by the compiled menu (ino 0 if not present) */
+struct msc_menu_file
+{
+	uint32_t ino;
+	uint32_t size;
+	uint32_t mtime;
+	uint32_t ctime;
+	uint32_t generation;
+	uint32_t first_extent;
+	uint32_t num_extents;
+};
+
+struct msc_menu_entry
+{
+	char title[256];
+	char path[MSC_MENU_FILES][256];
+	char cmdline[512];
+	struct msc_menu_file files[MSC_MENU_FILES];
 };
 
+/* Extents follow the header at extents_offset */
+struct msc_menu_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t checksum;
+
+	/* Menu file it was compiled from (BL format) and its inode */
+	char boot_file[256];
+	struct msc_menu_file menu;
+
+	/* Titles from the LNX, AKB and SOS sections (empty if not set) */
+	char lnx_title[256];
+	char akb_title[256];
+	char sos_title[256];
+
+	uint32_t num_entries;
+	uint32_t num_extents;
+	uint32_t extents_offset;
+	uint32_t reserved;
+
+	struct msc_menu_entry entries[MSC_MENU_MAX_ENTRIES];
+};
+
+/* Checksum of everything after the checksum field, written by bootloaderctl */
+static inline uint32_t msc_menu_checksum(const struct msc_menu_header* menu)
+{
+	const uint8_t* ptr = (const uint8_t*)&menu->checksum + sizeof(menu->checksum);
+
+	return ext2fs_hash_bytes(EXT2FS_HASH_INIT, ptr, (const uint8_t*)menu + menu->size - ptr);
+}
+
 /* GPIO key descriptors */
 struct gpio_key
 {
@@ -187,6 +289,9 @@ int akb_contains_boot_image();
 /* Load boot images */
 int load_boot_images(struct boot_selection_item* boot_items, struct boot_menu_item* menu_items, int max_items, char* recovery_name, int recovery_name_size);
 
+/* Invalidate loaded boot images (boot file changed) */
+void invalidate_boot_images(void);
+
 /* Show interactive boot selection */
 void boot_interactively(unsigned char initial_selection, int force_initial, int no_fastboot, const char* message, const char* error,
                         uint32_t ram_base, char* error_message, int error_message_size);
@@ -36,9 +36,92 @@ int ext2fs_open(const char* filename);
 int ext2fs_read(char* buf, unsigned int len);
 int ext2fs_seek(int pos);
 int ext2fs_gets(char* buf, int bufsize);
+int ext2fs_getline(char** line);
 int ext2fs_close(void);
 int ext2fs_mount(const char* partition);
 int ext2fs_unmount(void);
+int ext2fs_invalidate(const char* partition);
+
+/* Device access of a mount */
+#define EXT2FS_IO_PARTITION    0
+#define EXT2FS_IO_RAW          1
+
+int ext2fs_set_io(const char* partition, int io);
 int ext2fs_loadfile(char** data, int* size, const char* path);
 
+/*
+ * Line iterator (ext2fs_fgetline): returns the length of the next line including
+ * its '\n' and points line at it, 0 at the end of the file and -1 on error. The
+ * line is not terminated, it stays valid until the next call on the file and may
+ * be modified in place. Longer lines are split.
+ */
+#define EXT2FS_LINE_MAX        1024
+
+/* File descriptor API, paths are in BL format (PARTITION:path) */
+int ext2fs_fopen(const char* path);
+int ext2fs_fread(int fd, char* buf, unsigned int len);
+int ext2fs_fseek(int fd, int pos);
+int ext2fs_fgets(int fd, char* buf, int bufsize);
+int ext2fs_fgetline(int fd, char** line);
+int ext2fs_fsize(int fd);
+int ext2fs_fclose(int fd);
+
+/* Readahead of the runs following the read position, for files read sequentially */
+#define EXT2FS_RA_TEXT_SLOTS   2
+#define EXT2FS_RA_TEXT_CHUNK   0x2000
+
+int ext2fs_freadahead(int fd, int slots, unsigned int chunk);
+
+/* Inode of a file, for checking it is unchanged */
+struct ext2fs_stat
+{
+	unsigned int ino;
+	unsigned int size;
+	unsigned int mtime;
+	unsigned int ctime;
+	unsigned int generation;
+	unsigned int nlinks;
+};
+
+int ext2fs_fstat(int fd, struct ext2fs_stat* st);
+int ext2fs_stat_ino(const char* partition, unsigned int ino, struct ext2fs_stat* st);
+int ext2fs_map_ino(const char* partition, unsigned int ino, unsigned int pos, uint64_t* offset, unsigned int* len);
+
+/* FNV-1a, for check values of records kept on MSC (shared with bootloaderctl) */
+#define EXT2FS_HASH_INIT       2166136261U
+
+static inline uint32_t ext2fs_hash_bytes(uint32_t hash, const void* buf, int len)
+{
+	const uint8_t* ptr = buf;
+
+	while (len-- > 0)
+	{
+		hash ^= *ptr++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+/* Batch loading, the files are read in a single pass ordered by disk position */
+struct ext2fs_load_item
+{
+	const char* path;
+	char* data;
+	int size;
+};
+
+/* Allocates the buffers */
+int ext2fs_loadfiles(struct ext2fs_load_item* items, int count);
+
+/* Buffer allocator for ext2fs_loadboot, item sizes are set, fills in item data */
+typedef int (*ext2fs_alloc_t)(struct ext2fs_load_item* items, int count, void* arg);
+
+/*
+ * Boot files, the block map is kept on MSC so that unchanged files are read without
+ * walking the filesystem. Without alloc the buffers are malloced, with alloc they
+ * remain with the caller on failure.
+ */
+int ext2fs_loadboot(struct ext2fs_load_item* items, int count, ext2fs_alloc_t alloc, void* arg);
+
 #endif //!EXT2FS_H
@@ -0,0 +1,84 @@
+/*
+ * Acer bootloader boot menu application I/O accounting
+ *
+ * Copyright (C) 2013 Skrilax_CZ
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef IOSTATS_H
+#define IOSTATS_H
+
+/* Request streams */
+#define IOSTATS_PARTITION_READ   0   /* BL partition API */
+#define IOSTATS_PARTITION_WRITE  1
+#define IOSTATS_EMMC_READ        2   /* hsmmc sector reads (blockdev) */
+#define IOSTATS_SD_READ          3   /* SD card sector reads (blockdev) */
+#define IOSTATS_EXT2FS_READ      4   /* ext2fs device reads, whatever the backend */
+#define IOSTATS_STREAMS          5
+
+/* Caches */
+#define IOSTATS_CACHE_BLOCK      0   /* ext2fs metadata blocks */
+#define IOSTATS_CACHE_DENTRY     1   /* ext2fs directory entries */
+#define IOSTATS_CACHE_SD         2   /* SD card sectors */
+#define IOSTATS_CACHES           3
+
+/* Request size histogram: up to 512 B, 4 KiB, 32 KiB, 256 KiB, 1 MiB and larger */
+#define IOSTATS_SIZE_BUCKETS     6
+
+struct iostats_stream
+{
+	uint32_t calls;
+	uint64_t bytes;
+	uint32_t seeks;        /* requests not continuing the previous one */
+	uint32_t time_us;
+	uint32_t sizes[IOSTATS_SIZE_BUCKETS];
+};
+
+struct iostats_cache
+{
+	uint32_t hits;
+	uint32_t misses;
+};
+
+struct iostats
+{
+	struct iostats_stream stream[IOSTATS_STREAMS];
+	struct iostats_cache cache[IOSTATS_CACHES];
+};
+
+extern struct iostats iostats;
+
+/* Account a request started at start_us (from get_timer_us) */
+void iostats_add(int stream, uint32_t bytes, int seek, uint32_t start_us);
+
+#define iostats_hit(c)       (iostats.cache[c].hits++)
+#define iostats_miss(c)      (iostats.cache[c].misses++)
+
+/* Partition API with accounting, same semantics as the BL functions */
+int iostats_set_partition_position(int partition_handle, int64_t offset, int origin);
+int iostats_read_partition(int partition_handle, void* buffer, uint32_t buffer_length, uint32_t* processed_bytes);
+int iostats_write_partition(int partition_handle, void* buffer, uint32_t data_size, uint32_t* processed_bytes);
+
+/* Text of report line (0 on success, 1 past the last line) */
+int iostats_format(int line, char* buffer, int size);
+
+/* Report to the log */
+void iostats_print(void);
+
+void iostats_reset(void);
+
+#endif //!IOSTATS_H
@@ -0,0 +1,145 @@
+/*
+ * Acer bootloader boot menu application I/O accounting
+ *
+ * Copyright (C) 2013 Skrilax_CZ
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "bl_0_03_14.h"
+#include "mystdlib.h"
+#include "iostats.h"
+
+struct iostats iostats;
+
+/* Position was set since the last partition request */
+static int iostats_partition_seek = 0;
+
+static const char* iostats_stream_names[IOSTATS_STREAMS] =
+{
+	"partition read",
+	"partition write",
+	"eMMC read",
+	"SD read",
+	"ext2fs read",
+};
+
+static const char* iostats_cache_names[IOSTATS_CACHES] =
+{
+	"ext2fs block",
+	"ext2fs dentry",
+	"SD sector",
+};
+
+static int iostats_size_bucket(uint32_t bytes)
+{
+	if (bytes <= 0x200)
+		return 0;
+	else if (bytes <= 0x1000)
+		return 1;
+	else if (bytes <= 0x8000)
+		return 2;
+	else if (bytes <= 0x40000)
+		return 3;
+	else if (bytes <= 0x100000)
+		return 4;
+	else
+		return 5;
+}
+
+/* Account a request started at start_us (from get_timer_us) */
+void iostats_add(int stream, uint32_t bytes, int seek, uint32_t start_us)
+{
+	struct iostats_stream* s = &iostats.stream[stream];
+
+	s->calls++;
+	s->bytes += bytes;
+	s->time_us += get_timer_us() - start_us;
+	s->sizes[iostats_size_bucket(bytes)]++;
+
+	if (seek)
+		s->seeks++;
+}
+
+int iostats_set_partition_position(int partition_handle, int64_t offset, int origin)
+{
+	iostats_partition_seek = 1;
+	return set_partition_position(partition_handle, offset, origin);
+}
+
+int iostats_read_partition(int partition_handle, void* buffer, uint32_t buffer_length, uint32_t* processed_bytes)
+{
+	uint32_t start_us = get_timer_us();
+	int ret;
+
+	ret = read_partition(partition_handle, buffer, buffer_length, processed_bytes);
+	iostats_add(IOSTATS_PARTITION_READ, *processed_bytes, iostats_partition_seek, start_us);
+	iostats_partition_seek = 0;
+	return ret;
+}
+
+int iostats_write_partition(int partition_handle, void* buffer, uint32_t data_size, uint32_t* processed_bytes)
+{
+	uint32_t start_us = get_timer_us();
+	int ret;
+
+	ret = write_partition(partition_handle, buffer, data_size, processed_bytes);
+	iostats_add(IOSTATS_PARTITION_WRITE, *processed_bytes, iostats_partition_seek, start_us);
+	iostats_partition_seek = 0;
+	return ret;
+}
+
+/* Text of report line (0 on success, 1 past the last line) */
+int iostats_format(int line, char* buffer, int size)
+{
+	struct iostats_stream* s;
+	struct iostats_cache* c;
+
+	if (line < IOSTATS_STREAMS)
+	{
+		s = &iostats.stream[line];
+		snprintf(buffer, size, "%s: %u calls, %u KiB, %u seeks, %u us, sizes %u/%u/%u/%u/%u/%u",
+		         iostats_stream_names[line], s->calls, (uint32_t)(s->bytes >> 10), s->seeks, s->time_us,
+		         s->sizes[0], s->sizes[1], s->sizes[2], s->sizes[3], s->sizes[4], s->sizes[5]);
+		return 0;
+	}
+
+	line -= IOSTATS_STREAMS;
+	if (line < IOSTATS_CACHES)
+	{
+		c = &iostats.cache[line];
+		snprintf(buffer, size, "%s cache: %u hits, %u misses", iostats_cache_names[line], c->hits, c->misses);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Report to the log */
+void iostats_print(void)
+{
+	char buffer[160];
+	int i;
+
+	for (i = 0; !iostats_format(i, buffer, ARRAY_SIZE(buffer)); i++)
+		printf("IOSTATS: %s\n", buffer);
+}
+
+void iostats_reset(void)
+{
+	memset(&iostats, 0, sizeof(iostats));
+	iostats_partition_seek = 0;
+}